@@ -0,0 +1,998 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * benchmark.c - classifier datapath benchmark
+ *
+ * Loads private (unpinned) copies of the classifier with different load-time
+ * flags and feature sets, reports the instruction count left after the
+ * verifier's dead code elimination and measures the per-packet cost with
+ * BPF_PROG_TEST_RUN. The same flow is replayed on every online CPU at once,
+ * so contention on shared flow records shows up in the numbers just like
+ * with a multi-queue NIC. Before the modes are measured, both directions of
+ * a TCP connection are fed through the classifier to check that they update
+ * a single flow record, and a flow that changes behaviour is replayed in real
+ * time to show how quickly its class follows with and without decaying
+ * feature counters. In per-CPU mode the packets counted by the shards and
+ * reported by the idle flow sweeper must add up to the packets injected on
+ * all CPUs, and the throughput of both flow statistics modes is compared.
+ *
+ * benchmark_dns_run() measures domain rule lookups per second of the compiled
+ * matcher against the old linear fnmatch/regexec scan for growing rule sets,
+ * then the DNS capture path: responses are fed through the ingress program,
+ * drained from its dns_events ring buffer and parsed like in the daemon.
+ */
+#define _GNU_SOURCE
+#include "common.h"
+#include <fnmatch.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+
+#define BENCH_PAYLOAD_LEN   64
+#define BENCH_PREFIXES      4096
+
+/* 待比较的加载模式 */
+static const struct {
+    const char *name;
+    uint32_t flags;
+    uint32_t features;
+    bool cache;
+    bool prefix;
+} bench_modes[] = {
+    { "shared-nocache", 0, FEATURE_ALL, false, false },
+    { "shared", 0, FEATURE_ALL, true, false },
+    { "percpu", IDCLASS_PERCPU_STATS, FEATURE_ALL, true, false },
+    { "minimal-nocache", 0, FEATURE_PKTLEN, false, false },
+    { "minimal", 0, FEATURE_PKTLEN, true, false },
+    { "minimal-prefix", 0, FEATURE_PKTLEN, true, true },
+};
+
+struct bench_thread {
+    pthread_t thread;
+    int cpu;
+    int prog_fd;
+    unsigned int iterations;
+    uint32_t duration;
+    int err;
+};
+
+static struct {
+    struct ethhdr eth;
+    struct iphdr ip;
+    struct udphdr udp;
+    uint8_t payload[BENCH_PAYLOAD_LEN];
+} __attribute__((packed)) bench_pkt;
+
+/* 构造一个 UDP/IPv4 测试包（上行方向，目的地址命中 ipv4_map 或其 /24 前缀） */
+static void bench_build_packet(void) {
+    memset(&bench_pkt, 0, sizeof(bench_pkt));
+    bench_pkt.eth.h_proto = htons(ETH_P_IP);
+    bench_pkt.ip.version = 4;
+    bench_pkt.ip.ihl = 5;
+    bench_pkt.ip.ttl = 64;
+    bench_pkt.ip.protocol = IPPROTO_UDP;
+    bench_pkt.ip.tot_len = htons(sizeof(bench_pkt) - sizeof(bench_pkt.eth));
+    inet_pton(AF_INET, "198.51.100.1", &bench_pkt.ip.saddr);
+    inet_pton(AF_INET, "192.0.2.1", &bench_pkt.ip.daddr);
+    bench_pkt.udp.source = htons(40000);
+    bench_pkt.udp.dest = htons(3074);
+    bench_pkt.udp.len = htons(sizeof(bench_pkt.udp) + BENCH_PAYLOAD_LEN);
+}
+
+static int bench_map_fd(struct bpf_object *obj, const char *name) {
+    struct bpf_map *map = bpf_object__find_map_by_name(obj, name);
+    return map ? bpf_map__fd(map) : -1;
+}
+
+/*
+ * 把测试包目的地址所在的 /24 放进 ipv4_prefix_map，另加 BENCH_PREFIXES 个
+ * 不相关的网段，让 trie 有接近真实规则集的深度
+ */
+static int bench_setup_prefixes(struct bpf_object *obj, const struct idclass_ip_map_val *val) {
+    struct idclass_lpm4_key key = { .prefixlen = 24 };
+    struct idclass_ip_map_val other = { .dscp = 0 };
+    uint32_t i;
+    int fd;
+
+    if ((fd = bench_map_fd(obj, "ipv4_prefix_map")) < 0)
+        return -1;
+
+    for (i = 0; i < BENCH_PREFIXES; i++) {
+        key.addr = htonl(0x0a000000 | (i << 8));
+        if (bpf_map_update_elem(fd, &key, &other, BPF_ANY))
+            return -1;
+    }
+
+    key.addr = bench_pkt.ip.daddr & htonl(0xffffff00);
+    return bpf_map_update_elem(fd, &key, val, BPF_ANY);
+}
+
+/* 填充最小可用配置：一个启用给定特征的类，测试包目的地址指向该类 */
+static int bench_setup_maps(struct bpf_object *obj, uint32_t features, bool cache,
+                            bool prefix) {
+    struct global_config gcfg = { .dscp_icmp = 0xff };
+    struct idclass_class class = {
+        .flags = IDCLASS_CLASS_FLAG_PRESENT,
+        .config = IDCLASS_FLOW_CONFIG_DEFAULT,
+    };
+    struct idclass_flow_config cfg;
+    struct idclass_ip_map_val ip_val = { .dscp = IDCLASS_DSCP_CLASS_FLAG };
+    struct blob_buf b = {};
+    uint32_t key = 0, i;
+    int fd;
+
+    /* 与守护进程默认值一致：每 16 包或 100ms 重新评分 */
+    if (cache) {
+        gcfg.rescore_ms = 100;
+        gcfg.rescore_pkt_mask = 15;
+    }
+    if (prefix)
+        gcfg.prefix_maps = IDCLASS_PREFIX_IPV4;
+
+    blob_buf_init(&b, 0);
+    config_parse_flow_config(&cfg, b.head, true);
+    blob_buf_free(&b);
+    cfg.feature_mask = features;
+
+    /* 第 0 代，与 gcfg.config_gen 一致 */
+    key = IDCLASS_FLOW_CONFIG_DEFAULT;
+    if ((fd = bench_map_fd(obj, "flow_config_map")) < 0 ||
+        bpf_map_update_elem(fd, &key, &cfg, BPF_ANY))
+        return -1;
+
+    key = 0;
+    if ((fd = bench_map_fd(obj, "global_config")) < 0 ||
+        bpf_map_update_elem(fd, &key, &gcfg, BPF_ANY))
+        return -1;
+
+    if ((fd = bench_map_fd(obj, "class_map")) < 0 ||
+        bpf_map_update_elem(fd, &key, &class, BPF_ANY))
+        return -1;
+
+    /* 前缀模式下 hash 查找落空，再走 trie */
+    if (prefix) {
+        if (bench_setup_prefixes(obj, &ip_val))
+            return -1;
+    } else if ((fd = bench_map_fd(obj, "ipv4_map")) < 0 ||
+               bpf_map_update_elem(fd, &bench_pkt.ip.daddr, &ip_val, BPF_ANY)) {
+        return -1;
+    }
+
+    for (i = 0; i < 4; i++) {
+        uint32_t class_id = i + 1;
+        if ((fd = bench_map_fd(obj, "prio_class_up")) >= 0)
+            bpf_map_update_elem(fd, &i, &class_id, BPF_ANY);
+        if ((fd = bench_map_fd(obj, "prio_class_down")) >= 0)
+            bpf_map_update_elem(fd, &i, &class_id, BPF_ANY);
+        if ((fd = bench_map_fd(obj, "class_mark")) >= 0)
+            bpf_map_update_elem(fd, &class_id, &class_id, BPF_ANY);
+    }
+
+    return 0;
+}
+
+/* 校验器裁剪后的指令数 */
+static uint32_t bench_prog_insns(int prog_fd) {
+    struct bpf_prog_info info = {};
+    uint32_t len = sizeof(info);
+
+    if (bpf_obj_get_info_by_fd(prog_fd, &info, &len))
+        return 0;
+    return info.xlated_prog_len / sizeof(struct bpf_insn);
+}
+
+static void *bench_thread_cb(void *arg) {
+    struct bench_thread *t = arg;
+    DECLARE_LIBBPF_OPTS(bpf_test_run_opts, opts,
+        .data_in = &bench_pkt,
+        .data_size_in = sizeof(bench_pkt),
+        .repeat = t->iterations,
+    );
+    cpu_set_t set;
+
+    CPU_ZERO(&set);
+    CPU_SET(t->cpu, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+
+    t->err = bpf_prog_test_run_opts(t->prog_fd, &opts);
+    t->duration = opts.duration;
+    return NULL;
+}
+
+/* 在 ncpus 个 CPU 上并发运行，返回平均每包耗时（纳秒） */
+static int bench_run_mode(int prog_fd, int ncpus, unsigned int iterations,
+                          uint32_t *ns_per_pkt) {
+    struct bench_thread *threads;
+    uint64_t total = 0;
+    int i, ret = 0;
+
+    threads = calloc(ncpus, sizeof(*threads));
+    if (!threads)
+        return -1;
+
+    for (i = 0; i < ncpus; i++) {
+        threads[i].cpu = i;
+        threads[i].prog_fd = prog_fd;
+        threads[i].iterations = iterations;
+        if (pthread_create(&threads[i].thread, NULL, bench_thread_cb, &threads[i])) {
+            ncpus = i;
+            ret = -1;
+            break;
+        }
+    }
+
+    for (i = 0; i < ncpus; i++) {
+        pthread_join(threads[i].thread, NULL);
+        if (threads[i].err)
+            ret = -1;
+        total += threads[i].duration;
+    }
+    free(threads);
+
+    if (ncpus)
+        *ns_per_pkt = total / ncpus;
+    return ret;
+}
+
+/* TCP 报文（双向流键检查用） */
+static struct {
+    struct ethhdr eth;
+    struct iphdr ip;
+    struct tcphdr tcp;
+} __attribute__((packed)) bench_tcp_pkt;
+
+static void bench_build_tcp_packet(bool reply) {
+    const char *client = "198.51.100.1", *server = "192.0.2.1";
+
+    memset(&bench_tcp_pkt, 0, sizeof(bench_tcp_pkt));
+    bench_tcp_pkt.eth.h_proto = htons(ETH_P_IP);
+    bench_tcp_pkt.ip.version = 4;
+    bench_tcp_pkt.ip.ihl = 5;
+    bench_tcp_pkt.ip.ttl = 64;
+    bench_tcp_pkt.ip.protocol = IPPROTO_TCP;
+    bench_tcp_pkt.ip.tot_len = htons(sizeof(bench_tcp_pkt) - sizeof(bench_tcp_pkt.eth));
+    inet_pton(AF_INET, reply ? server : client, &bench_tcp_pkt.ip.saddr);
+    inet_pton(AF_INET, reply ? client : server, &bench_tcp_pkt.ip.daddr);
+    bench_tcp_pkt.tcp.source = htons(reply ? 443 : 40000);
+    bench_tcp_pkt.tcp.dest = htons(reply ? 40000 : 443);
+    bench_tcp_pkt.tcp.doff = 5;
+    bench_tcp_pkt.tcp.syn = 1;
+    bench_tcp_pkt.tcp.ack = reply;
+    bench_tcp_pkt.tcp.window = htons(65535);
+}
+
+/*
+ * 一个 TCP 连接的请求经 egress 程序、应答经 ingress 程序各过一次（两个
+ * 程序共享同一组 map），两个方向必须落在同一条流记录中（记录数为 1，
+ * 包数为 2）
+ */
+static int bench_check_flow_key(void) {
+    DECLARE_LIBBPF_OPTS(bpf_test_run_opts, opts,
+        .data_in = &bench_tcp_pkt,
+        .data_size_in = sizeof(bench_tcp_pkt),
+        .repeat = 1,
+    );
+    struct flow_key key, next_key;
+    struct flow_stats stats = {};
+    struct bpf_object *obj, *obj_in = NULL;
+    void *prev = NULL;
+    uint32_t flows = 0;
+    int prog_fd[2], fd, i, ret = -1;
+
+    obj = ebpf_loader_open_private(0, FEATURE_ALL, NULL, &prog_fd[0]);
+    if (!obj)
+        return -1;
+    obj_in = ebpf_loader_open_private(IDCLASS_INGRESS, FEATURE_ALL, obj, &prog_fd[1]);
+    if (!obj_in)
+        goto out;
+    if (bench_setup_maps(obj, FEATURE_ALL, false, false))
+        goto out;
+
+    for (i = 0; i < 2; i++) {
+        bench_build_tcp_packet(i);
+        if (bpf_prog_test_run_opts(prog_fd[i], &opts))
+            goto out;
+    }
+
+    if ((fd = bench_map_fd(obj, "flow_stats_map")) < 0)
+        goto out;
+    while (bpf_map_get_next_key(fd, prev, &next_key) == 0) {
+        flows++;
+        key = next_key;
+        prev = &key;
+    }
+    if (flows == 1)
+        bpf_map_lookup_elem(fd, &key, &stats);
+
+    printf("flow key: %zu bytes, %u record(s), %u packets for both directions: %s\n",
+           sizeof(struct flow_key), flows, stats.packets,
+           flows == 1 && stats.packets == 2 ? "ok" : "FAILED");
+    if (flows == 1 && stats.packets == 2)
+        ret = 0;
+
+out:
+    bpf_object__close(obj_in);
+    bpf_object__close(obj);
+    return ret;
+}
+
+#define BENCH_REPLAY_RST        200     /* 第一阶段的 RST 包数 */
+#define BENCH_REPLAY_MAX        4000    /* 第二阶段最多重放的包数 */
+#define BENCH_REPLAY_GAP_US     1000
+#define BENCH_REPLAY_SHIFT      6       /* 衰减周期 64ms */
+
+/*
+ * 实时重放一次行为变化：同一条 TCP 流先连续发 BENCH_REPLAY_RST 个 RST
+ * （RST 比例高，判为 bulk），再每毫秒发一个纯 ACK，记录分类离开 bulk
+ * 之前的包数和毫秒数（没有离开时包数为 0）。只启用 FEATURE_TCPFLAGS，
+ * 门限降到其权重，判定只取决于衰减后的标志比例。
+ */
+static int bench_replay(uint8_t window_shift, uint32_t *packets, uint32_t *ms) {
+    DECLARE_LIBBPF_OPTS(bpf_test_run_opts, opts,
+        .data_in = &bench_tcp_pkt,
+        .data_size_in = sizeof(bench_tcp_pkt),
+        .repeat = 1,
+    );
+    struct global_config gcfg = { .dscp_icmp = 0xff, .window_shift = window_shift };
+    struct idclass_flow_config cfg;
+    struct flow_stats stats = {};
+    struct flow_key key;
+    struct bpf_object *obj;
+    struct timespec ts;
+    uint32_t i, cfg_key = IDCLASS_FLOW_CONFIG_DEFAULT, gcfg_key = 0;
+    uint64_t start;
+    int prog_fd, fd, ret = -1;
+
+    *packets = *ms = 0;
+    obj = ebpf_loader_open_private(0, FEATURE_TCPFLAGS, NULL, &prog_fd);
+    if (!obj)
+        return -1;
+    if (bench_setup_maps(obj, FEATURE_TCPFLAGS, false, false) ||
+        (fd = bench_map_fd(obj, "flow_config_map")) < 0 ||
+        bpf_map_lookup_elem(fd, &cfg_key, &cfg))
+        goto out;
+    cfg.score_threshold = cfg.weight_tcpflags_bulk;
+    if (bpf_map_update_elem(fd, &cfg_key, &cfg, BPF_ANY) ||
+        (fd = bench_map_fd(obj, "global_config")) < 0 ||
+        bpf_map_update_elem(fd, &gcfg_key, &gcfg, BPF_ANY))
+        goto out;
+
+    bench_build_tcp_packet(false);
+    bench_tcp_pkt.tcp.syn = 0;
+    bench_tcp_pkt.tcp.ack = 1;
+    bench_tcp_pkt.tcp.rst = 1;
+    for (i = 0; i < BENCH_REPLAY_RST; i++) {
+        if (bpf_prog_test_run_opts(prog_fd, &opts))
+            goto out;
+    }
+
+    if ((fd = bench_map_fd(obj, "flow_stats_map")) < 0 ||
+        bpf_map_get_next_key(fd, NULL, &key) ||
+        bpf_map_lookup_elem(fd, &key, &stats) || stats.verdict_prio != 3) {
+        fprintf(stderr, "replay: RST phase did not classify as bulk\n");
+        goto out;
+    }
+
+    bench_tcp_pkt.tcp.rst = 0;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    start = ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+    for (i = 1; i <= BENCH_REPLAY_MAX; i++) {
+        usleep(BENCH_REPLAY_GAP_US);
+        if (bpf_prog_test_run_opts(prog_fd, &opts) ||
+            bpf_map_lookup_elem(fd, &key, &stats))
+            goto out;
+        if (stats.verdict_prio != 3) {
+            clock_gettime(CLOCK_MONOTONIC, &ts);
+            *packets = i;
+            *ms = (ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000 - start) / 1000;
+            break;
+        }
+    }
+    ret = 0;
+
+out:
+    bpf_object__close(obj);
+    return ret;
+}
+
+/* 衰减计数器下重新分类必须在重放结束前发生，累计计数器的结果仅作对照 */
+static int bench_check_reclassify(void) {
+    static const uint8_t shifts[] = { 0, BENCH_REPLAY_SHIFT };
+    uint32_t packets, ms;
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(shifts); i++) {
+        if (bench_replay(shifts[i], &packets, &ms))
+            return -1;
+        if (shifts[i])
+            printf("reclassify, %u ms window: ", 1U << shifts[i]);
+        else
+            printf("reclassify, lifetime counters: ");
+        if (packets)
+            printf("left bulk after %u packets, %u ms\n", packets, ms);
+        else
+            printf("still bulk after %u packets\n", BENCH_REPLAY_MAX);
+        if (shifts[i] && !packets)
+            return -1;
+    }
+    return 0;
+}
+
+/* 改为对齐布局之前的流记录（packed，每包更新的字段散布在三个 cache line） */
+struct bench_flow_packed {
+    uint64_t packets;
+    uint64_t bytes;
+    uint32_t avg_pkt_len;
+    uint64_t first_seen;
+    uint64_t last_seen;
+    uint32_t pps;
+    uint64_t last_pps_ts;
+    uint32_t packets_in_window;
+    uint32_t burst_packets;
+    uint32_t burst_bytes;
+    uint64_t burst_start_ts;
+    uint32_t syn_count, ack_count, fin_count, rst_count, retrans_count;
+    uint64_t tcp_seq;
+    uint8_t fin_rst_seen;
+    uint64_t up_bytes;
+    uint64_t down_bytes;
+    uint64_t last_pkt_ts;
+    uint32_t iat_us;
+    uint8_t client_ip[16];
+    uint8_t client_family;
+    uint64_t max_seq;
+    uint16_t tcp_window;
+    uint16_t tcp_mss;
+    uint32_t tcp_rtt_us;
+    uint32_t tcp_rtt_var_us;
+} __attribute__((packed));
+
+#define BENCH_LAYOUT_FLOWS      65536
+#define BENCH_LAYOUT_PACKETS    (16 * BENCH_LAYOUT_FLOWS)
+
+static uint64_t bench_now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * 流记录布局的前后对比：在与 flow_stats_map 同样多的流上随机更新每包
+ * 访问的字段，表太大放不进缓存，耗时主要取决于每包碰到几个 cache line
+ */
+static void bench_layout(void) {
+    struct bench_flow_packed *old = calloc(BENCH_LAYOUT_FLOWS, sizeof(*old));
+    struct flow_stats *new = calloc(BENCH_LAYOUT_FLOWS, sizeof(*new));
+    uint64_t start, old_ns, new_ns;
+    uint32_t i, r;
+
+    if (!old || !new)
+        goto out;
+    /* 先触发缺页，不计入测量 */
+    memset(old, 0, BENCH_LAYOUT_FLOWS * sizeof(*old));
+    memset(new, 0, BENCH_LAYOUT_FLOWS * sizeof(*new));
+
+    r = 1;
+    start = bench_now_ns();
+    for (i = 0; i < BENCH_LAYOUT_PACKETS; i++) {
+        struct bench_flow_packed *f;
+
+        r = r * 1103515245 + 12345;
+        f = &old[(r >> 8) % BENCH_LAYOUT_FLOWS];
+        f->packets++;
+        f->bytes += 100;
+        f->avg_pkt_len = (f->avg_pkt_len * 7 + 100) / 8;
+        f->last_seen = i;
+        f->packets_in_window++;
+        f->burst_packets++;
+        f->burst_bytes += 100;
+        f->up_bytes += 100;
+        f->iat_us = i - f->last_pkt_ts;
+        f->last_pkt_ts = i;
+    }
+    old_ns = bench_now_ns() - start;
+
+    r = 1;
+    start = bench_now_ns();
+    for (i = 0; i < BENCH_LAYOUT_PACKETS; i++) {
+        struct flow_stats *f;
+
+        r = r * 1103515245 + 12345;
+        f = &new[(r >> 8) % BENCH_LAYOUT_FLOWS];
+        f->packets++;
+        f->bytes += 100;
+        f->avg_pkt_len = (f->avg_pkt_len * 7 + 100) / 8;
+        f->iat_us = i - f->last_seen;
+        f->last_seen = i;
+        f->packets_in_window++;
+        f->burst_packets++;
+        f->burst_bytes += 100;
+        f->up_bytes += 100;
+    }
+    new_ns = bench_now_ns() - start;
+
+    printf("flow layout: packed %zu bytes %.1f ns/pkt, aligned %zu bytes "
+           "(%zu per-packet) %.1f ns/pkt\n",
+           sizeof(*old), (double)old_ns / BENCH_LAYOUT_PACKETS,
+           sizeof(*new), offsetof(struct flow_stats, verdict_ms),
+           (double)new_ns / BENCH_LAYOUT_PACKETS);
+out:
+    free(old);
+    free(new);
+}
+
+#define BENCH_PERCPU_PACKETS    100000
+
+static uint64_t bench_swept_packets;
+static uint32_t bench_swept_flows;
+
+static int bench_sweep_event_cb(void *ctx, void *data, size_t len) {
+    const struct idclass_event *ev = data;
+
+    if (len >= sizeof(*ev) && ev->type == IDCLASS_EV_FLOW_END) {
+        bench_swept_packets += ev->packets;
+        bench_swept_flows++;
+    }
+    return 0;
+}
+
+/*
+ * 每 CPU 模式：同一条流在所有 CPU 上各注入 BENCH_PERCPU_PACKETS 个包，
+ * 各分片之和与 flow_sweep 删除该流时上报的包数都必须等于注入的包数
+ */
+static int bench_check_percpu(int ncpus) {
+    static uint8_t sweep_pkt[ETH_HLEN];
+    DECLARE_LIBBPF_OPTS(bpf_test_run_opts, sweep_opts,
+        .data_in = sweep_pkt,
+        .data_size_in = sizeof(sweep_pkt),
+        .repeat = 1,
+    );
+    size_t stride = (sizeof(struct flow_stats) + 7) & ~7;
+    uint64_t injected = (uint64_t)ncpus * BENCH_PERCPU_PACKETS, counted = 0;
+    int possible = libbpf_num_possible_cpus();
+    struct global_config gcfg;
+    struct ring_buffer *rb = NULL;
+    struct bpf_program *sweep;
+    struct bpf_object *obj;
+    struct flow_key key;
+    uint32_t zero = 0, ns;
+    void *shards = NULL;
+    int prog_fd, fd, i, ret = -1;
+
+    obj = ebpf_loader_open_private(IDCLASS_PERCPU_STATS, FEATURE_ALL, NULL, &prog_fd);
+    if (!obj)
+        return -1;
+    sweep = bpf_object__find_program_by_name(obj, "flow_sweep");
+    shards = calloc(possible > 0 ? possible : 1, stride);
+    if (!sweep || !shards ||
+        bench_setup_maps(obj, FEATURE_ALL, true, false) ||
+        bench_run_mode(prog_fd, ncpus, BENCH_PERCPU_PACKETS, &ns))
+        goto out;
+
+    if ((fd = bench_map_fd(obj, "flow_stats_percpu")) < 0 ||
+        bpf_map_get_next_key(fd, NULL, &key) ||
+        bpf_map_lookup_elem(fd, &key, shards))
+        goto out;
+    for (i = 0; i < possible; i++)
+        counted += ((struct flow_stats *)(shards + i * stride))->packets;
+
+    /* 空闲 1 秒后由 flow_sweep 删除，FLOW_END 事件带合并后的包数 */
+    if ((fd = bench_map_fd(obj, "global_config")) < 0 ||
+        bpf_map_lookup_elem(fd, &zero, &gcfg))
+        goto out;
+    gcfg.active_timeout_s = 1;
+    gcfg.event_mask = 1 << IDCLASS_EV_FLOW_END;
+    if (bpf_map_update_elem(fd, &zero, &gcfg, BPF_ANY))
+        goto out;
+    rb = ring_buffer__new(bench_map_fd(obj, "events"), bench_sweep_event_cb, NULL, NULL);
+    if (!rb)
+        goto out;
+    usleep(1100000);
+    bench_swept_packets = 0;
+    bench_swept_flows = 0;
+    if (bpf_prog_test_run_opts(bpf_program__fd(sweep), &sweep_opts))
+        goto out;
+    ring_buffer__consume(rb);
+
+    printf("per-CPU totals: %llu packets injected, %llu counted, %llu swept in %u flow(s): %s\n",
+           (unsigned long long)injected, (unsigned long long)counted,
+           (unsigned long long)bench_swept_packets, bench_swept_flows,
+           counted == injected && bench_swept_packets == injected &&
+           bench_swept_flows == 1 ? "ok" : "FAILED");
+    if (counted == injected && bench_swept_packets == injected && bench_swept_flows == 1)
+        ret = 0;
+
+out:
+    ring_buffer__free(rb);
+    free(shards);
+    bpf_object__close(obj);
+    return ret;
+}
+
+/* External interface: run all benchmark modes and print the results */
+int benchmark_run(unsigned int iterations) {
+    int ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    uint32_t shared_ns = 0, percpu_ns = 0;
+    int i;
+
+    if (ncpus < 1)
+        ncpus = 1;
+    if (!iterations)
+        iterations = 1000000;
+
+    bench_build_packet();
+    if (bench_check_flow_key()) {
+        fprintf(stderr, "bidirectional flow key check failed\n");
+        return -1;
+    }
+    if (bench_check_reclassify()) {
+        fprintf(stderr, "reclassification replay failed\n");
+        return -1;
+    }
+    if (bench_check_percpu(ncpus)) {
+        fprintf(stderr, "per-CPU totals check failed\n");
+        return -1;
+    }
+
+    printf("flow record: %zu bytes, first %zu bytes per packet (+%zu bytes cold), "
+           "per-CPU mode: %zu bytes\n",
+           sizeof(struct flow_stats), offsetof(struct flow_stats, verdict_ms),
+           sizeof(struct flow_info),
+           ncpus * sizeof(struct flow_stats) + sizeof(struct flow_info));
+    bench_layout();
+    printf("%-16s %6s %6s %10s\n", "mode", "insns", "cpus", "ns/pkt");
+    for (i = 0; i < ARRAY_SIZE(bench_modes); i++) {
+        struct bpf_object *obj;
+        uint32_t ns_single = 0, ns_all = 0, insns;
+        int prog_fd;
+
+        obj = ebpf_loader_open_private(bench_modes[i].flags,
+                                       bench_modes[i].features, NULL, &prog_fd);
+        if (!obj)
+            return -1;
+        insns = bench_prog_insns(prog_fd);
+
+        if (bench_setup_maps(obj, bench_modes[i].features, bench_modes[i].cache,
+                             bench_modes[i].prefix) ||
+            bench_run_mode(prog_fd, 1, iterations, &ns_single) ||
+            bench_run_mode(prog_fd, ncpus, iterations, &ns_all)) {
+            fprintf(stderr, "benchmark %s failed: %s\n",
+                    bench_modes[i].name, strerror(errno));
+            bpf_object__close(obj);
+            return -1;
+        }
+
+        printf("%-16s %6u %6d %10u\n", bench_modes[i].name, insns, 1, ns_single);
+        printf("%-16s %6u %6d %10u\n", bench_modes[i].name, insns, ncpus, ns_all);
+        bpf_object__close(obj);
+
+        if (!strcmp(bench_modes[i].name, "shared"))
+            shared_ns = ns_all;
+        else if (!strcmp(bench_modes[i].name, "percpu"))
+            percpu_ns = ns_all;
+    }
+
+    /* 只报告，不判失败：单 CPU 或负载抖动时两者可能相差无几 */
+    printf("percpu vs shared on %d cpus: %u vs %u ns/pkt: %s\n", ncpus, percpu_ns, shared_ns,
+           percpu_ns <= shared_ns ? "ok" : "SLOWER");
+
+    return 0;
+}
+
+/* 域名规则基准测试的规则数量 */
+static const unsigned int bench_dns_sizes[] = { 16, 256, 4096, 16384 };
+
+#define BENCH_DNS_NAMES     1024
+#define BENCH_DNS_MIN_US    200000
+
+/*
+ * 生成 n 条规则：70% "*.cdnN.example"，20% 精确名，10% 正则，
+ * seq 与 map_manager 一样按加入顺序递增
+ */
+static struct idclass_map_data *bench_dns_rules(unsigned int n) {
+    struct idclass_map_data *rules = calloc(n, sizeof(*rules));
+    char buf[64];
+    unsigned int i;
+
+    if (!rules)
+        return NULL;
+
+    for (i = 0; i < n; i++) {
+        struct idclass_map_data *r = &rules[i];
+
+        r->id = CL_MAP_DNS;
+        r->dscp = i & IDCLASS_DSCP_VALUE_MASK;
+        r->addr.dns.seq = i + 1;
+        switch (i % 10) {
+        case 7:
+        case 8:
+            snprintf(buf, sizeof(buf), "host%u.example.net", i);
+            break;
+        case 9:
+            snprintf(buf, sizeof(buf), "/^v[0-9]+\\.site%u\\.tv$", i);
+            break;
+        default:
+            snprintf(buf, sizeof(buf), "*.cdn%u.example", i);
+            break;
+        }
+        r->addr.dns.pattern = strdup(buf);
+        if (buf[0] == '/')
+            regcomp(&r->addr.dns.regex, buf + 1, REG_EXTENDED | REG_NOSUB);
+    }
+    return rules;
+}
+
+static void bench_dns_free_rules(struct idclass_map_data *rules, unsigned int n) {
+    unsigned int i;
+
+    for (i = 0; i < n; i++) {
+        if (rules[i].addr.dns.pattern[0] == '/')
+            regfree(&rules[i].addr.dns.regex);
+        free((char *)rules[i].addr.dns.pattern);
+    }
+    free(rules);
+}
+
+/* 查询名：约一半命中某条规则，其余落空 */
+static void bench_dns_names(char names[][64], unsigned int n_rules) {
+    unsigned int i, k;
+
+    for (i = 0; i < BENCH_DNS_NAMES; i++) {
+        k = (i * 2654435761U) % n_rules;
+        switch (i % 4) {
+        case 0:
+            snprintf(names[i], 64, "a%u.edge.cdn%u.example", i, k - k % 10);
+            break;
+        case 1:
+            snprintf(names[i], 64, "host%u.example.net", k - k % 10 + 7);
+            break;
+        case 2:
+            snprintf(names[i], 64, "v%u.site%u.tv", i, k - k % 10 + 9);
+            break;
+        default:
+            snprintf(names[i], 64, "miss%u.other.org", i);
+            break;
+        }
+    }
+}
+
+/* 原先的做法：逐条 fnmatch/regexec，作为对照 */
+static int bench_dns_linear(struct idclass_map_data *rules, unsigned int n,
+                            const char *host, uint8_t *dscp, uint32_t *seq) {
+    unsigned int i;
+    int ret = -1;
+
+    for (i = 0; i < n; i++) {
+        struct idclass_map_data *r = &rules[i];
+
+        if (r->addr.dns.pattern[0] == '/') {
+            if (regexec(&r->addr.dns.regex, host, 0, NULL, 0))
+                continue;
+        } else if (fnmatch(r->addr.dns.pattern, host, 0)) {
+            continue;
+        }
+        if (*dscp == 0xff || r->addr.dns.seq < *seq) {
+            *dscp = r->dscp;
+            *seq = r->addr.dns.seq;
+        }
+        ret = 0;
+    }
+    return ret;
+}
+
+/* 反复查询直到至少运行 BENCH_DNS_MIN_US，返回每秒查询数 */
+static uint64_t bench_dns_measure(struct dns_matcher *m, struct idclass_map_data *rules,
+                                  unsigned int n, char names[][64], unsigned int *hits) {
+    uint64_t lookups = 0, start, elapsed;
+    struct timespec ts;
+    unsigned int i;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    start = ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+    *hits = 0;
+    do {
+        for (i = 0; i < BENCH_DNS_NAMES; i++) {
+            uint8_t dscp = 0xff;
+            uint32_t seq = 0;
+            int ret;
+
+            if (m)
+                ret = dns_matcher_lookup(m, names[i], false, &dscp, &seq);
+            else
+                ret = bench_dns_linear(rules, n, names[i], &dscp, &seq);
+            if (!ret && lookups < BENCH_DNS_NAMES)
+                (*hits)++;
+            lookups++;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        elapsed = ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000 - start;
+    } while (elapsed < BENCH_DNS_MIN_US);
+
+    return lookups * 1000000ULL / elapsed;
+}
+
+/* DNS 捕获基准测试：每轮 test_run 的应答数不超过 ring buffer 能容纳的记录数 */
+#define BENCH_DNS_RESPONSES 200000
+#define BENCH_DNS_BATCH     256
+
+static const uint8_t bench_dns_msg[] = {
+    0x12, 0x34, 0x81, 0x80, 0x00, 0x01, 0x00, 0x01, 0x00, 0x00, 0x00, 0x00,
+    3, 'w', 'w', 'w', 7, 'e', 'x', 'a', 'm', 'p', 'l', 'e', 3, 'c', 'o', 'm', 0,
+    0x00, 0x01, 0x00, 0x01,
+    0xc0, 0x0c, 0x00, 0x01, 0x00, 0x01, 0x00, 0x00, 0x01, 0x2c, 0x00, 0x04,
+    192, 0, 2, 10,
+};
+
+static struct {
+    struct ethhdr eth;
+    struct iphdr ip;
+    struct udphdr udp;
+    uint8_t dns[sizeof(bench_dns_msg)];
+} __attribute__((packed)) bench_dns_pkt;
+
+static unsigned int bench_dns_handled;
+
+/* 构造上游 DNS 服务器发来的 www.example.com A 记录应答（下行方向） */
+static void bench_dns_build_packet(void) {
+    memset(&bench_dns_pkt, 0, sizeof(bench_dns_pkt));
+    bench_dns_pkt.eth.h_proto = htons(ETH_P_IP);
+    bench_dns_pkt.ip.version = 4;
+    bench_dns_pkt.ip.ihl = 5;
+    bench_dns_pkt.ip.ttl = 64;
+    bench_dns_pkt.ip.protocol = IPPROTO_UDP;
+    bench_dns_pkt.ip.tot_len = htons(sizeof(bench_dns_pkt) - sizeof(bench_dns_pkt.eth));
+    inet_pton(AF_INET, "198.51.100.53", &bench_dns_pkt.ip.saddr);
+    inet_pton(AF_INET, "192.168.1.10", &bench_dns_pkt.ip.daddr);
+    bench_dns_pkt.udp.source = htons(53);
+    bench_dns_pkt.udp.dest = htons(40000);
+    bench_dns_pkt.udp.len = htons(sizeof(bench_dns_pkt.udp) + sizeof(bench_dns_msg));
+    memcpy(bench_dns_pkt.dns, bench_dns_msg, sizeof(bench_dns_msg));
+}
+
+/* 预标记模式：把 www.example.com 写进 dns_names，数据路径直接标记应答地址 */
+static int bench_dns_setup_names(struct bpf_object *obj) {
+    struct idclass_dns_key key = { .hash = IDCLASS_DNS_HASH_INIT };
+    struct idclass_dns_val val = { .seq = 1, .dscp = IDCLASS_DSCP_CLASS_FLAG };
+    /* 问题名的线格式（不含根标签）在 DNS 头之后 */
+    const uint8_t *wire = bench_dns_msg + 12;
+    int i, fd;
+
+    for (i = strlen((const char *)wire) - 1; i >= 0; i--)
+        key.hash = IDCLASS_DNS_HASH_STEP(key.hash, wire[i]);
+
+    if ((fd = bench_map_fd(obj, "dns_names")) < 0)
+        return -1;
+    return bpf_map_update_elem(fd, &key, &val, BPF_ANY);
+}
+
+static int bench_dns_event_cb(void *ctx, void *data, size_t size) {
+    const struct idclass_dns_event *ev = data;
+
+    if (size >= sizeof(*ev) && ev->len <= IDCLASS_DNS_MAX_LEN)
+        dns_parser_process((void *)ev->data, ev->len);
+    bench_dns_handled++;
+    return 0;
+}
+
+/* 私有对象中 classify_counters 某一项的各 CPU 之和 */
+static uint64_t bench_counter(struct bpf_object *obj, uint32_t idx) {
+    int ncpus = libbpf_num_possible_cpus();
+    uint64_t *vals, sum = 0;
+    int fd, i;
+
+    if (ncpus < 1 || (fd = bench_map_fd(obj, "classify_counters")) < 0)
+        return 0;
+    vals = calloc(ncpus, sizeof(*vals));
+    if (!vals)
+        return 0;
+    if (!bpf_map_lookup_elem(fd, &idx, vals))
+        for (i = 0; i < ncpus; i++)
+            sum += vals[i];
+    free(vals);
+    return sum;
+}
+
+/*
+ * 测量 DNS 捕获路径：数据路径复制应答的耗时，以及包括 ring buffer 取出和
+ * 用户态解析在内的每秒处理应答数
+ */
+static int bench_dns_capture(const char *name, bool premark) {
+    struct global_config gcfg;
+    struct ring_buffer *rb = NULL;
+    struct bpf_object *obj;
+    uint64_t kernel_ns = 0, start, elapsed;
+    unsigned int runs = 0;
+    struct timespec ts;
+    uint32_t key = 0;
+    int prog_fd, fd, ret = -1;
+
+    obj = ebpf_loader_open_private(IDCLASS_INGRESS, FEATURE_PKTLEN, NULL, &prog_fd);
+    if (!obj)
+        return -1;
+
+    if (bench_setup_maps(obj, FEATURE_PKTLEN, true, false) ||
+        (fd = bench_map_fd(obj, "global_config")) < 0 ||
+        bpf_map_lookup_elem(fd, &key, &gcfg))
+        goto out;
+    gcfg.dns_capture = 1;
+    if (bpf_map_update_elem(fd, &key, &gcfg, BPF_ANY) ||
+        (premark && bench_dns_setup_names(obj)))
+        goto out;
+
+    rb = ring_buffer__new(bench_map_fd(obj, "dns_events"), bench_dns_event_cb, NULL, NULL);
+    if (!rb)
+        goto out;
+
+    bench_dns_handled = 0;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    start = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    while (runs < BENCH_DNS_RESPONSES) {
+        DECLARE_LIBBPF_OPTS(bpf_test_run_opts, opts,
+            .data_in = &bench_dns_pkt,
+            .data_size_in = sizeof(bench_dns_pkt),
+            .repeat = BENCH_DNS_BATCH,
+        );
+
+        if (bpf_prog_test_run_opts(prog_fd, &opts))
+            goto out;
+        kernel_ns += (uint64_t)opts.duration * BENCH_DNS_BATCH;
+        runs += BENCH_DNS_BATCH;
+        ring_buffer__consume(rb);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    elapsed = ts.tv_sec * 1000000000ULL + ts.tv_nsec - start;
+
+    printf("%-12s %10u %10u %12llu %10llu %10llu\n", name, runs,
+           (unsigned int)(kernel_ns / runs),
+           (unsigned long long)(elapsed ? bench_dns_handled * 1000000000ULL / elapsed : 0),
+           (unsigned long long)bench_counter(obj, IDCLASS_CNT_DNS_DROP),
+           (unsigned long long)bench_counter(obj, IDCLASS_CNT_DNS_DEFERRED));
+    ret = 0;
+
+out:
+    if (ret)
+        fprintf(stderr, "benchmark %s failed: %s\n", name, strerror(errno));
+    ring_buffer__free(rb);
+    bpf_object__close(obj);
+    return ret;
+}
+
+/* External interface: compare the compiled domain matcher with a linear scan */
+int benchmark_dns_run(void) {
+    static char names[BENCH_DNS_NAMES][64];
+    int i;
+
+    printf("%-8s %12s %12s %6s\n", "rules", "compiled/s", "linear/s", "hits");
+    for (i = 0; i < ARRAY_SIZE(bench_dns_sizes); i++) {
+        unsigned int n = bench_dns_sizes[i], j, hits, linear_hits;
+        struct idclass_map_data *rules = bench_dns_rules(n);
+        struct dns_matcher *m = dns_matcher_new();
+        uint64_t compiled, linear;
+
+        if (!rules || !m) {
+            fprintf(stderr, "benchmark: out of memory\n");
+            return -1;
+        }
+        for (j = 0; j < n; j++)
+            dns_matcher_add(m, &rules[j]);
+        bench_dns_names(names, n);
+
+        compiled = bench_dns_measure(m, rules, n, names, &hits);
+        linear = bench_dns_measure(NULL, rules, n, names, &linear_hits);
+        if (hits != linear_hits)
+            fprintf(stderr, "benchmark: matcher disagrees with linear scan (%u/%u hits)\n",
+                    hits, linear_hits);
+
+        printf("%-8u %12llu %12llu %6u\n", n, (unsigned long long)compiled,
+               (unsigned long long)linear, hits);
+        dns_matcher_free(m);
+        bench_dns_free_rules(rules, n);
+    }
+
+    bench_dns_build_packet();
+    printf("\n%-12s %10s %10s %12s %10s %10s\n", "capture", "responses", "ns/resp",
+           "handled/s", "dropped", "deferred");
+    if (bench_dns_capture("copy", false) || bench_dns_capture("premark", true))
+        return -1;
+    return 0;
+}
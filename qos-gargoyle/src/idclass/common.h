@@ -31,8 +31,9 @@
 
 #define CLASSIFY_DATA_PATH   "/sys/fs/bpf/idclass_data"
 #define CLASSIFY_PIN_PATH    "/sys/fs/bpf/idclass"
-#define IDCLASS_DNS_IFNAME   "ifb-dns"
 #define IDCLASS_PRIO_BASE    0x110
+/* BPF 过滤器使用固定 handle，程序可按 handle 原地替换 */
+#define IDCLASS_FILTER_HANDLE 1
 
 /* 全局配置实例（由 map_manager.c 定义） */
 extern struct global_config global_config;
@@ -50,6 +51,19 @@ int read_float_mult100(const char *val);
 /* ======================= ebpf_loader 接口 ======================= */
 int ebpf_loader_init(void);
 const char *ebpf_loader_get_program(uint32_t flags, int *fd);
+uint32_t ebpf_loader_get_flags(void);
+uint32_t ebpf_loader_get_features(void);
+uint32_t ebpf_loader_get_load_time(void);
+int ebpf_loader_get_sweep_fd(void);
+int ebpf_loader_set_features(uint32_t features);
+bool ebpf_loader_warm_restart(void);
+bool ebpf_loader_maps_reused(void);
+struct bpf_object *ebpf_loader_open_private(uint32_t flags, uint32_t features,
+                                            struct bpf_object *maps_from, int *prog_fd);
+
+/* ======================= benchmark 接口 ======================= */
+int benchmark_run(unsigned int iterations);
+int benchmark_dns_run(void);
 
 /* ======================= map_manager 接口 ======================= */
 enum idclass_map_id {
@@ -57,6 +71,8 @@ enum idclass_map_id {
     CL_MAP_UDP_PORTS,
     CL_MAP_IPV4_ADDR,
     CL_MAP_IPV6_ADDR,
+    CL_MAP_IPV4_PREFIX,
+    CL_MAP_IPV6_PREFIX,
     CL_MAP_CLASS,
     CL_MAP_GLOBAL_CONFIG,
     CL_MAP_DNS,
@@ -64,6 +80,8 @@ enum idclass_map_id {
     CL_MAP_PRIO_CLASS_DOWN,
     CL_MAP_CLASS_MARK,
     CL_MAP_IP_CONN,
+    CL_MAP_DNS_NAMES,
+    CL_MAP_FLOW_CONFIG,
     __CL_MAP_MAX,
 };
 
@@ -73,10 +91,13 @@ struct idclass_map_data {
     bool user : 1;
     uint8_t dscp;
     uint8_t file_dscp;
+    uint32_t timeout;       /* 用户条目的有效期（秒），0 表示 idclass_map_timeout */
     union {
         uint32_t port;
         struct in_addr ip;
         struct in6_addr ip6;
+        struct idclass_lpm4_key prefix4;
+        struct idclass_lpm6_key prefix6;
         struct {
             uint32_t seq : 30;
             uint32_t only_cname : 1;
@@ -87,6 +108,7 @@ struct idclass_map_data {
 };
 
 int map_manager_init(void);
+void map_manager_stop(void);
 int map_manager_get_fd(enum idclass_map_id id);
 int map_manager_set_entry(enum idclass_map_id id, bool file, const char *str,
                          uint8_t dscp, bool only_cname);
@@ -97,13 +119,18 @@ void map_manager_reload_files(void);
 void map_manager_gc(void);
 void map_manager_dump(struct blob_buf *b);
 void map_manager_stats(struct blob_buf *b, bool reset);
+void map_manager_flows(struct blob_buf *b, uint32_t limit);
 void map_manager_update_config(void);
+uint64_t map_manager_read_counter(uint32_t key, bool reset);
 void map_manager_set_classes(struct blob_attr *val);
 void map_manager_sync_class_config(void);
 void map_manager_add_ip_to_nft_sets(const void *addr, int family, uint32_t ttl, uint8_t dscp);
 int map_manager_lookup_dns_entry(char *host, bool cname, uint8_t *dscp, uint32_t *seq);
 int map_manager_add_dns_host(char *host, const char *addr, const char *type, int ttl);
+uint32_t map_manager_dns_lifetime(uint32_t ttl);
+uint32_t map_manager_dns_rules_gen(void);
 int map_manager_load_file(const char *file);
+void map_manager_set_files(struct blob_attr *files);
 void map_manager_clear_files(void);
 
 /* ======================= config 接口 ======================= */
@@ -120,9 +147,48 @@ void config_sync_to_bpf(void);
 void config_set_name(const char *name);          /* 设置 UCI 配置名（由 main.c 调用） */
 const char *config_get_name(void);              /* 获取当前 UCI 配置名（供 ebpf_loader 使用） */
 
+/* ======================= dns_matcher 接口 ======================= */
+struct dns_matcher;
+struct dns_matcher *dns_matcher_new(void);
+void dns_matcher_free(struct dns_matcher *m);
+int dns_matcher_add(struct dns_matcher *m, struct idclass_map_data *rule);
+void dns_matcher_del(struct dns_matcher *m, struct idclass_map_data *rule);
+int dns_matcher_lookup(struct dns_matcher *m, const char *host, bool cname,
+                       uint8_t *dscp, uint32_t *seq);
+void dns_matcher_stats(struct dns_matcher *m, struct blob_buf *b);
+
+/* ======================= nft_batch 接口 ======================= */
+int nft_batch_init(void);
+void nft_batch_stop(void);
+void nft_batch_flush(void);
+void nft_batch_add_element(const char *class_name, const char *addr, uint32_t ttl);
+void nft_batch_stats(struct blob_buf *b, bool reset);
+
+/* ======================= rtnl_batch 接口 ======================= */
+int rtnl_batch_init(void);
+void rtnl_batch_stop(void);
+void rtnl_batch_begin(void);
+int rtnl_batch_commit(void);
+int rtnl_add_clsact(const char *ifname, int ifindex);
+int rtnl_del_root_qdisc(const char *ifname, int ifindex);
+int rtnl_add_cake(const char *ifname, int ifindex, const char *args);
+int rtnl_add_bpf_filter(const char *ifname, int ifindex, bool egress, int prio,
+                        int prog_fd, const char *prog_name);
+int rtnl_del_filter(const char *ifname, int ifindex, bool egress, int prio);
+int rtnl_replace_bpf_filter(const char *ifname, int ifindex, bool egress, int prio,
+                            int prog_fd, const char *prog_name);
+int rtnl_get_bpf_filter(const char *ifname, int ifindex, bool egress, int prio,
+                        uint32_t *prog_id);
+int rtnl_add_redirect(const char *ifname, int ifindex, int prio, int target);
+int rtnl_add_ifb(const char *ifname);
+int rtnl_del_link(const char *ifname);
+
 /* ======================= dns_parser 接口 ======================= */
 int dns_parser_init(void);
 void dns_parser_stop(void);
+bool dns_parser_active(void);
+void dns_parser_process(void *data, uint32_t len);
+void dns_parser_stats(struct blob_buf *b, bool reset);
 
 /* ======================= interface 接口 ======================= */
 int interface_init(void);
@@ -131,11 +197,20 @@ void interface_check(void);
 void interface_get_devices(struct blob_buf *b);
 void interface_status(struct blob_buf *b);
 void interface_stop(void);
+void interface_reload_programs(void);
+
+/* ======================= event_stream 接口 ======================= */
+int event_stream_init(void);
+void event_stream_stop(void);
+void event_stream_set_subscribed(bool subscribed);
+uint8_t event_stream_get_mask(void);
+void event_stream_stats(struct blob_buf *b, bool reset);
 
 /* ======================= ubus_server 接口 ======================= */
 int ubus_server_init(void);
 void ubus_server_stop(void);
 int ubus_server_check_interface(const char *name, char *ifname, int ifname_len);
 void ubus_server_update_bridger(bool shutdown);
+void ubus_server_notify(const char *type, struct blob_attr *msg);
 
 #endif /* __IDCLASS_COMMON_H */
\ No newline at end of file
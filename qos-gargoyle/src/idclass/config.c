@@ -109,6 +109,31 @@ static int load_idclass_config(void) {
         const char *dscp_icmp = uci_lookup_option_string(uci, s, "dscp_icmp");
         if (dscp_icmp) idclass_map_dscp_value(dscp_icmp, &global_config.dscp_icmp);
 
+        /* 判定缓存：每 rescore_packets 个包或 rescore_interval_ms 毫秒重新评分 */
+        const char *rescore_pkts = uci_lookup_option_string(uci, s, "rescore_packets");
+        if (rescore_pkts) {
+            unsigned long n = strtoul(rescore_pkts, NULL, 0);
+            uint32_t pow2 = 1;
+            while (pow2 < n && pow2 < 0x8000)
+                pow2 <<= 1;
+            global_config.rescore_pkt_mask = pow2 - 1;
+        }
+        const char *rescore_ms = uci_lookup_option_string(uci, s, "rescore_interval_ms");
+        if (rescore_ms) {
+            unsigned long ms = strtoul(rescore_ms, NULL, 0);
+            global_config.rescore_ms = ms > 0xffff ? 0xffff : ms;
+        }
+
+        /* 特征计数器的衰减周期：向上取 2 的幂毫秒，0 表示累计整个生命周期 */
+        const char *window_ms = uci_lookup_option_string(uci, s, "feature_window_ms");
+        if (window_ms) {
+            unsigned long ms = strtoul(window_ms, NULL, 0);
+            uint8_t shift = 0;
+            while (ms && (1UL << shift) < ms && shift < IDCLASS_WINDOW_SHIFT_MAX)
+                shift++;
+            global_config.window_shift = shift;
+        }
+
         /* 将 section 中的所有选项打包成 blob，供 config_parse_flow_config 解析 */
         blob_buf_init(&b, 0);
         struct uci_element *opt;
@@ -130,6 +155,17 @@ out:
     return ret;
 }
 
+/* 内部函数：启用的特征变化时重建分类程序（特征为加载时常量） */
+static void config_apply_features(void) {
+    int ret = ebpf_loader_set_features(global_flow_config.feature_mask);
+
+    if (ret > 0)
+        interface_reload_programs();
+    else if (ret < 0)
+        ULOG_ERR("Failed to rebuild classifier for feature mask 0x%x\n",
+                 global_flow_config.feature_mask);
+}
+
 /* UCI 文件监控回调 */
 static void config_check_uci_reload(struct uloop_timeout *t) {
     struct stat st;
@@ -142,6 +178,7 @@ static void config_check_uci_reload(struct uloop_timeout *t) {
                 /* 配置更新后同步到 BPF map */
                 map_manager_update_config();
                 map_manager_sync_class_config();
+                config_apply_features();
                 ULOG_INFO("UCI config reloaded\n");
             } else {
                 ULOG_ERR("Failed to reload UCI config\n");
@@ -206,6 +243,8 @@ int config_parse_flow_config(struct idclass_flow_config *cfg, struct blob_attr *
         CL_CONFIG_WEIGHT_RTT_REALTIME, CL_CONFIG_WEIGHT_RTT_VIDEO,
         CL_CONFIG_WEIGHT_RTT_NORMAL, CL_CONFIG_WEIGHT_RTT_BULK,
         CL_CONFIG_ENABLE_TCP_WINDOW, CL_CONFIG_ENABLE_TCP_MSS, CL_CONFIG_ENABLE_TCP_RTT,
+        CL_CONFIG_HIST_BIMODAL_PCT, CL_CONFIG_HIST_PERIODIC_PCT,
+        CL_CONFIG_WEIGHT_HIST_VIDEO, CL_CONFIG_WEIGHT_HIST_REALTIME, CL_CONFIG_ENABLE_HIST,
         __CL_CONFIG_MAX
     };
     static const struct blobmsg_policy policy[__CL_CONFIG_MAX] = {
@@ -295,6 +334,11 @@ int config_parse_flow_config(struct idclass_flow_config *cfg, struct blob_attr *
         [CL_CONFIG_ENABLE_TCP_WINDOW] = { "enable_tcp_window", BLOBMSG_TYPE_BOOL },
         [CL_CONFIG_ENABLE_TCP_MSS]    = { "enable_tcp_mss",    BLOBMSG_TYPE_BOOL },
         [CL_CONFIG_ENABLE_TCP_RTT]    = { "enable_tcp_rtt",    BLOBMSG_TYPE_BOOL },
+        [CL_CONFIG_HIST_BIMODAL_PCT]  = { "hist_bimodal_pct",  BLOBMSG_TYPE_INT32 },
+        [CL_CONFIG_HIST_PERIODIC_PCT] = { "hist_periodic_pct", BLOBMSG_TYPE_INT32 },
+        [CL_CONFIG_WEIGHT_HIST_VIDEO]    = { "weight_hist_video",    BLOBMSG_TYPE_INT32 },
+        [CL_CONFIG_WEIGHT_HIST_REALTIME] = { "weight_hist_realtime", BLOBMSG_TYPE_INT32 },
+        [CL_CONFIG_ENABLE_HIST]       = { "enable_hist",       BLOBMSG_TYPE_BOOL },
     };
     struct blob_attr *tb[__CL_CONFIG_MAX];
     struct blob_attr *cur;
@@ -378,6 +422,12 @@ int config_parse_flow_config(struct idclass_flow_config *cfg, struct blob_attr *
         cfg->weight_rtt_video       = 1;
         cfg->weight_rtt_normal      = 1;
         cfg->weight_rtt_bulk        = 2;
+
+        // 直方图形状特征默认值
+        cfg->hist_bimodal_pct = 25;
+        cfg->hist_periodic_pct = 75;
+        cfg->weight_hist_video      = 2;
+        cfg->weight_hist_realtime   = 2;
     }
 
     blobmsg_parse(policy, __CL_CONFIG_MAX, tb, blobmsg_data(attr), blobmsg_len(attr));
@@ -455,6 +505,10 @@ int config_parse_flow_config(struct idclass_flow_config *cfg, struct blob_attr *
     READ_U32(CL_CONFIG_WEIGHT_RTT_VIDEO,       weight_rtt_video);
     READ_U32(CL_CONFIG_WEIGHT_RTT_NORMAL,      weight_rtt_normal);
     READ_U32(CL_CONFIG_WEIGHT_RTT_BULK,        weight_rtt_bulk);
+    READ_U32(CL_CONFIG_HIST_BIMODAL_PCT, hist_bimodal_pct);
+    READ_U32(CL_CONFIG_HIST_PERIODIC_PCT, hist_periodic_pct);
+    READ_U32(CL_CONFIG_WEIGHT_HIST_VIDEO,      weight_hist_video);
+    READ_U32(CL_CONFIG_WEIGHT_HIST_REALTIME,   weight_hist_realtime);
 #undef READ_U32
 
     if ((cur = tb[CL_CONFIG_UP_DOWN_RATIO_LOW]) != NULL)
@@ -476,6 +530,7 @@ int config_parse_flow_config(struct idclass_flow_config *cfg, struct blob_attr *
     if ((cur = tb[CL_CONFIG_ENABLE_TCP_WINDOW]) && blobmsg_get_bool(cur)) cfg->feature_mask |= FEATURE_TCP_WINDOW;
     if ((cur = tb[CL_CONFIG_ENABLE_TCP_MSS]) && blobmsg_get_bool(cur)) cfg->feature_mask |= FEATURE_TCP_MSS;
     if ((cur = tb[CL_CONFIG_ENABLE_TCP_RTT]) && blobmsg_get_bool(cur)) cfg->feature_mask |= FEATURE_TCP_RTT;
+    if ((cur = tb[CL_CONFIG_ENABLE_HIST]) && blobmsg_get_bool(cur)) cfg->feature_mask |= FEATURE_HIST;
 
     return 0;
 }
@@ -518,6 +573,7 @@ int config_reload(void) {
     if (load_idclass_config() != 0) return -1;
     if (load_class_config() != 0) return -1;
     config_sync_to_bpf();
+    config_apply_features();
     ULOG_INFO("Configuration reloaded via ubus\n");
     return 0;
 }
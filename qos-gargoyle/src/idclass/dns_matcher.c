@@ -0,0 +1,412 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * dns_matcher.c - compiled domain pattern matcher
+ *
+ * Indexes the CL_MAP_DNS rules so a lookup does not have to run fnmatch() or
+ * regexec() against every configured pattern:
+ *   - exact names and "*.suffix" globs live in a trie of reversed labels,
+ *     a lookup walks the name once from the top-level label down;
+ *   - regex rules are grouped in chunks, each chunk compiled into a single
+ *     alternation that rejects a non-matching name with one regexec();
+ *   - any other glob hangs off the trie node of its literal label suffix
+ *     ("ads*.example.com" under example.com) and is checked with fnmatch()
+ *     only for names that pass through that node.
+ * The matcher only stores pointers to the rules, so the seq and DSCP values
+ * are always read live and the priority rule (lowest seq wins) is unchanged.
+ */
+#include "common.h"
+#include <fnmatch.h>
+#include <libubox/avl-cmp.h>
+
+#define DNS_MATCH_CHUNK     32
+#define DNS_LABEL_MAX       63
+
+struct dns_match_node {
+    struct avl_node avl;
+    struct avl_tree children;
+    struct dns_match_node *parent;
+    struct idclass_map_data *exact;
+    struct idclass_map_data *wildcard;
+    struct idclass_map_data **globs;    /* 字面后缀止于此节点的通配规则 */
+    int n_globs, globs_alloc;
+    char label[];
+};
+
+/* 一组正则规则，合并编译成一个 (r1)|(r2)|... 作为预筛选 */
+struct dns_regex_chunk {
+    struct list_head list;
+    struct idclass_map_data *rules[DNS_MATCH_CHUNK];
+    int n;
+    bool dirty;
+    bool combined_ok;
+    regex_t combined;
+};
+
+struct dns_matcher {
+    struct dns_match_node root;
+    struct list_head regex_chunks;
+    uint32_t n_exact, n_wildcard, n_glob, n_regex;
+};
+
+enum dns_rule_kind {
+    DNS_RULE_EXACT,
+    DNS_RULE_WILDCARD,
+    DNS_RULE_GLOB,
+    DNS_RULE_REGEX,
+};
+
+/* Helper: classify a (lowercase) pattern, *name points to the trie part */
+static enum dns_rule_kind dns_rule_kind(const char *pattern, const char **name) {
+    *name = pattern;
+    if (pattern[0] == '/')
+        return DNS_RULE_REGEX;
+    if (!strncmp(pattern, "*.", 2) && pattern[2] && !strpbrk(pattern + 2, "*?[\\")) {
+        *name = pattern + 2;
+        return DNS_RULE_WILDCARD;
+    }
+    if (*pattern && !strpbrk(pattern, "*?[\\"))
+        return DNS_RULE_EXACT;
+    return DNS_RULE_GLOB;
+}
+
+/*
+ * Helper: literal label suffix of a glob, the part after the first '.' that
+ * follows the last wildcard character ("" if there is none)
+ */
+static const char *dns_glob_suffix(const char *pattern) {
+    const char *p, *last = NULL;
+
+    for (p = pattern; *p; p++)
+        if (strchr("*?[]\\", *p))
+            last = p;
+    p = last ? strchr(last, '.') : NULL;
+    return p ? p + 1 : "";
+}
+
+/* Helper: check that every label of name fits into a trie node */
+static bool dns_labels_ok(const char *name) {
+    int len = 0;
+
+    for (; *name; name++) {
+        len = *name == '.' ? 0 : len + 1;
+        if (len > DNS_LABEL_MAX)
+            return false;
+    }
+    return true;
+}
+
+/* Helper: apply one matching rule with the existing seq priority */
+static void dns_match_consider(const struct idclass_map_data *r, bool cname,
+                               uint8_t *dscp, uint32_t *seq, int *ret) {
+    if (!r || (!cname && r->addr.dns.only_cname))
+        return;
+    if (*dscp == 0xff || r->addr.dns.seq < *seq) {
+        *dscp = r->dscp;
+        *seq = r->addr.dns.seq;
+    }
+    *ret = 0;
+}
+
+/* Helper: get (and optionally create) the child node for one label */
+static struct dns_match_node *dns_node_child(struct dns_match_node *node,
+                                             const char *label, int len, bool create) {
+    struct dns_match_node *child;
+    char buf[DNS_LABEL_MAX + 1];
+
+    if (len >= sizeof(buf))
+        return NULL;
+    memcpy(buf, label, len);
+    buf[len] = 0;
+
+    child = avl_find_element(&node->children, buf, child, avl);
+    if (child || !create)
+        return child;
+
+    child = calloc(1, sizeof(*child) + len + 1);
+    if (!child)
+        return NULL;
+    memcpy(child->label, buf, len + 1);
+    child->avl.key = child->label;
+    child->parent = node;
+    avl_init(&child->children, avl_strcmp, false, NULL);
+    avl_insert(&node->children, &child->avl);
+    return child;
+}
+
+/* Helper: walk the trie along the reversed labels of name */
+static struct dns_match_node *dns_node_find(struct dns_matcher *m, const char *name,
+                                            bool create) {
+    struct dns_match_node *node = &m->root;
+    const char *end = name + strlen(name);
+    const char *p;
+
+    while (node && end > name) {
+        for (p = end; p > name && p[-1] != '.'; p--);
+        node = dns_node_child(node, p, end - p, create);
+        end = p > name ? p - 1 : p;
+    }
+    return node;
+}
+
+/* Helper: free empty nodes from node up to (not including) the root */
+static void dns_node_prune(struct dns_matcher *m, struct dns_match_node *node) {
+    while (node != &m->root && !node->exact && !node->wildcard && !node->n_globs &&
+           avl_is_empty(&node->children)) {
+        struct dns_match_node *parent = node->parent;
+
+        avl_delete(&parent->children, &node->avl);
+        free(node->globs);
+        free(node);
+        node = parent;
+    }
+}
+
+/* Helper: (re)compile the combined prefilter of a regex chunk */
+static void dns_chunk_compile(struct dns_regex_chunk *c) {
+    size_t len = 1;
+    char *buf, *p;
+    int i;
+
+    if (c->combined_ok)
+        regfree(&c->combined);
+    c->combined_ok = false;
+    c->dirty = false;
+
+    for (i = 0; i < c->n; i++)
+        len += strlen(c->rules[i]->addr.dns.pattern + 1) + 3;
+    buf = p = malloc(len);
+    if (!buf)
+        return;
+    for (i = 0; i < c->n; i++)
+        p += sprintf(p, "%s(%s)", i ? "|" : "", c->rules[i]->addr.dns.pattern + 1);
+
+    /* 反向引用等无法合并的写法会编译失败，此时该组逐条匹配 */
+    c->combined_ok = !regcomp(&c->combined, buf, REG_EXTENDED | REG_NOSUB);
+    free(buf);
+}
+
+/* External: add a CL_MAP_DNS rule (pattern already lowercase, regex compiled) */
+int dns_matcher_add(struct dns_matcher *m, struct idclass_map_data *rule) {
+    struct dns_match_node *node;
+    struct dns_regex_chunk *c;
+    enum dns_rule_kind kind;
+    const char *name;
+
+    kind = dns_rule_kind(rule->addr.dns.pattern, &name);
+    if (kind == DNS_RULE_GLOB)
+        name = dns_glob_suffix(rule->addr.dns.pattern);
+    if (kind != DNS_RULE_REGEX && !dns_labels_ok(name)) {
+        ULOG_WARN("DNS rule '%s' rejected: label longer than %d characters\n",
+                  rule->addr.dns.pattern, DNS_LABEL_MAX);
+        return -1;
+    }
+
+    switch (kind) {
+    case DNS_RULE_EXACT:
+    case DNS_RULE_WILDCARD:
+        node = dns_node_find(m, name, true);
+        if (!node)
+            return -1;
+        if (name == rule->addr.dns.pattern) {
+            node->exact = rule;
+            m->n_exact++;
+        } else {
+            node->wildcard = rule;
+            m->n_wildcard++;
+        }
+        return 0;
+    case DNS_RULE_REGEX:
+        c = list_empty(&m->regex_chunks) ? NULL :
+            list_last_entry(&m->regex_chunks, struct dns_regex_chunk, list);
+        if (!c || c->n == DNS_MATCH_CHUNK) {
+            c = calloc(1, sizeof(*c));
+            if (!c)
+                return -1;
+            list_add_tail(&c->list, &m->regex_chunks);
+        }
+        c->rules[c->n++] = rule;
+        c->dirty = true;
+        m->n_regex++;
+        return 0;
+    case DNS_RULE_GLOB:
+        node = dns_node_find(m, name, true);
+        if (!node)
+            return -1;
+        if (node->n_globs == node->globs_alloc) {
+            int alloc = node->globs_alloc ? node->globs_alloc * 2 : 4;
+            void *p = realloc(node->globs, alloc * sizeof(*node->globs));
+            if (!p) {
+                dns_node_prune(m, node);
+                return -1;
+            }
+            node->globs = p;
+            node->globs_alloc = alloc;
+        }
+        node->globs[node->n_globs++] = rule;
+        m->n_glob++;
+        return 0;
+    }
+    return -1;
+}
+
+/* External: remove a rule previously added with dns_matcher_add */
+void dns_matcher_del(struct dns_matcher *m, struct idclass_map_data *rule) {
+    struct dns_match_node *node;
+    struct dns_regex_chunk *c;
+    const char *name;
+    int i;
+
+    switch (dns_rule_kind(rule->addr.dns.pattern, &name)) {
+    case DNS_RULE_EXACT:
+    case DNS_RULE_WILDCARD:
+        node = dns_node_find(m, name, false);
+        if (!node)
+            return;
+        if (node->exact == rule) {
+            node->exact = NULL;
+            m->n_exact--;
+        } else if (node->wildcard == rule) {
+            node->wildcard = NULL;
+            m->n_wildcard--;
+        }
+        dns_node_prune(m, node);
+        break;
+    case DNS_RULE_REGEX:
+        list_for_each_entry(c, &m->regex_chunks, list) {
+            for (i = 0; i < c->n; i++) {
+                if (c->rules[i] != rule)
+                    continue;
+                c->rules[i] = c->rules[--c->n];
+                c->dirty = true;
+                m->n_regex--;
+                if (!c->n) {
+                    if (c->combined_ok)
+                        regfree(&c->combined);
+                    list_del(&c->list);
+                    free(c);
+                }
+                return;
+            }
+        }
+        break;
+    case DNS_RULE_GLOB:
+        node = dns_node_find(m, dns_glob_suffix(rule->addr.dns.pattern), false);
+        if (!node)
+            return;
+        for (i = 0; i < node->n_globs; i++) {
+            if (node->globs[i] != rule)
+                continue;
+            node->globs[i] = node->globs[--node->n_globs];
+            m->n_glob--;
+            break;
+        }
+        dns_node_prune(m, node);
+        break;
+    }
+}
+
+/* Helper: check the glob rules hanging off one trie node */
+static void dns_match_globs(const struct dns_match_node *node, const char *host,
+                            bool cname, uint8_t *dscp, uint32_t *seq, int *ret) {
+    int i;
+
+    for (i = 0; i < node->n_globs; i++)
+        if (!fnmatch(node->globs[i]->addr.dns.pattern, host, 0))
+            dns_match_consider(node->globs[i], cname, dscp, seq, ret);
+}
+
+/*
+ * External: find the rule for a (lowercase) host name. Same contract as the
+ * old linear scan: *dscp/*seq are only replaced by a rule with a lower seq
+ * (or if *dscp is still 0xff); returns 0 if any rule matched.
+ */
+int dns_matcher_lookup(struct dns_matcher *m, const char *host, bool cname,
+                       uint8_t *dscp, uint32_t *seq) {
+    struct dns_match_node *node = &m->root;
+    const char *end = host + strlen(host);
+    struct dns_regex_chunk *c;
+    const char *p;
+    int ret = -1;
+    int i;
+
+    /*
+     * 从顶级域开始逐级向下，途经节点的 "*.suffix" 规则在还有剩余标签时命中，
+     * 挂在途经节点上的通配规则逐条用 fnmatch() 检查
+     */
+    dns_match_globs(node, host, cname, dscp, seq, &ret);
+    while (end > host) {
+        for (p = end; p > host && p[-1] != '.'; p--);
+        node = dns_node_child(node, p, end - p, false);
+        if (!node)
+            break;
+        dns_match_globs(node, host, cname, dscp, seq, &ret);
+        if (p > host) {
+            dns_match_consider(node->wildcard, cname, dscp, seq, &ret);
+            end = p - 1;
+        } else {
+            dns_match_consider(node->exact, cname, dscp, seq, &ret);
+            end = p;
+        }
+    }
+
+    list_for_each_entry(c, &m->regex_chunks, list) {
+        if (c->dirty)
+            dns_chunk_compile(c);
+        if (c->combined_ok && regexec(&c->combined, host, 0, NULL, 0))
+            continue;
+        for (i = 0; i < c->n; i++)
+            if (!regexec(&c->rules[i]->addr.dns.regex, host, 0, NULL, 0))
+                dns_match_consider(c->rules[i], cname, dscp, seq, &ret);
+    }
+
+    return ret;
+}
+
+/* External: number of rules per kind (get_stats) */
+void dns_matcher_stats(struct dns_matcher *m, struct blob_buf *b) {
+    void *c;
+
+    c = blobmsg_open_table(b, "dns_rules");
+    blobmsg_add_u32(b, "exact", m->n_exact);
+    blobmsg_add_u32(b, "wildcard", m->n_wildcard);
+    blobmsg_add_u32(b, "glob", m->n_glob);
+    blobmsg_add_u32(b, "regex", m->n_regex);
+    blobmsg_close_table(b, c);
+}
+
+/* External: allocate an empty matcher */
+struct dns_matcher *dns_matcher_new(void) {
+    struct dns_matcher *m = calloc(1, sizeof(*m));
+
+    if (!m)
+        return NULL;
+    avl_init(&m->root.children, avl_strcmp, false, NULL);
+    INIT_LIST_HEAD(&m->regex_chunks);
+    return m;
+}
+
+/* Helper: free a trie node and everything below it */
+static void dns_node_free(struct dns_match_node *node) {
+    struct dns_match_node *child, *tmp;
+
+    avl_remove_all_elements(&node->children, child, avl, tmp) {
+        dns_node_free(child);
+        free(child);
+    }
+    free(node->globs);
+}
+
+/* External: free a matcher (the rules themselves belong to the caller) */
+void dns_matcher_free(struct dns_matcher *m) {
+    struct dns_regex_chunk *c, *tmp;
+
+    if (!m)
+        return;
+    dns_node_free(&m->root);
+    list_for_each_entry_safe(c, tmp, &m->regex_chunks, list) {
+        if (c->combined_ok)
+            regfree(&c->combined);
+        free(c);
+    }
+    free(m);
+}
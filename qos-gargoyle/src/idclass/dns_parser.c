@@ -2,15 +2,14 @@
 /*
  * dns_parser.c - DNS traffic parsing and mapping module
  *
- * Listens to DNS responses on a dedicated IFB interface, extracts domain names,
- * and updates IP address mappings via map_manager. Also manages CNAME caching
+ * Receives upstream DNS response payloads from the classifier through the
+ * dns_events ring buffer, extracts domain names, and updates IP address
+ * mappings via map_manager. Also keeps a bounded, TTL-aware CNAME cache
  * for chained lookups.
  */
 #include "common.h"
-#include <linux/if_packet.h>      // 提供 struct sockaddr_ll
-#include <net/if.h>
-#include <sys/socket.h>
 #include <errno.h>
+#include <time.h>
 #include <resolv.h>
 #include <libubox/uloop.h>
 #include <libubox/avl-cmp.h>
@@ -33,11 +32,11 @@
 #define MAX_NAME_LEN    256
 #define MAX_DATA_LEN    8096
 
-/* VLAN 头部定义（内核可能未包含完整） */
-struct vlan_hdr {
-    uint16_t tci;
-    uint16_t proto;
-};
+/* CNAME 缓存：固定槽位数，CLOCK 置换，有效期取自应答记录的 TTL */
+#define CNAME_CACHE_SIZE        4096
+#define CNAME_CACHE_MIN_TTL     5
+#define CNAME_CACHE_MAX_TTL     3600
+#define CNAME_SWEEP_STEPS       64
 
 /* 数据包结构 */
 struct packet {
@@ -72,17 +71,42 @@ struct dns_answer {
 /* CNAME 缓存条目 */
 struct cname_entry {
     struct avl_node node;
+    uint32_t expires;        /* 单调时钟秒数 */
     uint32_t seq;
+    uint32_t gen;            /* 写入时的 DNS 规则版本，规则变化后作废 */
+    uint16_t slot;
     uint8_t dscp;
-    uint8_t age;
-    regex_t regex;           /* 用于正则匹配（如果 pattern 以 '/' 开头） */
-    char pattern[];          /* 可变长度，存储 pattern 字符串 */
+    bool referenced;         /* CLOCK 引用位 */
+    char name[];
 };
 
 /* 全局变量 */
 static struct uloop_fd ufd;
+static struct ring_buffer *dns_rb;
+static uint64_t dns_responses;
+static struct uloop_timeout dns_drain_timer;
+
+/* 每次唤醒（或定时取走）处理的应答数 */
+static struct {
+    uint64_t wakeups;
+    uint64_t drains;
+    uint32_t last_batch;
+    uint32_t max_batch;
+} dns_batch_stats;
 static struct uloop_timeout cname_gc_timer;
 static AVL_TREE(cname_cache, avl_strcmp, false, NULL);
+static struct cname_entry *cname_slots[CNAME_CACHE_SIZE];
+static uint32_t cname_hand;     /* 分配/置换指针 */
+static uint32_t cname_sweep;    /* 定时清理过期条目的游标 */
+
+static struct {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t inserts;
+    uint64_t evicted;
+    uint64_t expired;
+    uint64_t stale;
+} cname_stats;
 
 /* 内部函数：从数据包中拉取指定长度 */
 static void *pkt_pull(struct packet *pkt, unsigned int len) {
@@ -108,52 +132,110 @@ static int pkt_pull_name(struct packet *pkt, const void *hdr, char *dest) {
     return 0;
 }
 
-/* 内部函数：判断协议是否为 VLAN */
-static bool proto_is_vlan(uint16_t proto) {
-    return proto == ETH_P_8021Q || proto == ETH_P_8021AD;
+/* 内部函数：单调时钟秒数 */
+static uint32_t cname_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
 }
 
-/* CNAME 缓存操作（普通域名） */
-static void cname_cache_set(const char *name, uint8_t dscp, uint32_t seq) {
-    struct cname_entry *e = avl_find_element(&cname_cache, name, e, node);
-    if (!e) {
-        char *pattern;
-        e = calloc_a(sizeof(*e), &pattern, strlen(name) + 1);
-        if (!e) return;
-        strcpy(pattern, name);
-        e->pattern[0] = 0; /* 不是正则，没有 pattern */
-        e->node.key = pattern;
-        avl_insert(&cname_cache, &e->node);
+static bool cname_expired(const struct cname_entry *e, uint32_t now) {
+    return (int32_t)(e->expires - now) <= 0;
+}
+
+/* 内部函数：条目已过期或规则已变化，计入相应的统计 */
+static bool cname_invalid(const struct cname_entry *e, uint32_t now) {
+    if (e->gen != map_manager_dns_rules_gen()) {
+        cname_stats.stale++;
+        return true;
     }
-    e->age = 0;
-    e->dscp = dscp;
-    e->seq = seq;
+    if (cname_expired(e, now)) {
+        cname_stats.expired++;
+        return true;
+    }
+    return false;
+}
+
+/* 内部函数：释放一个缓存条目并空出其槽位 */
+static void cname_cache_free(struct cname_entry *e) {
+    cname_slots[e->slot] = NULL;
+    avl_delete(&cname_cache, &e->node);
+    free(e);
+}
+
+/*
+ * 内部函数：用 CLOCK 算法找一个可用槽位。空槽和过期条目直接使用；
+ * 引用位为 1 的条目清零后跳过，否则淘汰。最多转两圈。
+ */
+static uint32_t cname_cache_slot(uint32_t now) {
+    struct cname_entry *e;
+    uint32_t slot;
+
+    for (;;) {
+        slot = cname_hand;
+        cname_hand = (cname_hand + 1) % CNAME_CACHE_SIZE;
+        e = cname_slots[slot];
+        if (!e)
+            return slot;
+        if (cname_invalid(e, now))
+            break;
+        if (e->referenced) {
+            e->referenced = false;
+            continue;
+        }
+        cname_stats.evicted++;
+        break;
+    }
+    cname_cache_free(e);
+    return slot;
 }
 
-/* CNAME 缓存操作（正则表达式） */
-static void cname_cache_set_regex(const char *pattern, uint8_t dscp, uint32_t seq) {
-    struct cname_entry *e = avl_find_element(&cname_cache, pattern, e, node);
+/* CNAME 缓存操作：记录 CNAME 目标的 DSCP，有效期为记录的 TTL */
+static void cname_cache_set(const char *name, uint8_t dscp, uint32_t seq, uint32_t ttl) {
+    struct cname_entry *e = avl_find_element(&cname_cache, name, e, node);
+    uint32_t now = cname_now();
+
     if (!e) {
-        char *pattern_copy;
-        e = calloc_a(sizeof(*e), &pattern_copy, strlen(pattern) + 1);
+        char *name_buf;
+        uint32_t slot = cname_cache_slot(now);
+
+        e = calloc_a(sizeof(*e), &name_buf, strlen(name) + 1);
         if (!e) return;
-        strcpy(pattern_copy, pattern);
-        e->pattern[0] = pattern[0];
-        e->node.key = pattern_copy;
-        if (regcomp(&e->regex, pattern + 1, REG_EXTENDED | REG_NOSUB) != 0) {
-            free(e);
-            return;
-        }
+        strcpy(name_buf, name);
+        e->node.key = name_buf;
+        e->slot = slot;
+        cname_slots[slot] = e;
         avl_insert(&cname_cache, &e->node);
+        cname_stats.inserts++;
+        if (!cname_gc_timer.pending)
+            uloop_timeout_set(&cname_gc_timer, 1000);
     }
-    e->age = 0;
+
+    if (ttl < CNAME_CACHE_MIN_TTL)
+        ttl = CNAME_CACHE_MIN_TTL;
+    else if (ttl > CNAME_CACHE_MAX_TTL)
+        ttl = CNAME_CACHE_MAX_TTL;
+    e->expires = now + ttl;
+    e->referenced = true;
     e->dscp = dscp;
     e->seq = seq;
+    e->gen = map_manager_dns_rules_gen();
 }
 
 static int cname_cache_get(const char *name, uint8_t *dscp, uint32_t *seq) {
     struct cname_entry *e = avl_find_element(&cname_cache, name, e, node);
-    if (!e) return -1;
+
+    if (e && cname_invalid(e, cname_now())) {
+        cname_cache_free(e);
+        e = NULL;
+    }
+    if (!e) {
+        cname_stats.misses++;
+        return -1;
+    }
+
+    cname_stats.hits++;
+    e->referenced = true;
     if (*dscp == 0xff || e->seq < *seq) {
         *dscp = e->dscp;
         *seq = e->seq;
@@ -190,12 +272,14 @@ static int dns_parse_answer(struct packet *pkt, void *hdr,
     if (!a)
         return -1;
 
+    /* rdata 必须完整位于报文内 */
     len = be16_to_cpu(a->rdlength);
     rdata = pkt_pull(pkt, len);
     if (!rdata)
         return -1;
 
     ttl = be32_to_cpu(a->ttl);
+    data.timeout = map_manager_dns_lifetime(ttl);
 
     switch (be16_to_cpu(a->type)) {
     case TYPE_CNAME: {
@@ -204,19 +288,26 @@ static int dns_parse_answer(struct packet *pkt, void *hdr,
                       cname, sizeof(cname)) < 0)
             return -1;
         map_manager_lookup_dns_entry(cname, true, dscp, seq);
-        if (cname[0] == '/')
-            cname_cache_set_regex(cname, *dscp, *seq);
-        else
-            cname_cache_set(cname, *dscp, *seq);
+        /* 没有匹配到规则的链不占缓存 */
+        if (*dscp != 0xff)
+            cname_cache_set(cname, *dscp, *seq, ttl);
         break;
     }
     case TYPE_A:
+        if (len != 4)
+            return -1;
+        if (*dscp == 0xff)
+            break;
         data.id = CL_MAP_IPV4_ADDR;
         memcpy(&data.addr.ip, rdata, 4);
         map_manager_add_ip_to_nft_sets(rdata, AF_INET, ttl, *dscp);
         map_manager_set_entry_data(&data);
         break;
     case TYPE_AAAA:
+        if (len != 16)
+            return -1;
+        if (*dscp == 0xff)
+            break;
         data.id = CL_MAP_IPV6_ADDR;
         memcpy(&data.addr.ip6, rdata, 16);
         map_manager_add_ip_to_nft_sets(rdata, AF_INET6, ttl, *dscp);
@@ -254,134 +345,140 @@ static void idclass_dns_data_cb(struct packet *pkt) {
             return;
 }
 
-/* 内部函数：解析以太网帧，定位 DNS/UDP 载荷 */
-static void idclass_dns_packet_cb(struct packet *pkt) {
-    struct ethhdr *eth;
-    struct iphdr *ip;
-    struct ipv6hdr *ip6;
-    uint16_t proto;
-
-    eth = pkt_pull(pkt, sizeof(*eth));
-    if (!eth)
-        return;
+/* 外部接口：处理一个 DNS 应答载荷（从 DNS 头开始） */
+void dns_parser_process(void *data, uint32_t len) {
+    struct packet pkt = { .buffer = data, .len = len };
 
-    proto = be16_to_cpu(eth->h_proto);
-    if (proto_is_vlan(proto)) {
-        struct vlan_hdr *vlan;
-        vlan = pkt_pull(pkt, sizeof(*vlan));
-        if (!vlan)
-            return;
-        proto = be16_to_cpu(vlan->proto);
-    }
-
-    switch (proto) {
-    case ETH_P_IP:
-        ip = pkt_pull(pkt, sizeof(*ip));
-        if (!ip)
-            return;
-        if (!pkt_pull(pkt, (ip->ihl * 4) - sizeof(*ip)))
-            return;
-        proto = ip->protocol;
-        break;
-    case ETH_P_IPV6:
-        ip6 = pkt_pull(pkt, sizeof(*ip6));
-        if (!ip6)
-            return;
-        proto = ip6->nexthdr;
-        break;
-    default:
-        return;
-    }
+    dns_responses++;
+    idclass_dns_data_cb(&pkt);
+}
 
-    if (proto != IPPROTO_UDP)
-        return;
+/* 内部函数：ring buffer 回调，每个事件是一个 DNS 载荷 */
+static int idclass_dns_event_cb(void *ctx, void *data, size_t size) {
+    struct idclass_dns_event *ev = data;
 
-    if (!pkt_pull(pkt, sizeof(struct udphdr)))
-        return;
+    if (size < sizeof(*ev) || ev->len > IDCLASS_DNS_MAX_LEN)
+        return 0;
 
-    idclass_dns_data_cb(pkt);
+    dns_parser_process(ev->data, ev->len);
+    return 0;
 }
 
-/* 内部函数：原始套接字回调 */
-static void idclass_dns_socket_cb(struct uloop_fd *fd, unsigned int events) {
-    static uint8_t buf[8192];
-    struct packet pkt = { .buffer = buf };
-    int len;
-
-retry:
-    len = recvfrom(fd->fd, buf, sizeof(buf), MSG_DONTWAIT, NULL, NULL);
-    if (len < 0) {
-        if (errno == EINTR)
-            goto retry;
-        return;
+/* 内部函数：取走 ring buffer 中的全部应答，记录批大小 */
+static uint32_t idclass_dns_consume(void) {
+    uint64_t prev = dns_responses;
+    uint32_t n;
+
+    ring_buffer__consume(dns_rb);
+    n = dns_responses - prev;
+    if (n) {
+        dns_batch_stats.last_batch = n;
+        if (n > dns_batch_stats.max_batch)
+            dns_batch_stats.max_batch = n;
     }
-    if (!len)
-        return;
+    return n;
+}
 
-    pkt.len = len;
-    idclass_dns_packet_cb(&pkt);
+/* 内部函数：ring buffer 可读（数据路径唤醒） */
+static void idclass_dns_fd_cb(struct uloop_fd *fd, unsigned int events) {
+    dns_batch_stats.wakeups++;
+    idclass_dns_consume();
 }
 
-/* 内部函数：CNAME 缓存垃圾回收 */
-static void idclass_cname_cache_gc(struct uloop_timeout *timeout) {
-    struct cname_entry *e, *tmp;
-    avl_for_each_element_safe(&cname_cache, e, node, tmp) {
-        if (e->age++ < 5)
-            continue;
-        avl_delete(&cname_cache, &e->node);
-        if (e->pattern[0] == '/')
-            regfree(&e->regex);
-        free(e);
-    }
-    uloop_timeout_set(timeout, 1000);
+/* 内部函数：定时取走数据路径没有唤醒的（已预先标记的）应答 */
+static void idclass_dns_drain_cb(struct uloop_timeout *t) {
+    if (idclass_dns_consume())
+        dns_batch_stats.drains++;
+    uloop_timeout_set(t, IDCLASS_DNS_DRAIN_MS);
 }
 
-/* 内部函数：打开原始套接字监听 DNS 流量（在 ifb-dns 上） */
-static int idclass_open_dns_socket(void) {
-    struct sockaddr_ll sll = {
-        .sll_family = AF_PACKET,
-        .sll_protocol = htons(ETH_P_ALL),
-    };
-    int sock;
-
-    sock = socket(PF_PACKET, SOCK_RAW, htons(ETH_P_ALL));
-    if (sock == -1) {
-        ULOG_ERR("failed to create raw socket: %s\n", strerror(errno));
-        return -1;
-    }
+/*
+ * 内部函数：CNAME 缓存垃圾回收。每秒只检查 CNAME_SWEEP_STEPS 个槽位，
+ * 开销与缓存大小无关；没被扫到的过期条目在查询或置换时回收。
+ */
+static void idclass_cname_cache_gc(struct uloop_timeout *timeout) {
+    uint32_t now = cname_now();
+    struct cname_entry *e;
+    int i;
 
-    sll.sll_ifindex = if_nametoindex(IDCLASS_DNS_IFNAME);
-    if (bind(sock, (struct sockaddr *)&sll, sizeof(sll))) {
-        ULOG_ERR("failed to bind socket to " IDCLASS_DNS_IFNAME ": %s\n",
-                 strerror(errno));
-        close(sock);
-        return -1;
+    for (i = 0; i < CNAME_SWEEP_STEPS; i++) {
+        e = cname_slots[cname_sweep];
+        cname_sweep = (cname_sweep + 1) % CNAME_CACHE_SIZE;
+        if (!e || !cname_invalid(e, now))
+            continue;
+        cname_cache_free(e);
     }
+    if (!avl_is_empty(&cname_cache))
+        uloop_timeout_set(timeout, 1000);
+}
 
-    ufd.fd = sock;
-    ufd.cb = idclass_dns_socket_cb;
-    uloop_fd_add(&ufd, ULOOP_READ);
-    return 0;
+/* 外部接口：数据路径是否应把 DNS 应答送上来（global_config.dns_capture） */
+bool dns_parser_active(void) {
+    return dns_rb != NULL;
 }
 
-/* 内部函数：删除 ifb-dns 设备 */
-static void idclass_dns_del_ifb(void) {
-    idclass_run_cmd("ip link del ifb-dns type ifb", true);
+/* 外部接口：DNS 统计，加入 get_stats 输出 */
+void dns_parser_stats(struct blob_buf *b, bool reset) {
+    void *c, *t;
+
+    c = blobmsg_open_table(b, "dns");
+    blobmsg_add_u8(b, "capture", dns_parser_active());
+    blobmsg_add_u64(b, "responses", dns_responses);
+    blobmsg_add_u64(b, "sent", map_manager_read_counter(IDCLASS_CNT_DNS_SENT, reset));
+    blobmsg_add_u64(b, "dropped", map_manager_read_counter(IDCLASS_CNT_DNS_DROP, reset));
+    blobmsg_add_u64(b, "premarked", map_manager_read_counter(IDCLASS_CNT_DNS_PREMARK, reset));
+    blobmsg_add_u64(b, "deferred", map_manager_read_counter(IDCLASS_CNT_DNS_DEFERRED, reset));
+    blobmsg_add_u64(b, "tcp", map_manager_read_counter(IDCLASS_CNT_DNS_TCP, reset));
+    blobmsg_add_u64(b, "wakeups", dns_batch_stats.wakeups);
+    blobmsg_add_u64(b, "drains", dns_batch_stats.drains);
+    blobmsg_add_u32(b, "last_batch", dns_batch_stats.last_batch);
+    blobmsg_add_u32(b, "max_batch", dns_batch_stats.max_batch);
+    t = blobmsg_open_table(b, "cname_cache");
+    blobmsg_add_u32(b, "entries", cname_cache.count);
+    blobmsg_add_u32(b, "size", CNAME_CACHE_SIZE);
+    blobmsg_add_u64(b, "hits", cname_stats.hits);
+    blobmsg_add_u64(b, "misses", cname_stats.misses);
+    blobmsg_add_u64(b, "inserts", cname_stats.inserts);
+    blobmsg_add_u64(b, "evicted", cname_stats.evicted);
+    blobmsg_add_u64(b, "expired", cname_stats.expired);
+    blobmsg_add_u64(b, "stale", cname_stats.stale);
+    blobmsg_close_table(b, t);
+    blobmsg_close_table(b, c);
+
+    if (!reset)
+        return;
+    dns_responses = 0;
+    memset(&dns_batch_stats, 0, sizeof(dns_batch_stats));
+    memset(&cname_stats, 0, sizeof(cname_stats));
 }
 
 /* 外部接口：初始化 DNS 解析模块 */
 int dns_parser_init(void) {
+    int fd;
+
     cname_gc_timer.cb = idclass_cname_cache_gc;
-    idclass_cname_cache_gc(&cname_gc_timer);
 
-    idclass_dns_del_ifb();
+    fd = bpf_obj_get(CLASSIFY_DATA_PATH "/dns_events");
+    if (fd < 0) {
+        ULOG_ERR("failed to open DNS ring buffer: %s\n", strerror(errno));
+        return -1;
+    }
 
-    if (idclass_run_cmd("ip link add ifb-dns type ifb", false) ||
-        idclass_run_cmd("ip link set dev ifb-dns up", false) ||
-        idclass_open_dns_socket()) {
+    dns_rb = ring_buffer__new(fd, idclass_dns_event_cb, NULL, NULL);
+    close(fd);
+    if (!dns_rb) {
+        ULOG_ERR("failed to create DNS ring buffer consumer\n");
         return -1;
     }
 
+    ufd.fd = ring_buffer__epoll_fd(dns_rb);
+    ufd.cb = idclass_dns_fd_cb;
+    uloop_fd_add(&ufd, ULOOP_READ);
+    dns_drain_timer.cb = idclass_dns_drain_cb;
+    uloop_timeout_set(&dns_drain_timer, IDCLASS_DNS_DRAIN_MS);
+
+    /* 有消费者后再打开数据路径的 DNS 捕获 */
+    map_manager_update_config();
     return 0;
 }
 
@@ -389,16 +486,17 @@ int dns_parser_init(void) {
 void dns_parser_stop(void) {
     struct cname_entry *e, *tmp;
 
-    if (ufd.registered) {
+    if (dns_rb) {
+        uloop_timeout_cancel(&dns_drain_timer);
         uloop_fd_delete(&ufd);
-        close(ufd.fd);
+        ring_buffer__free(dns_rb);
+        dns_rb = NULL;
+        map_manager_update_config();
     }
 
-    idclass_dns_del_ifb();
-
+    uloop_timeout_cancel(&cname_gc_timer);
     avl_remove_all_elements(&cname_cache, e, node, tmp) {
-        if (e->pattern[0] == '/')
-            regfree(&e->regex);
+        cname_slots[e->slot] = NULL;
         free(e);
     }
 }
\ No newline at end of file
@@ -2,19 +2,39 @@
 /*
  * ebpf_loader.c - eBPF program loader module
  *
- * Loads eBPF programs from the object file, pins them to the filesystem,
+ * Loads the eBPF object once, pins its program variants to the filesystem,
  * and provides access to program file descriptors. Also sets program flags
- * based on global configuration (e.g., DSCP mode). Uses config module to
- * retrieve current UCI configuration name.
+ * based on global configuration (e.g., DSCP mode) and compiles the enabled
+ * flow features in as load-time constants. Uses config module to retrieve
+ * current UCI configuration name.
+ *
+ * With warm restart enabled (the default), maps pinned by the previous run
+ * are kept if their layout version matches, so flow statistics and learned
+ * mappings survive a daemon restart.
  */
 #include "common.h"
 #include <sys/resource.h>
 #include <glob.h>
+#include <time.h>
 #include <uci.h>
+#include <bpf/btf.h>
 
 #define CLASSIFY_PROG_PATH   "/lib/bpf/idclass-bpf.o"
 
-/* eBPF program variants (different flags combinations) */
+/* Load-time flags shared by all variants (IDCLASS_SET_DSCP, IDCLASS_PERCPU_STATS) */
+static uint32_t load_flags;
+/* Feature set compiled into the loaded programs (FEATURE_*) */
+static uint32_t load_features = FEATURE_ALL;
+/* Duration of the last object load (open, verify, pin) */
+static uint32_t load_time_us;
+/* Idle flow sweeper (run from userspace via BPF_PROG_TEST_RUN) */
+static int sweep_fd = -1;
+/* Keep compatible pinned maps and map_data across restarts (option warm_restart) */
+static bool warm_restart = true;
+/* Pinned maps of the previous run were reused by the current load */
+static bool maps_reused;
+
+/* eBPF program variants: entry points classify_<suffix> of one object */
 static struct {
     const char *suffix;
     uint32_t flags;
@@ -40,51 +60,190 @@ static void idclass_init_env(void) {
     setrlimit(RLIMIT_MEMLOCK, &limit);
 }
 
-/* Fill .rodata section of the eBPF object with module flags */
-static void idclass_fill_rodata(struct bpf_object *obj, uint32_t flags) {
+/* Patch one load-time constant in the .rodata section, located via BTF */
+static int idclass_set_rodata(struct bpf_object *obj, void *data, size_t size,
+                              const char *name, uint32_t val) {
+    struct btf *btf = bpf_object__btf(obj);
+    const struct btf_var_secinfo *vs;
+    const struct btf_type *sec;
+    int id, i;
+
+    if (!btf)
+        return -1;
+    id = btf__find_by_name_kind(btf, ".rodata", BTF_KIND_DATASEC);
+    if (id < 0)
+        return -1;
+
+    sec = btf__type_by_id(btf, id);
+    vs = btf_var_secinfos(sec);
+    for (i = 0; i < btf_vlen(sec); i++, vs++) {
+        const struct btf_type *var = btf__type_by_id(btf, vs->type);
+
+        if (strcmp(btf__name_by_offset(btf, var->name_off), name) != 0)
+            continue;
+        if (vs->size != sizeof(val) || vs->offset + vs->size > size)
+            return -1;
+        memcpy(data + vs->offset, &val, sizeof(val));
+        return 0;
+    }
+    return -1;
+}
+
+/* Fill .rodata section of the eBPF object with module flags and features */
+static int idclass_fill_rodata(struct bpf_object *obj, uint32_t flags, uint32_t features) {
     struct bpf_map *map = NULL;
+    const void *init;
+    void *data;
+    size_t size;
+    int ret;
+
     while ((map = bpf_object__next_map(obj, map)) != NULL) {
-        if (!strstr(bpf_map__name(map), ".rodata"))
-            continue;
-        bpf_map__set_initial_value(map, &flags, sizeof(flags));
+        if (strstr(bpf_map__name(map), ".rodata"))
+            break;
     }
+    if (!map)
+        return -1;
+
+    init = bpf_map__initial_value(map, &size);
+    data = init ? malloc(size) : NULL;
+    if (!data)
+        return -1;
+    memcpy(data, init, size);
+
+    ret = idclass_set_rodata(obj, data, size, "module_flags", flags);
+    if (!ret)
+        ret = idclass_set_rodata(obj, data, size, "module_features", features);
+    if (!ret)
+        ret = idclass_set_rodata(obj, data, size, "nr_cpus", libbpf_num_possible_cpus());
+    if (!ret)
+        ret = bpf_map__set_initial_value(map, data, size);
+    free(data);
+
+    if (ret)
+        fprintf(stderr, "Failed to set load-time constants in .rodata\n");
+    return ret;
 }
 
-/* Load and pin a single eBPF program variant */
-static int idclass_create_program(int idx) {
-    DECLARE_LIBBPF_OPTS(bpf_object_open_opts, opts,
-        .pin_root_path = CLASSIFY_DATA_PATH,
-    );
-    struct bpf_program *prog;
-    struct bpf_object *obj;
-    char path[256];
-    int err;
-    uint32_t flags = bpf_progs[idx].flags;
+/* Only one of the two flow statistics maps is used, shrink the other one */
+static void idclass_shrink_unused_maps(struct bpf_object *obj, uint32_t flags) {
+    const char *unused = (flags & IDCLASS_PERCPU_STATS) ?
+                         "flow_stats_map" : "flow_stats_percpu";
+    struct bpf_map *map = bpf_object__find_map_by_name(obj, unused);
+
+    if (map)
+        bpf_map__set_max_entries(map, 1);
+}
+
+/*
+ * Read the load-time settings from UCI: DSCP marking mode, per-CPU flow
+ * statistics and the enabled flow features (same options as the idclass
+ * section parsed by the config module).
+ */
+static void idclass_read_uci_flags(void) {
+    struct idclass_flow_config fcfg;
+    struct uci_context *uci;
+    struct uci_package *pkg;
+    uint32_t flags = 0;
 
     /* Get current UCI configuration name from config module */
     const char *config_name = config_get_name();
     if (!config_name)
         config_name = "qos_gargoyle";  // fallback
 
-    /* Check global algorithm setting to decide if DSCP marking should be enabled */
-    const char *alg = NULL;
-    struct uci_context *uci = uci_alloc_context();
-    if (uci) {
-        struct uci_package *pkg;
-        if (uci_load(uci, config_name, &pkg) == UCI_OK) {
-            struct uci_section *s = uci_lookup_section(uci, pkg, "global");
-            if (s) {
-                alg = uci_lookup_option_string(uci, s, "algorithm");
+    uci = uci_alloc_context();
+    if (!uci)
+        return;
+
+    if (uci_load(uci, config_name, &pkg) == UCI_OK) {
+        struct uci_section *s = uci_lookup_section(uci, pkg, "global");
+        const char *val;
+
+        /* Check global algorithm setting to decide if DSCP marking should be enabled */
+        if (s) {
+            val = uci_lookup_option_string(uci, s, "algorithm");
+            if (val && (strcmp(val, "cake") == 0 || strcmp(val, "cake_dscp") == 0))
+                flags |= IDCLASS_SET_DSCP;
+        }
+        /* Per-CPU flow statistics (no atomics on the per-packet path) */
+        s = uci_lookup_section(uci, pkg, "idclass");
+        if (s) {
+            struct blob_buf b = {};
+            struct uci_element *e;
+
+            val = uci_lookup_option_string(uci, s, "percpu_stats");
+            if (val && !strcmp(val, "1"))
+                flags |= IDCLASS_PERCPU_STATS;
+
+            val = uci_lookup_option_string(uci, s, "warm_restart");
+            warm_restart = !val || strcmp(val, "0") != 0;
+
+            /* Enabled features become load-time constants */
+            blob_buf_init(&b, 0);
+            uci_foreach_element(&s->options, e) {
+                struct uci_option *o = uci_to_option(e);
+                if (o->type == UCI_TYPE_STRING)
+                    blobmsg_add_string(&b, o->e.name, o->v.string);
             }
-            uci_unload(uci, pkg);
+            memset(&fcfg, 0, sizeof(fcfg));
+            if (config_parse_flow_config(&fcfg, b.head, true) == 0)
+                load_features = fcfg.feature_mask;
+            blob_buf_free(&b);
         }
-        uci_free_context(uci);
+        uci_unload(uci, pkg);
     }
-    if (alg && (strcmp(alg, "cake") == 0 || strcmp(alg, "cake_dscp") == 0)) {
-        flags |= IDCLASS_SET_DSCP;
+    uci_free_context(uci);
+
+    load_flags = flags;
+}
+
+/* Record the layout of the pinned maps for the next warm restart */
+static void idclass_write_layout_version(struct bpf_object *obj) {
+    struct bpf_map *map = bpf_object__find_map_by_name(obj, "layout_version");
+    uint32_t key = 0, version = IDCLASS_MAP_LAYOUT_VERSION;
+
+    if (map)
+        bpf_map_update_elem(bpf_map__fd(map), &key, &version, BPF_ANY);
+}
+
+/* Do the maps pinned by a previous run have the layout this object expects? */
+static bool idclass_pins_compatible(void) {
+    uint32_t key = 0, version = 0;
+    int fd, ret;
+
+    fd = bpf_obj_get(CLASSIFY_DATA_PATH "/layout_version");
+    if (fd < 0)
+        return false;
+    ret = bpf_map_lookup_elem(fd, &key, &version);
+    close(fd);
+    return !ret && version == IDCLASS_MAP_LAYOUT_VERSION;
+}
+
+/* Remove all pinned maps, the next load creates them empty */
+static void idclass_unpin_maps(void) {
+    glob_t g;
+    int i;
+
+    if (glob(CLASSIFY_DATA_PATH "/*", 0, NULL, &g) == 0) {
+        for (i = 0; i < g.gl_pathc; i++)
+            unlink(g.gl_pathv[i]);
+        globfree(&g);
     }
+}
 
-    snprintf(path, sizeof(path), CLASSIFY_PIN_PATH "_%s", bpf_progs[idx].suffix);
+/*
+ * Load the object once and pin every program variant. All variants are entry
+ * points of the same object, so they share every map, and the UCI package is
+ * read once per load instead of once per variant.
+ */
+static int idclass_load_programs(void) {
+    DECLARE_LIBBPF_OPTS(bpf_object_open_opts, opts,
+        .pin_root_path = CLASSIFY_DATA_PATH,
+    );
+    struct bpf_program *progs[ARRAY_SIZE(bpf_progs)];
+    struct bpf_program *sweep;
+    struct bpf_object *obj;
+    char path[256];
+    int i, err;
 
     obj = bpf_object__open_file(CLASSIFY_PROG_PATH, &opts);
     err = libbpf_get_error(obj);
@@ -93,70 +252,150 @@ static int idclass_create_program(int idx) {
         return -1;
     }
 
-    prog = bpf_object__find_program_by_name(obj, "classify");
-    if (!prog) {
-        fprintf(stderr, "Can't find classifier prog\n");
-        bpf_object__close(obj);
-        return -1;
+    for (i = 0; i < ARRAY_SIZE(bpf_progs); i++) {
+        snprintf(path, sizeof(path), "classify_%s", bpf_progs[i].suffix);
+        progs[i] = bpf_object__find_program_by_name(obj, path);
+        if (!progs[i]) {
+            fprintf(stderr, "Can't find classifier prog %s\n", path);
+            goto error;
+        }
+        bpf_program__set_type(progs[i], BPF_PROG_TYPE_SCHED_CLS);
     }
 
-    bpf_program__set_type(prog, BPF_PROG_TYPE_SCHED_CLS);
-    idclass_fill_rodata(obj, flags);
+    sweep = bpf_object__find_program_by_name(obj, "flow_sweep");
+    if (!sweep) {
+        fprintf(stderr, "Can't find flow_sweep prog\n");
+        goto error;
+    }
+    bpf_program__set_type(sweep, BPF_PROG_TYPE_SCHED_CLS);
+
+    if (idclass_fill_rodata(obj, load_flags, load_features))
+        goto error;
+    idclass_shrink_unused_maps(obj, load_flags);
 
     err = bpf_object__load(obj);
     if (err) {
         fprintf(stderr, "bpf_object__load failed: %s\n", strerror(-err));
-        bpf_object__close(obj);
-        return -1;
+        goto error;
     }
+    idclass_write_layout_version(obj);
 
-    libbpf_set_print(NULL);
+    for (i = 0; i < ARRAY_SIZE(bpf_progs); i++) {
+        snprintf(path, sizeof(path), CLASSIFY_PIN_PATH "_%s", bpf_progs[i].suffix);
+        unlink(path);
+        err = bpf_program__pin(progs[i], path);
+        if (err) {
+            fprintf(stderr, "Failed to pin program to %s: %s\n",
+                    path, strerror(-err));
+            goto error;
+        }
+    }
 
-    unlink(path);
-    err = bpf_program__pin(prog, path);
-    if (err) {
-        fprintf(stderr, "Failed to pin program to %s: %s\n",
-                path, strerror(-err));
-        bpf_object__close(obj);
-        return -1;
+    /* 清理程序不挂载到接口，只需保留 fd */
+    err = dup(bpf_program__fd(sweep));
+    if (err >= 0) {
+        if (sweep_fd >= 0)
+            close(sweep_fd);
+        sweep_fd = err;
     }
 
     bpf_object__close(obj);
 
-    err = bpf_obj_get(path);
-    if (err < 0) {
-        fprintf(stderr, "Failed to load pinned program %s: %s\n",
-                path, strerror(errno));
-        return -1;
+    for (i = 0; i < ARRAY_SIZE(bpf_progs); i++) {
+        snprintf(path, sizeof(path), CLASSIFY_PIN_PATH "_%s", bpf_progs[i].suffix);
+        err = bpf_obj_get(path);
+        if (err < 0) {
+            fprintf(stderr, "Failed to load pinned program %s: %s\n",
+                    path, strerror(errno));
+            return -1;
+        }
+        if (bpf_progs[i].fd >= 0)
+            close(bpf_progs[i].fd);
+        bpf_progs[i].fd = err;
     }
-    bpf_progs[idx].fd = err;
 
     return 0;
+
+error:
+    bpf_object__close(obj);
+    return -1;
+}
+
+/* Helper: microseconds elapsed since *start */
+static uint32_t idclass_elapsed_us(const struct timespec *start) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000000 +
+           (now.tv_nsec - start->tv_nsec) / 1000;
 }
 
 /* External interface: initialize eBPF loader module */
 int ebpf_loader_init(void) {
-    glob_t g;
-    int i;
-
-    /* Clean up any old pinned programs */
-    if (glob(CLASSIFY_DATA_PATH "/*", 0, NULL, &g) == 0) {
-        for (i = 0; i < g.gl_pathc; i++)
-            unlink(g.gl_pathv[i]);
-        globfree(&g);
-    }
+    struct timespec start;
+    int ret;
 
+    clock_gettime(CLOCK_MONOTONIC, &start);
     libbpf_set_print(idclass_bpf_pr);
     idclass_init_env();
+    idclass_read_uci_flags();
 
-    for (i = 0; i < ARRAY_SIZE(bpf_progs); i++) {
-        if (idclass_create_program(i))
-            return -1;
+    /* 冷启动或布局不同时清掉上次运行固定的 map */
+    maps_reused = warm_restart && idclass_pins_compatible();
+    if (!maps_reused)
+        idclass_unpin_maps();
+
+    ret = idclass_load_programs();
+    if (ret && maps_reused) {
+        /* 例如 percpu_stats 改变后 map 大小不再一致 */
+        fprintf(stderr, "Pinned maps not reusable, starting with empty maps\n");
+        maps_reused = false;
+        idclass_unpin_maps();
+        ret = idclass_load_programs();
     }
+    libbpf_set_print(NULL);
+    if (ret)
+        return -1;
 
+    load_time_us = idclass_elapsed_us(&start);
     return 0;
 }
 
+/*
+ * External interface: rebuild all program variants for a new feature set.
+ * Pinned maps are reused, so flow state survives. Returns 1 if the programs
+ * were replaced, 0 if the feature set is unchanged and -1 on error. On 1 the
+ * caller runs interface_reload_programs(), which swaps the new programs into
+ * the attached filters in place (interface_swap_programs() replaces the
+ * cls_bpf filter by handle IDCLASS_FILTER_HANDLE); only an interface where
+ * that fails is stopped and started again.
+ */
+int ebpf_loader_set_features(uint32_t features) {
+    uint32_t old_features = load_features;
+    struct timespec start;
+    int ret;
+
+    features &= FEATURE_ALL;
+    if (features == load_features)
+        return 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    load_features = features;
+    libbpf_set_print(idclass_bpf_pr);
+    ret = idclass_load_programs();
+    libbpf_set_print(NULL);
+    if (ret) {
+        /* 保留旧程序继续工作 */
+        load_features = old_features;
+        return -1;
+    }
+    load_time_us = idclass_elapsed_us(&start);
+
+    ULOG_INFO("classifier rebuilt for feature mask 0x%x (was 0x%x) in %u us\n",
+              features, old_features, load_time_us);
+    return 1;
+}
+
 /* External interface: get file descriptor and suffix for a program with given flags */
 const char *ebpf_loader_get_program(uint32_t flags, int *fd) {
     int i;
@@ -171,4 +410,112 @@ const char *ebpf_loader_get_program(uint32_t flags, int *fd) {
         }
     }
     return NULL;
-}
\ No newline at end of file
+}
+
+/* External interface: get load-time flags shared by all program variants */
+uint32_t ebpf_loader_get_flags(void) {
+    return load_flags;
+}
+
+/* External interface: get the feature set compiled into the loaded programs */
+uint32_t ebpf_loader_get_features(void) {
+    return load_features;
+}
+
+/* External interface: get the idle flow sweeper program (-1 if unavailable) */
+int ebpf_loader_get_sweep_fd(void) {
+    return sweep_fd;
+}
+
+/* External interface: is warm restart enabled (option warm_restart)? */
+bool ebpf_loader_warm_restart(void) {
+    return warm_restart;
+}
+
+/* External interface: were the maps pinned by the previous run reused? */
+bool ebpf_loader_maps_reused(void) {
+    return maps_reused;
+}
+
+/* External interface: get the duration of the last program load */
+uint32_t ebpf_loader_get_load_time(void) {
+    return load_time_us;
+}
+
+/*
+ * External interface: load an unpinned private copy of the classifier (plus
+ * the flow_sweep program) for benchmarking. Maps are not shared with the
+ * running daemon; if maps_from is given, the new object uses that object's
+ * maps instead of creating its own, so e.g. an egress and an ingress copy see
+ * the same flows. The caller owns the returned object and must close it with
+ * bpf_object__close().
+ */
+struct bpf_object *ebpf_loader_open_private(uint32_t flags, uint32_t features,
+                                            struct bpf_object *maps_from, int *prog_fd) {
+    struct bpf_program *prog, *p;
+    struct bpf_object *obj;
+    struct bpf_map *map = NULL;
+    int i, err;
+
+    obj = bpf_object__open_file(CLASSIFY_PROG_PATH, NULL);
+    err = libbpf_get_error(obj);
+    if (err) {
+        fprintf(stderr, "bpf_object__open_file failed: %s\n", strerror(-err));
+        return NULL;
+    }
+
+    /* 只加载与 flags 对应的入口和 flow_sweep，其余入口不经过校验器 */
+    prog = NULL;
+    for (i = 0; i < ARRAY_SIZE(bpf_progs); i++) {
+        char name[64];
+
+        snprintf(name, sizeof(name), "classify_%s", bpf_progs[i].suffix);
+        p = bpf_object__find_program_by_name(obj, name);
+        if (!p)
+            continue;
+        if (bpf_progs[i].flags == (flags & (IDCLASS_INGRESS | IDCLASS_IP_ONLY)))
+            prog = p;
+        else
+            bpf_program__set_autoload(p, false);
+    }
+    if ((p = bpf_object__find_program_by_name(obj, "flow_sweep")) != NULL)
+        bpf_program__set_type(p, BPF_PROG_TYPE_SCHED_CLS);
+    if (!prog) {
+        fprintf(stderr, "Can't find classifier prog\n");
+        bpf_object__close(obj);
+        return NULL;
+    }
+
+    while ((map = bpf_object__next_map(obj, map)) != NULL) {
+        struct bpf_map *src;
+
+        bpf_map__set_pin_path(map, NULL);
+        /* .rodata 等内部 map 保存各自的加载时常量，不共享 */
+        if (!maps_from || bpf_map__is_internal(map))
+            continue;
+        src = bpf_object__find_map_by_name(maps_from, bpf_map__name(map));
+        if (src && bpf_map__reuse_fd(map, bpf_map__fd(src))) {
+            fprintf(stderr, "Failed to share map %s\n", bpf_map__name(map));
+            bpf_object__close(obj);
+            return NULL;
+        }
+    }
+
+    bpf_program__set_type(prog, BPF_PROG_TYPE_SCHED_CLS);
+    if (idclass_fill_rodata(obj, flags, features)) {
+        bpf_object__close(obj);
+        return NULL;
+    }
+    idclass_shrink_unused_maps(obj, flags);
+
+    idclass_init_env();
+    err = bpf_object__load(obj);
+    if (err) {
+        fprintf(stderr, "bpf_object__load failed: %s\n", strerror(-err));
+        bpf_object__close(obj);
+        return NULL;
+    }
+
+    *prog_fd = bpf_program__fd(prog);
+    return obj;
+}
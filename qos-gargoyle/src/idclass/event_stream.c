@@ -0,0 +1,208 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * event_stream.c - datapath event stream
+ *
+ * Consumes the classifier's ring buffer (new flow, class change, flow end,
+ * map full) from the uloop and republishes each event as a ubus notification
+ * on the idclass object. The datapath only produces events while the object
+ * has subscribers, and userspace throttles notifications to a fixed rate;
+ * both kinds of loss are counted.
+ */
+#include "common.h"
+#include <time.h>
+
+/* 每秒最多转发的通知数，超出部分计入 throttled */
+#define EVENT_STREAM_RATE   1000
+
+static const char * const event_names[__IDCLASS_EV_MAX] = {
+    [IDCLASS_EV_FLOW_NEW] = "flow_new",
+    [IDCLASS_EV_CLASS_CHANGE] = "class_change",
+    [IDCLASS_EV_FLOW_END] = "flow_end",
+    [IDCLASS_EV_MAP_FULL] = "map_full",
+};
+
+static const char * const prio_names[] = {
+    "realtime", "video", "normal", "bulk",
+};
+
+static struct ring_buffer *event_rb;
+static struct uloop_fd event_ufd;
+static struct blob_buf event_buf;
+static bool event_subscribed;
+
+static uint64_t event_received[__IDCLASS_EV_MAX];
+static uint64_t event_notified;
+static uint64_t event_throttled;
+static uint64_t event_invalid;
+
+/* 令牌桶：每秒补充 EVENT_STREAM_RATE 个 */
+static uint32_t event_tokens = EVENT_STREAM_RATE;
+static uint32_t event_token_sec;
+
+/* Helper: take one notification token, false if over the rate limit */
+static bool event_stream_take_token(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    if (ts.tv_sec != event_token_sec) {
+        event_token_sec = ts.tv_sec;
+        event_tokens = EVENT_STREAM_RATE;
+    }
+    if (!event_tokens)
+        return false;
+    event_tokens--;
+    return true;
+}
+
+/* Helper: add the client address of an event as a string */
+static void event_stream_add_client(const struct idclass_event *ev) {
+    char *buf;
+
+    if (!ev->client_family)
+        return;
+
+    buf = blobmsg_alloc_string_buffer(&event_buf, "client", INET6_ADDRSTRLEN);
+    if (ev->client_family == 4)
+        inet_ntop(AF_INET, ev->client_ip + 12, buf, INET6_ADDRSTRLEN);
+    else
+        inet_ntop(AF_INET6, ev->client_ip, buf, INET6_ADDRSTRLEN);
+    blobmsg_add_string_buffer(&event_buf);
+}
+
+/* Helper: ring buffer callback, one call per event */
+static int event_stream_cb(void *ctx, void *data, size_t size) {
+    const struct idclass_event *ev = data;
+    void *c;
+    int i;
+
+    if (size < sizeof(*ev) || ev->type >= __IDCLASS_EV_MAX) {
+        event_invalid++;
+        return 0;
+    }
+
+    event_received[ev->type]++;
+    if (!event_subscribed)
+        return 0;
+    if (!event_stream_take_token()) {
+        event_throttled++;
+        return 0;
+    }
+
+    blob_buf_init(&event_buf, 0);
+    blobmsg_add_u32(&event_buf, "hash", ev->hash);
+    blobmsg_add_u64(&event_buf, "ts_ns", ev->ts_ns);
+
+    switch (ev->type) {
+    case IDCLASS_EV_FLOW_NEW:
+        event_stream_add_client(ev);
+        blobmsg_add_u8(&event_buf, "ingress", ev->ingress);
+        break;
+    case IDCLASS_EV_CLASS_CHANGE:
+        event_stream_add_client(ev);
+        blobmsg_add_u8(&event_buf, "ingress", ev->ingress);
+        if (ev->old_prio < ARRAY_SIZE(prio_names))
+            blobmsg_add_string(&event_buf, "old", prio_names[ev->old_prio]);
+        if (ev->new_prio < ARRAY_SIZE(prio_names))
+            blobmsg_add_string(&event_buf, "new", prio_names[ev->new_prio]);
+        c = blobmsg_open_table(&event_buf, "scores");
+        for (i = 0; i < ARRAY_SIZE(prio_names); i++)
+            blobmsg_add_u32(&event_buf, prio_names[i], ev->scores[i]);
+        blobmsg_close_table(&event_buf, c);
+        blobmsg_add_u32(&event_buf, "packets", ev->packets);
+        blobmsg_add_u32(&event_buf, "bytes", ev->bytes);
+        blobmsg_add_u32(&event_buf, "duration_ms", ev->duration_ms);
+        break;
+    case IDCLASS_EV_FLOW_END:
+        event_stream_add_client(ev);
+        blobmsg_add_u32(&event_buf, "packets", ev->packets);
+        blobmsg_add_u32(&event_buf, "bytes", ev->bytes);
+        blobmsg_add_u32(&event_buf, "duration_ms", ev->duration_ms);
+        break;
+    case IDCLASS_EV_MAP_FULL:
+        blobmsg_add_string(&event_buf, "map",
+                           ev->map == IDCLASS_EV_MAP_CONN ? "ip_conn_map" : "flow_stats");
+        break;
+    }
+
+    ubus_server_notify(event_names[ev->type], event_buf.head);
+    event_notified++;
+    return 0;
+}
+
+/* Helper: uloop callback for the ring buffer epoll fd */
+static void event_stream_fd_cb(struct uloop_fd *fd, unsigned int events) {
+    ring_buffer__consume(event_rb);
+}
+
+/* External: enable datapath events while the ubus object has subscribers */
+void event_stream_set_subscribed(bool subscribed) {
+    if (event_subscribed == subscribed)
+        return;
+    event_subscribed = subscribed;
+    map_manager_update_config();
+}
+
+/* External: event types the datapath should produce (global_config.event_mask) */
+uint8_t event_stream_get_mask(void) {
+    return (event_rb && event_subscribed) ? IDCLASS_EV_ALL : 0;
+}
+
+/* External: add event stream counters to get_stats output */
+void event_stream_stats(struct blob_buf *b, bool reset) {
+    void *c;
+    int i;
+
+    c = blobmsg_open_table(b, "events");
+    blobmsg_add_u8(b, "subscribed", event_subscribed);
+    blobmsg_add_u64(b, "sent", map_manager_read_counter(IDCLASS_CNT_EV_SENT, reset));
+    blobmsg_add_u64(b, "dropped", map_manager_read_counter(IDCLASS_CNT_EV_DROP, reset));
+    for (i = 0; i < __IDCLASS_EV_MAX; i++)
+        blobmsg_add_u64(b, event_names[i], event_received[i]);
+    blobmsg_add_u64(b, "notified", event_notified);
+    blobmsg_add_u64(b, "throttled", event_throttled);
+    blobmsg_add_u64(b, "invalid", event_invalid);
+    blobmsg_close_table(b, c);
+
+    if (!reset)
+        return;
+    memset(event_received, 0, sizeof(event_received));
+    event_notified = event_throttled = event_invalid = 0;
+}
+
+/* External: open the pinned ring buffer and start consuming it */
+int event_stream_init(void) {
+    int fd;
+
+    fd = bpf_obj_get(CLASSIFY_DATA_PATH "/events");
+    if (fd < 0) {
+        ULOG_ERR("Failed to open event ring buffer: %s\n", strerror(errno));
+        return -1;
+    }
+
+    event_rb = ring_buffer__new(fd, event_stream_cb, NULL, NULL);
+    close(fd);
+    if (!event_rb) {
+        ULOG_ERR("Failed to create ring buffer consumer\n");
+        return -1;
+    }
+
+    event_ufd.fd = ring_buffer__epoll_fd(event_rb);
+    event_ufd.cb = event_stream_fd_cb;
+    uloop_fd_add(&event_ufd, ULOOP_READ);
+
+    /* 启动前已有订阅者 */
+    if (event_subscribed)
+        map_manager_update_config();
+    return 0;
+}
+
+/* External: stop consuming events */
+void event_stream_stop(void) {
+    if (!event_rb)
+        return;
+
+    uloop_fd_delete(&event_ufd);
+    ring_buffer__free(event_rb);
+    event_rb = NULL;
+    blob_buf_free(&event_buf);
+}
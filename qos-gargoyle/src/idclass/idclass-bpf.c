@@ -22,9 +22,27 @@
 #include "idclass-bpf.h"
 
 #define INET_ECN_MASK 3
-#define EWMA_SHIFT 12
+
+/* TCP 选项（RTT 测量只需要时间戳） */
+#define TCP_OPT_EOL         0
+#define TCP_OPT_NOP         1
+#define TCP_OPT_TS          8
+#define TCP_OPT_TS_LEN      10
+#define TCP_MAX_OPTS        8
+#define TCP_FLAG_FIN        0x01
+#define TCP_FLAG_SYN        0x02
+#define TCP_FLAG_RST        0x04
+#define TCP_FLAG_ACK        0x10
 
 const volatile static __u32 module_flags = 0;
+/* 加载时启用的特征集合，未启用特征的代码由校验器裁剪 */
+const volatile static __u32 module_features = FEATURE_ALL;
+
+#define FEATURE_ON(f) (module_features & (f))
+
+/* 可能的 CPU 数（每 CPU 模式下重新评分和清理空闲流时遍历各分片） */
+const volatile static __u32 nr_cpus = 1;
+#define PERCPU_MAX_CPUS 64
 
 /* 上传方向：逻辑优先级 (0-3) → class_id */
 struct {
@@ -32,6 +50,7 @@ struct {
     __uint(max_entries, 4);
     __type(key, __u32);
     __type(value, __u32);
+    __uint(pinning, 1);
 } prio_class_up SEC(".maps");
 
 /* 下载方向：逻辑优先级 (0-3) → class_id */
@@ -40,6 +59,7 @@ struct {
     __uint(max_entries, 4);
     __type(key, __u32);
     __type(value, __u32);
+    __uint(pinning, 1);
 } prio_class_down SEC(".maps");
 
 /* class_mark map（用于最终 skb->mark 或 DSCP 值） */
@@ -48,17 +68,47 @@ struct {
     __uint(max_entries, IDCLASS_MAX_CLASS_ENTRIES + 1);
     __type(key, __u32);
     __type(value, __u32);
+    __uint(pinning, 1);
 } class_mark SEC(".maps");
 
 /* 每流统计 map */
 struct {
     __uint(type, BPF_MAP_TYPE_LRU_HASH);
     __uint(max_entries, 65536);
-    __type(key, __u32);
+    __type(key, struct flow_key);
     __type(value, struct flow_stats);
     __uint(pinning, 1);
 } flow_stats_map SEC(".maps");
 
+/* 每流冷数据 map（客户端地址、计数器高位） */
+struct {
+    __uint(type, BPF_MAP_TYPE_LRU_HASH);
+    __uint(max_entries, 65536);
+    __type(key, struct flow_key);
+    __type(value, struct flow_info);
+    __uint(pinning, 1);
+} flow_info_map SEC(".maps");
+
+/*
+ * 每 CPU 流统计 map（IDCLASS_PERCPU_STATS 模式）：每包只写本 CPU 的分片，
+ * 重新评分时合并全部分片，用户态读取时同样合并
+ */
+struct {
+    __uint(type, BPF_MAP_TYPE_LRU_PERCPU_HASH);
+    __uint(max_entries, 65536);
+    __type(key, struct flow_key);
+    __type(value, struct flow_stats);
+    __uint(pinning, 1);
+} flow_stats_percpu SEC(".maps");
+
+/* 合并后的评分输入（每 CPU 一份临时空间，记录太大放不进栈） */
+struct {
+    __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+    __uint(max_entries, 1);
+    __type(key, __u32);
+    __type(value, struct flow_stats);
+} flow_stats_scratch SEC(".maps");
+
 struct {
     __uint(type, BPF_MAP_TYPE_ARRAY);
     __uint(pinning, 1);
@@ -101,6 +151,25 @@ struct {
     __uint(map_flags, BPF_F_NO_PREALLOC);
 } ipv6_map SEC(".maps");
 
+/* CIDR 条目；主机条目仍在上面的 hash 中，精确匹配优先 */
+struct {
+    __uint(type, BPF_MAP_TYPE_LPM_TRIE);
+    __uint(pinning, 1);
+    __type(key, struct idclass_lpm4_key);
+    __type(value, struct idclass_ip_map_val);
+    __uint(max_entries, 16384);
+    __uint(map_flags, BPF_F_NO_PREALLOC);
+} ipv4_prefix_map SEC(".maps");
+
+struct {
+    __uint(type, BPF_MAP_TYPE_LPM_TRIE);
+    __uint(pinning, 1);
+    __type(key, struct idclass_lpm6_key);
+    __type(value, struct idclass_ip_map_val);
+    __uint(max_entries, 16384);
+    __uint(map_flags, BPF_F_NO_PREALLOC);
+} ipv6_prefix_map SEC(".maps");
+
 struct {
     __uint(type, BPF_MAP_TYPE_ARRAY);
     __uint(pinning, 1);
@@ -110,6 +179,57 @@ struct {
                         IDCLASS_DEFAULT_CLASS_ENTRIES);
 } class_map SEC(".maps");
 
+/* 固定 map 的布局版本，由加载器写入，数据路径不使用 */
+struct {
+    __uint(type, BPF_MAP_TYPE_ARRAY);
+    __uint(pinning, 1);
+    __type(key, __u32);
+    __type(value, __u32);
+    __uint(max_entries, 1);
+} layout_version SEC(".maps");
+
+/* 两代流特征配置，见 IDCLASS_FLOW_CONFIG_SLOTS */
+struct {
+    __uint(type, BPF_MAP_TYPE_ARRAY);
+    __uint(pinning, 1);
+    __type(key, __u32);
+    __type(value, struct idclass_flow_config);
+    __uint(max_entries, 2 * IDCLASS_FLOW_CONFIG_SLOTS);
+} flow_config_map SEC(".maps");
+
+/* 数据路径计数器（每 CPU，用户态求和） */
+struct {
+    __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+    __uint(pinning, 1);
+    __type(key, __u32);
+    __type(value, __u64);
+    __uint(max_entries, __IDCLASS_CNT_MAX);
+} classify_counters SEC(".maps");
+
+/* 低频事件通道（新建流、分类变化、流结束、map 满） */
+struct {
+    __uint(type, BPF_MAP_TYPE_RINGBUF);
+    __uint(max_entries, 256 * 1024);
+    __uint(pinning, 1);
+} events SEC(".maps");
+
+/* 上游 DNS 应答载荷，由 dns_parser 解析 */
+struct {
+    __uint(type, BPF_MAP_TYPE_RINGBUF);
+    __uint(max_entries, 512 * 1024);
+    __uint(pinning, 1);
+} dns_events SEC(".maps");
+
+/* 可在数据路径匹配的域名规则（见 struct idclass_dns_key） */
+struct {
+    __uint(type, BPF_MAP_TYPE_HASH);
+    __uint(pinning, 1);
+    __type(key, struct idclass_dns_key);
+    __type(value, struct idclass_dns_val);
+    __uint(max_entries, 4096);
+    __uint(map_flags, BPF_F_NO_PREALLOC);
+} dns_names SEC(".maps");
+
 /* ip_conn_map 的 key 类型 */
 struct ip_key {
     __u8 addr[16];
@@ -123,6 +243,183 @@ struct {
     __uint(pinning, 1);
 } ip_conn_map SEC(".maps");
 
+/* 被动 RTT 测量中待匹配的时间戳（只有 TCP 流） */
+struct {
+    __uint(type, BPF_MAP_TYPE_LRU_HASH);
+    __uint(max_entries, 8192);
+    __type(key, struct flow_key);
+    __type(value, struct flow_rtt);
+    __uint(pinning, 1);
+} flow_rtt_map SEC(".maps");
+
+/* 每客户端时延统计 */
+struct {
+    __uint(type, BPF_MAP_TYPE_LRU_HASH);
+    __uint(max_entries, 4096);
+    __type(key, struct ip_key);
+    __type(value, struct client_rtt);
+    __uint(pinning, 1);
+} client_rtt_map SEC(".maps");
+
+/* 每 WAN 接口的重传/乱序计数（用户态求和） */
+struct {
+    __uint(type, BPF_MAP_TYPE_PERCPU_HASH);
+    __uint(max_entries, 16);
+    __type(key, __u32);
+    __type(value, struct idclass_wan_loss);
+    __uint(pinning, 1);
+} wan_loss_map SEC(".maps");
+
+/*
+ * 统计字段更新：共享 map 需要原子操作，每 CPU map 只有本 CPU 写入，
+ * 直接读改写即可。module_flags 为加载时常量，未使用的分支由校验器裁剪。
+ */
+#define STAT_ADD(field, val) do {                       \
+    if (module_flags & IDCLASS_PERCPU_STATS)            \
+        (field) += (val);                               \
+    else                                                \
+        __sync_fetch_and_add(&(field), (val));          \
+} while (0)
+
+#define STAT_SET(field, val) do {                       \
+    if (module_flags & IDCLASS_PERCPU_STATS)            \
+        (field) = (val);                                \
+    else                                                \
+        __sync_lock_test_and_set(&(field), (val));      \
+} while (0)
+
+static __always_inline void count_inc(__u32 key)
+{
+    __u64 *val = bpf_map_lookup_elem(&classify_counters, &key);
+    if (val)
+        *val += 1;
+}
+
+/* 客户端连接数：新建流时加一，流过期时减一（计数归零的条目由用户态清理） */
+static __always_inline int conn_inc(struct ip_key *client)
+{
+    __u32 one = 1, *cnt;
+
+    cnt = bpf_map_lookup_elem(&ip_conn_map, client);
+    if (!cnt) {
+        if (!bpf_map_update_elem(&ip_conn_map, client, &one, BPF_NOEXIST))
+            return 0;
+        /* 与其他 CPU 同时插入 */
+        cnt = bpf_map_lookup_elem(&ip_conn_map, client);
+        if (!cnt)
+            return -1;
+    }
+    __sync_fetch_and_add(cnt, 1);
+    return 0;
+}
+
+static __always_inline void conn_dec(void *client)
+{
+    __u32 *cnt = bpf_map_lookup_elem(&ip_conn_map, client);
+
+    if (cnt && *cnt)
+        __sync_fetch_and_sub(cnt, 1);
+}
+
+/* 预留一个事件；类型未启用或 ring buffer 已满时返回 NULL */
+static __always_inline struct idclass_event *
+event_reserve(struct global_config *gcfg, __u32 type)
+{
+    struct idclass_event *ev;
+
+    if (!(gcfg->event_mask & (1 << type)))
+        return NULL;
+
+    ev = bpf_ringbuf_reserve(&events, sizeof(*ev), 0);
+    if (!ev) {
+        count_inc(IDCLASS_CNT_EV_DROP);
+        return NULL;
+    }
+    __builtin_memset(ev, 0, sizeof(*ev));
+    ev->type = type;
+    ev->ts_ns = bpf_ktime_get_ns();
+    return ev;
+}
+
+static __always_inline void event_submit(struct idclass_event *ev)
+{
+    count_inc(IDCLASS_CNT_EV_SENT);
+    bpf_ringbuf_submit(ev, 0);
+}
+
+static __always_inline void event_map_full(struct global_config *gcfg, __u32 map,
+                                           __u32 hash)
+{
+    struct idclass_event *ev = event_reserve(gcfg, IDCLASS_EV_MAP_FULL);
+
+    if (!ev)
+        return;
+    ev->map = map;
+    ev->hash = hash;
+    event_submit(ev);
+}
+
+/*
+ * 填入端口并将两端排序，使连接的两个方向得到同一个流键。
+ * 地址按字比较，任意但固定的全序即可，相同时再比较端口。
+ */
+static __always_inline void flow_key_finish(struct flow_key *key, struct __sk_buff *skb,
+                                            __u32 l4_offset, __u8 proto)
+{
+    __u32 tmp;
+    __be16 port;
+    __be16 *ports;
+    int swap, i;
+
+    key->proto = proto;
+    if (proto == IPPROTO_TCP || proto == IPPROTO_UDP) {
+        ports = skb_ptr(skb, l4_offset, 2 * sizeof(__be16));
+        if (ports) {
+            key->port[0] = ports[0];
+            key->port[1] = ports[1];
+        }
+    }
+
+    /* 从后往前，最后一次赋值来自第一个不同的字 */
+    swap = key->port[0] > key->port[1];
+    for (i = 3; i >= 0; i--)
+        if (key->addr[0][i] != key->addr[1][i])
+            swap = key->addr[0][i] > key->addr[1][i];
+    if (!swap)
+        return;
+
+    for (i = 0; i < 4; i++) {
+        tmp = key->addr[0][i];
+        key->addr[0][i] = key->addr[1][i];
+        key->addr[1][i] = tmp;
+    }
+    port = key->port[0];
+    key->port[0] = key->port[1];
+    key->port[1] = port;
+}
+
+/* 事件中标识流的 32 位值（FNV-1a，按字），只在发送事件时计算 */
+static __always_inline __u32 flow_key_hash(const struct flow_key *key)
+{
+    const __u32 *w = (const __u32 *)key;
+    __u32 h = 0x811c9dc5;
+    int i;
+
+    for (i = 0; i < sizeof(*key) / sizeof(__u32); i++)
+        h = (h ^ w[i]) * 0x01000193;
+    return h;
+}
+
+/* 当前一代中 slot 对应的流特征配置，一个包只查一次 */
+static __always_inline struct idclass_flow_config *
+get_flow_config(struct global_config *gcfg, __u8 slot)
+{
+    __u32 key = (gcfg->config_gen & 1) * IDCLASS_FLOW_CONFIG_SLOTS +
+                (slot & (IDCLASS_FLOW_CONFIG_SLOTS - 1));
+
+    return bpf_map_lookup_elem(&flow_config_map, &key);
+}
+
 static struct global_config *get_global_config(void)
 {
     __u32 key = 0;
@@ -191,7 +488,15 @@ parse_ipv4(struct global_config *config, struct skb_parser_info *info,
     parse_l4proto(config, info, ingress, out_val);
 
     void *key = ingress ? (void *)&iph->saddr : (void *)&iph->daddr;
-    return bpf_map_lookup_elem(&ipv4_map, key);
+    struct idclass_ip_map_val *val = bpf_map_lookup_elem(&ipv4_map, key);
+    if (val || !(config->prefix_maps & IDCLASS_PREFIX_IPV4))
+        return val;
+
+    struct idclass_lpm4_key lpm = {
+        .prefixlen = 32,
+        .addr = ingress ? iph->saddr : iph->daddr,
+    };
+    return bpf_map_lookup_elem(&ipv4_prefix_map, &lpm);
 }
 
 static __always_inline struct idclass_ip_map_val *
@@ -214,24 +519,373 @@ parse_ipv6(struct global_config *config, struct skb_parser_info *info,
     parse_l4proto(config, info, ingress, out_val);
 
     void *key = ingress ? (void *)&ip6h->saddr : (void *)&ip6h->daddr;
-    return bpf_map_lookup_elem(&ipv6_map, key);
+    struct idclass_ip_map_val *val = bpf_map_lookup_elem(&ipv6_map, key);
+    if (val || !(config->prefix_maps & IDCLASS_PREFIX_IPV6))
+        return val;
+
+    struct idclass_lpm6_key lpm = { .prefixlen = 128 };
+    __builtin_memcpy(lpm.addr, key, sizeof(lpm.addr));
+    return bpf_map_lookup_elem(&ipv6_prefix_map, &lpm);
+}
+
+/* 解析 TCP 时间戳选项，找到返回 0 */
+static __always_inline int tcp_parse_ts(struct tcphdr *tcph, void *data_end,
+                                        __u32 *tsval, __u32 *tsecr)
+{
+    __u8 *opt = (__u8 *)(tcph + 1);
+    __u32 optlen, off = 0;
+    int i;
+
+    if (tcph->doff <= 5)
+        return -1;
+    optlen = tcph->doff * 4 - sizeof(*tcph);
+
+    for (i = 0; i < TCP_MAX_OPTS && off + 2 <= optlen; i++) {
+        __u8 *p = opt + off;
+
+        if ((void *)(p + 2) > data_end)
+            return -1;
+        if (p[0] == TCP_OPT_EOL)
+            return -1;
+        if (p[0] == TCP_OPT_NOP) {
+            off++;
+            continue;
+        }
+        if (p[1] < 2)
+            return -1;
+        if (p[0] == TCP_OPT_TS && p[1] == TCP_OPT_TS_LEN) {
+            if (off + TCP_OPT_TS_LEN > optlen ||
+                (void *)(p + TCP_OPT_TS_LEN) > data_end)
+                return -1;
+            __builtin_memcpy(tsval, p + 2, 4);
+            __builtin_memcpy(tsecr, p + 6, 4);
+            *tsval = bpf_ntohl(*tsval);
+            *tsecr = bpf_ntohl(*tsecr);
+            return 0;
+        }
+        off += p[1];
+    }
+    return -1;
+}
+
+/*
+ * 一个 RTT 样本（seg 0：路由器到远端，1：路由器到本地主机）。流的 RTT
+ * 取两段之和，即本地主机看到的往返时间。
+ */
+static __always_inline void rtt_sample(struct flow_stats *stats, struct flow_rtt *rtt,
+                                       struct ip_key *client, __u8 seg,
+                                       __u32 sample_us, __u32 now_ms)
+{
+    struct client_rtt *c;
+    __u32 *avg;
+
+    if (!sample_us || sample_us > IDCLASS_RTT_MAX_US)
+        return;
+
+    avg = &rtt->rtt_us[seg];
+    *avg = *avg ? (*avg * 7 + sample_us) / 8 : sample_us;
+    stats->tcp_rtt_us = rtt->rtt_us[0] + rtt->rtt_us[1];
+
+    c = bpf_map_lookup_elem(&client_rtt_map, client);
+    if (!c) {
+        struct client_rtt new = {};
+
+        bpf_map_update_elem(&client_rtt_map, client, &new, BPF_NOEXIST);
+        c = bpf_map_lookup_elem(&client_rtt_map, client);
+        if (!c)
+            return;
+    }
+    avg = seg ? &c->lan_rtt_us : &c->rtt_us;
+    *avg = *avg ? (*avg * 7 + sample_us) / 8 : sample_us;
+    if (!seg && (!c->min_rtt_us || sample_us < c->min_rtt_us))
+        c->min_rtt_us = sample_us;
+    c->samples++;
+    c->last_ms = now_ms;
+}
+
+/*
+ * 被动 RTT 测量（与 pping 相同的思路）：握手阶段用 SYN 到对端确认的时间，
+ * 建立后用 TSval 到对端在 TSecr 中回显它的时间。两个方向的报文分别由
+ * egress 和 ingress 程序处理，待匹配的值放在两者共享的 flow_rtt_map 中。
+ */
+static __always_inline void tcp_rtt_update(struct flow_stats *stats, struct flow_key *key,
+                                           struct ip_key *client, struct tcphdr *tcph,
+                                           struct __sk_buff *skb, __u8 dir,
+                                           __u32 now_us, __u32 now_ms)
+{
+    __u8 tcp_flags = ((__u8 *)tcph)[13];
+    struct flow_rtt *rtt;
+    __u32 tsval = 0, tsecr = 0;
+    int has_ts, i;
+
+    has_ts = !tcp_parse_ts(tcph, (void *)(long)skb->data_end, &tsval, &tsecr);
+    /* 没有时间戳选项的流只在握手的几个包中查表 */
+    if (!has_ts && !(tcp_flags & TCP_FLAG_SYN) && stats->packets > 4)
+        return;
+
+    rtt = bpf_map_lookup_elem(&flow_rtt_map, key);
+    if (!rtt) {
+        struct flow_rtt new = {};
+
+        if (!has_ts && !(tcp_flags & TCP_FLAG_SYN))
+            return;
+        bpf_map_update_elem(&flow_rtt_map, key, &new, BPF_NOEXIST);
+        rtt = bpf_map_lookup_elem(&flow_rtt_map, key);
+        if (!rtt)
+            return;
+    }
+
+    /* 握手：SYN（或 SYN-ACK）被对端确认 */
+    if (tcp_flags & TCP_FLAG_SYN) {
+        rtt->syn_seq[dir] = bpf_ntohl(tcph->seq);
+        rtt->syn_us[dir] = now_us | 1;
+    }
+    if ((tcp_flags & TCP_FLAG_ACK) && rtt->syn_us[!dir] &&
+        bpf_ntohl(tcph->ack_seq) == rtt->syn_seq[!dir] + 1) {
+        rtt_sample(stats, rtt, client, !dir, now_us - rtt->syn_us[!dir], now_ms);
+        rtt->syn_us[!dir] = 0;
+    }
+
+    if (!has_ts)
+        return;
+
+    /* 对端回显了反方向等待中的 TSval，每个 TSval 只产生一个样本 */
+    if (tsecr) {
+        for (i = 0; i < IDCLASS_RTT_SLOTS; i++) {
+            struct idclass_rtt_slot *slot = &rtt->pending[!dir][i];
+
+            if (slot->sent_us && slot->tsval == tsecr) {
+                rtt_sample(stats, rtt, client, !dir, now_us - slot->sent_us, now_ms);
+                slot->sent_us = 0;
+                break;
+            }
+        }
+    }
+
+    /* 新的 TSval 放入空闲或已作废的槽位，没有则不记录 */
+    if (tsval != rtt->last_tsval[dir]) {
+        rtt->last_tsval[dir] = tsval;
+        for (i = 0; i < IDCLASS_RTT_SLOTS; i++) {
+            struct idclass_rtt_slot *slot = &rtt->pending[dir][i];
+
+            if (!slot->sent_us || now_us - slot->sent_us > IDCLASS_RTT_MAX_US) {
+                slot->tsval = tsval;
+                slot->sent_us = now_us | 1;
+                break;
+            }
+        }
+    }
+}
+
+/* 序号算术（RFC 1982）：a 在 b 之前 */
+static __always_inline int seq_before(__u32 a, __u32 b)
+{
+    return (__s32)(a - b) < 0;
+}
+
+/*
+ * 按序号把一个占用序号的段分为新数据、重传或乱序（见 struct tcp_seq_state），
+ * 纯 ACK 不参与。两个方向的段分别由 egress 和 ingress 程序处理。
+ */
+static __always_inline void tcp_seq_update(struct flow_stats *stats, struct tcphdr *tcph,
+                                           __u32 tcp_len, __u32 ifindex, __u8 dir,
+                                           __u32 now_us)
+{
+    struct tcp_seq_state *st = &stats->seq[dir & 1];
+    __u8 tcp_flags = ((__u8 *)tcph)[13];
+    __u32 hdr_len = tcph->doff * 4;
+    struct idclass_wan_loss *loss;
+    __u8 retrans = 0, reorder = 0, wan_lost = 0;
+    __u32 seq, end, len;
+
+    if (tcp_flags & TCP_FLAG_RST)
+        return;
+    /* tcp_len 由 IP 头长度算出，畸形报文可能下溢 */
+    len = tcp_len > hdr_len && tcp_len <= 0xffff ? tcp_len - hdr_len : 0;
+    /* SYN、FIN 各占一个序号 */
+    if (tcp_flags & TCP_FLAG_SYN)
+        len++;
+    if (tcp_flags & TCP_FLAG_FIN)
+        len++;
+    if (!len)
+        return;
+
+    seq = bpf_ntohl(tcph->seq);
+    end = seq + len;
+    STAT_ADD(stats->data_segs, 1);
+
+    if (!st->seq_next) {
+        st->seq_next = end;
+    } else if (seq_before(st->seq_next, end)) {
+        /* 含新数据；起点越过 seq_next 说明中间缺了一段 */
+        if (seq_before(st->seq_next, seq)) {
+            st->hole_lo = st->seq_next;
+            st->hole_hi = seq;
+            st->hole_us = now_us;
+        }
+        st->seq_next = end;
+    } else if (st->hole_us && !seq_before(seq, st->hole_lo) && seq_before(seq, st->hole_hi)) {
+        /*
+         * 补上空洞：在重排窗口内到达的是走了别的路径的原始段，否则是发送端
+         * 补发的。ingress 方向的空洞说明段在到达路由器之前（WAN 一侧）丢失。
+         */
+        __u32 window = stats->tcp_rtt_us ? stats->tcp_rtt_us / 2 : IDCLASS_REORDER_US;
+
+        if (now_us - st->hole_us < window) {
+            reorder = 1;
+        } else {
+            retrans = 1;
+            wan_lost = dir;
+        }
+        if (seq == st->hole_lo)
+            st->hole_lo = end;
+        if (!seq_before(st->hole_lo, st->hole_hi))
+            st->hole_us = 0;
+    } else {
+        /*
+         * 整段早已经过路由器，是重传（或伪重传）。egress 方向说明段在
+         * 路由器之后（WAN 一侧）丢失，ingress 方向则丢在 LAN 一侧。
+         */
+        retrans = 1;
+        wan_lost = !dir;
+    }
+
+    if (retrans)
+        STAT_ADD(stats->retrans_count, 1);
+    if (reorder)
+        STAT_ADD(stats->reorder_count, 1);
+
+    loss = bpf_map_lookup_elem(&wan_loss_map, &ifindex);
+    if (!loss) {
+        struct idclass_wan_loss new = {};
+
+        bpf_map_update_elem(&wan_loss_map, &ifindex, &new, BPF_NOEXIST);
+        loss = bpf_map_lookup_elem(&wan_loss_map, &ifindex);
+        if (!loss)
+            return;
+    }
+    dir &= 1;
+    loss->segs[dir]++;
+    loss->retrans[dir] += retrans;
+    loss->reorder[dir] += reorder;
+    loss->wan_lost[dir] += wan_lost;
+}
+
+/* 向下取整的 log2，只用比较和移位；v 为 0 时返回 0 */
+static __always_inline __u32 log2_u32(__u32 v)
+{
+    __u32 r, s;
+
+    r = (v > 0xffff) << 4;
+    v >>= r;
+    s = (v > 0xff) << 3;
+    v >>= s;
+    r |= s;
+    s = (v > 0xf) << 2;
+    v >>= s;
+    r |= s;
+    s = (v > 0x3) << 1;
+    v >>= s;
+    r |= s;
+    return r | (v >> 1);
+}
+
+/* 直方图每格右移 n 位：按 64 位字整体移位，再屏蔽从相邻格移入的位 */
+static __always_inline void hist_shift(__u8 *hist, __u32 n)
+{
+    __u64 *w = (__u64 *)hist;
+    __u64 mask;
+
+    if (n > 7) {
+        w[0] = w[1] = 0;
+        return;
+    }
+    mask = 0xff >> n;
+    mask |= mask << 8;
+    mask |= mask << 16;
+    mask |= mask << 32;
+    w[0] = (w[0] >> n) & mask;
+    w[1] = (w[1] >> n) & mask;
+}
+
+static __always_inline void hist_add(__u8 *hist, __u32 bin)
+{
+    if (bin >= IDCLASS_HIST_BINS)
+        bin = IDCLASS_HIST_BINS - 1;
+    if (hist[bin] == 0xff)
+        hist_shift(hist, 1);
+    hist[bin]++;
+}
+
+/*
+ * 衰减 struct flow_stats 中标 [W] 的计数器：跨过几个周期就右移几位。
+ * 每包只比较一次周期号，不做除法。
+ */
+static __always_inline void flow_window_decay(struct flow_stats *stats, __u32 now_ms,
+                                              __u8 shift)
+{
+    __u32 epoch = now_ms >> shift;
+    __u32 n = epoch - stats->win_epoch;
+
+    if (!n)
+        return;
+    stats->win_epoch = epoch;
+    if (n > 31)
+        n = 31;
+
+    stats->win_packets >>= n;
+    stats->up_bytes >>= n;
+    stats->down_bytes >>= n;
+    stats->syn_count >>= n;
+    stats->ack_count >>= n;
+    stats->fin_count >>= n;
+    stats->rst_count >>= n;
+    stats->data_segs >>= n;
+    stats->retrans_count >>= n;
+    stats->reorder_count >>= n;
+    if (FEATURE_ON(FEATURE_HIST)) {
+        hist_shift(stats->len_hist, n);
+        hist_shift(stats->iat_hist, n);
+    }
 }
 
 static __always_inline void update_flow_stats(struct flow_stats *stats,
+                          struct flow_key *key,
+                          struct ip_key *client,
                           __u32 pkt_len,
                           __u64 ts_ns,
                           __u8 direction,
+                          __u8 window_shift,
                           struct idclass_flow_config *cfg,
                           struct tcphdr *tcph,
+                          __u32 tcp_len,
                           struct __sk_buff *skb)
 {
     __u64 prev_ts = stats->last_seen;
+    __u32 now_ms = ts_ns / 1000000ULL;
+    __u32 old_packets = stats->packets;
+    __u32 old_bytes = stats->bytes;
 
-    __sync_fetch_and_add(&stats->packets, 1);
-    __sync_fetch_and_add(&stats->bytes, pkt_len);
+    if (window_shift)
+        flow_window_decay(stats, now_ms, window_shift);
+
+    STAT_ADD(stats->packets, 1);
+    STAT_ADD(stats->win_packets, 1);
+    STAT_ADD(stats->bytes, pkt_len);
     stats->last_seen = ts_ns;
 
-    if (prev_ts != 0) {
+    /* 低 32 位回绕时（极少发生）进位到冷数据 */
+    if (old_packets == 0xffffffff || old_bytes + pkt_len < old_bytes) {
+        struct flow_info *info = bpf_map_lookup_elem(&flow_info_map, key);
+        if (info) {
+            if (old_packets == 0xffffffff)
+                __sync_fetch_and_add(&info->packets_hi, 1);
+            if (old_bytes + pkt_len < old_bytes)
+                __sync_fetch_and_add(&info->bytes_hi, 1);
+        }
+    }
+
+    if (FEATURE_ON(FEATURE_IAT) && prev_ts != 0) {
         __u64 iat_ns = ts_ns - prev_ts;
         __u32 iat_us = iat_ns / 1000ULL;
         // 使用 EWMA 平滑 IAT
@@ -241,80 +895,86 @@ static __always_inline void update_flow_stats(struct flow_stats *stats,
             stats->iat_us = (stats->iat_us * 7 + iat_us) / 8;
     }
 
-    ewma(&stats->avg_pkt_len, pkt_len);
+    if (FEATURE_ON(FEATURE_PKTLEN))
+        ewma(&stats->avg_pkt_len, pkt_len);
 
-    /* 修复：方向：1 = ingress（下行），0 = egress（上行） */
-    if (direction == 1)
-        __sync_fetch_and_add(&stats->down_bytes, pkt_len);
-    else
-        __sync_fetch_and_add(&stats->up_bytes, pkt_len);
+    if (FEATURE_ON(FEATURE_HIST)) {
+        hist_add(stats->len_hist, log2_u32(pkt_len));
+        if (prev_ts != 0) {
+            __u64 iat = (ts_ns - prev_ts) >> IDCLASS_HIST_IAT_SHIFT;
+            hist_add(stats->iat_hist, log2_u32(iat > 0xffffffff ? 0xffffffff : iat));
+        }
+    }
+
+    if (FEATURE_ON(FEATURE_RATIO)) {
+        /* 修复：方向：1 = ingress（下行），0 = egress（上行） */
+        if (direction == 1)
+            STAT_ADD(stats->down_bytes, pkt_len);
+        else
+            STAT_ADD(stats->up_bytes, pkt_len);
 
-    if (cfg && cfg->bulk_trigger_pps) {
-        __u64 now_ns = ts_ns;
-        if (stats->last_pps_ts == 0) {
-            stats->last_pps_ts = now_ns;
+        /* 上下行字节只用于求比例，接近溢出时同时减半 */
+        if ((stats->up_bytes | stats->down_bytes) & 0x80000000) {
+            stats->up_bytes >>= 1;
+            stats->down_bytes >>= 1;
+        }
+    }
+
+    if (FEATURE_ON(FEATURE_PPS) && cfg && cfg->bulk_trigger_pps) {
+        if (stats->pps_window_ms == 0) {
+            stats->pps_window_ms = now_ms;
             stats->packets_in_window = 1;
         } else {
-            __u64 elapsed_ns = now_ns - stats->last_pps_ts;
-            if (elapsed_ns >= 1000000000ULL) {
-                stats->pps = (stats->packets_in_window * 1000000000ULL) / elapsed_ns;
-                stats->last_pps_ts = now_ns;
+            __u32 elapsed_ms = now_ms - stats->pps_window_ms;
+            if (elapsed_ms >= 1000) {
+                stats->pps = (stats->packets_in_window * 1000ULL) / elapsed_ms;
+                stats->pps_window_ms = now_ms;
                 stats->packets_in_window = 1;
             } else {
-                __sync_fetch_and_add(&stats->packets_in_window, 1);
+                STAT_ADD(stats->packets_in_window, 1);
             }
         }
     }
 
-    if (cfg && cfg->burst_window_ms) {
-        __u64 now_ms_val = bpf_ktime_get_ns() / 1000000ULL;
-        if (stats->burst_start_ts == 0) {
-            stats->burst_start_ts = now_ms_val;
+    if (FEATURE_ON(FEATURE_BURST) && cfg && cfg->burst_window_ms) {
+        if (stats->burst_start_ms == 0) {
+            stats->burst_start_ms = now_ms;
             stats->burst_packets = 1;
             stats->burst_bytes = pkt_len;
         } else {
-            __u64 elapsed_ms = now_ms_val - stats->burst_start_ts;
+            __u32 elapsed_ms = now_ms - stats->burst_start_ms;
             if (elapsed_ms <= cfg->burst_window_ms) {
-                __sync_fetch_and_add(&stats->burst_packets, 1);
-                __sync_fetch_and_add(&stats->burst_bytes, pkt_len);
+                STAT_ADD(stats->burst_packets, 1);
+                STAT_ADD(stats->burst_bytes, pkt_len);
             } else {
-                stats->burst_start_ts = now_ms_val;
+                stats->burst_start_ms = now_ms;
                 stats->burst_packets = 1;
                 stats->burst_bytes = pkt_len;
             }
         }
     }
 
-    if (tcph) {
+    if (tcph && FEATURE_ON(FEATURE_TCP_ALL)) {
         __u8 tcp_flags = ((__u8 *)tcph)[13];
-        if (tcp_flags & 0x02)
-            __sync_fetch_and_add(&stats->syn_count, 1);
-        if (tcp_flags & 0x10)
-            __sync_fetch_and_add(&stats->ack_count, 1);
-        if (tcp_flags & 0x01)
-            __sync_fetch_and_add(&stats->fin_count, 1);
-        if (tcp_flags & 0x04)
-            __sync_fetch_and_add(&stats->rst_count, 1);
-
-        __u32 seq = bpf_ntohl(tcph->seq);
-        __u64 old_max = stats->max_seq;
-        __u64 now_ns = bpf_ktime_get_ns();
-
-        if (seq > old_max) {
-            __sync_lock_test_and_set(&stats->max_seq, (__u64)seq);
-        } else if (seq < old_max) {
-            __u64 last_pkt = stats->last_pkt_ts;
-            if (last_pkt != 0 && (now_ns - last_pkt) < 200000000) {
-                __sync_fetch_and_add(&stats->retrans_count, 1);
-            }
+        __u32 now_us = ts_ns / 1000ULL;
+
+        if (FEATURE_ON(FEATURE_TCPFLAGS)) {
+            if (tcp_flags & 0x02)
+                STAT_ADD(stats->syn_count, 1);
+            if (tcp_flags & 0x10)
+                STAT_ADD(stats->ack_count, 1);
+            if (tcp_flags & 0x01)
+                STAT_ADD(stats->fin_count, 1);
+            if (tcp_flags & 0x04)
+                STAT_ADD(stats->rst_count, 1);
         }
 
-        __sync_lock_test_and_set(&stats->tcp_seq, (__u64)seq);
-        stats->last_pkt_ts = now_ns;
+        if (FEATURE_ON(FEATURE_RETRANS))
+            tcp_seq_update(stats, tcph, tcp_len, skb->ifindex, direction, now_us);
 
         /* TCP 窗口（接收窗口） */
         __u16 window = bpf_ntohs(tcph->window);
-        if (window > 0) {
+        if (FEATURE_ON(FEATURE_TCP_WINDOW) && window > 0) {
             if (stats->tcp_window == 0)
                 stats->tcp_window = window;
             else
@@ -322,7 +982,7 @@ static __always_inline void update_flow_stats(struct flow_stats *stats,
         }
 
         /* MSS 提取（仅在 SYN 包中解析 TCP 选项） */
-        if (tcp_flags & 0x02) { // SYN
+        if (FEATURE_ON(FEATURE_TCP_MSS) && (tcp_flags & 0x02)) { // SYN
             __u32 offset = sizeof(struct tcphdr);
             __u8 *opts = (__u8 *)tcph + offset;
             __u8 *end = (__u8 *)(long)skb->data_end;
@@ -341,44 +1001,37 @@ static __always_inline void update_flow_stats(struct flow_stats *stats,
             }
         }
 
-        /* RTT 估算：使用 ACK 与上一数据包的时间差，简化但不精确 */
-        if (tcp_flags & 0x10) { // ACK
-            if (stats->last_pkt_ts != 0) {
-                __u64 rtt_ns = now_ns - stats->last_pkt_ts;
-                __u32 rtt_us = rtt_ns / 1000;
-                if (stats->tcp_rtt_us == 0)
-                    stats->tcp_rtt_us = rtt_us;
-                else
-                    stats->tcp_rtt_us = (stats->tcp_rtt_us * 7 + rtt_us) / 8;
-            }
-        }
+        if (FEATURE_ON(FEATURE_TCP_RTT))
+            tcp_rtt_update(stats, key, client, tcph, skb, direction, now_us, now_ms);
     }
 }
 
 static __always_inline __u32 classify_score(struct flow_stats *stats,
-                                           struct idclass_flow_config *cfg)
+                                           struct ip_key *client,
+                                           struct idclass_flow_config *cfg,
+                                           __u32 *scores)
 {
     __u32 score_realtime = 0, score_video = 0, score_normal = 0, score_bulk = 0;
     __u32 packets = stats->packets;
+    __u32 avg_pkt_len = stats->avg_pkt_len >> EWMA_SHIFT;
     __u32 *conn = NULL;
-    __u32 mask = cfg->feature_mask;
+    /* 与加载时特征集合求交，未加载的特征分支在校验时即被删除 */
+    __u32 mask = cfg->feature_mask & module_features;
 
     if ((mask & FEATURE_PKTLEN) && packets >= cfg->game_sample_packets) {
-        if (stats->avg_pkt_len <= cfg->game_max_avg_pkt_len)
+        if (avg_pkt_len <= cfg->game_max_avg_pkt_len)
             score_realtime += cfg->weight_pktlen_realtime;
-        else if (stats->avg_pkt_len >= cfg->video_min_avg_pkt_len &&
-                 stats->avg_pkt_len <= cfg->video_max_avg_pkt_len)
+        else if (avg_pkt_len >= cfg->video_min_avg_pkt_len &&
+                 avg_pkt_len <= cfg->video_max_avg_pkt_len)
             score_video += cfg->weight_pktlen_video;
-        else if (stats->avg_pkt_len >= cfg->bulk_min_avg_pkt_len)
+        else if (avg_pkt_len >= cfg->bulk_min_avg_pkt_len)
             score_bulk += cfg->weight_pktlen_bulk;
         else
             score_normal += cfg->weight_pktlen_normal;
     }
 
     if (mask & FEATURE_CONN) {
-        struct ip_key key;
-        __builtin_memcpy(key.addr, stats->client_ip, 16);
-        conn = bpf_map_lookup_elem(&ip_conn_map, &key);
+        conn = bpf_map_lookup_elem(&ip_conn_map, client);
         if (conn) {
             if (*conn <= cfg->game_max_conn)
                 score_realtime += cfg->weight_conn_realtime;
@@ -406,33 +1059,38 @@ static __always_inline __u32 classify_score(struct flow_stats *stats,
         (stats->burst_packets > cfg->burst_packets || stats->burst_bytes > cfg->burst_bytes))
         score_bulk += cfg->weight_burst_bulk;
 
-    if ((mask & FEATURE_TCPFLAGS) && packets >= cfg->tcp_flags_window) {
+    /* 标志比例用衰减后的计数，反映最近的行为 */
+    if ((mask & FEATURE_TCPFLAGS) && stats->win_packets >= cfg->tcp_flags_window) {
         if (stats->ack_count > 0) {
             // 高 SYN 比例视为 bulk（可能为扫描或异常），实际可根据经验调整
             if (stats->syn_count * 100 > stats->ack_count * cfg->tcp_flags_syn_ack_ratio)
                 score_bulk += cfg->weight_tcpflags_bulk;
         }
-        if (stats->rst_count > packets / 10)
+        if (stats->rst_count * 10 > stats->win_packets)
             score_bulk += cfg->weight_tcpflags_bulk;
     }
 
-    if ((mask & FEATURE_RETRANS) && packets >= 10) {
-        if (stats->retrans_count * 100 > packets * cfg->retrans_threshold)
+    /* 重传率按带负载的段计算，乱序不计入 */
+    if ((mask & FEATURE_RETRANS) && stats->data_segs >= 10) {
+        if (stats->retrans_count * 100 > stats->data_segs * cfg->retrans_threshold)
             score_bulk += cfg->weight_retrans_bulk;
     }
 
     if ((mask & FEATURE_DURATION) && packets >= cfg->game_sample_packets) {
-        __u64 duration = (stats->last_seen - stats->first_seen) / 1000000000ULL;
+        __u32 duration = ((__u32)(stats->last_seen / 1000000ULL) - stats->first_seen_ms) / 1000;
         if (duration < cfg->conn_duration_short)
             score_realtime += cfg->weight_duration_realtime;
-        else if (duration > cfg->conn_duration_long)
-            score_bulk += cfg->weight_duration_bulk;
+        else if (duration > cfg->conn_duration_long) {
+            /* 长时间运行的小包流（游戏、VoIP）不因时长被判为 bulk */
+            if (avg_pkt_len >= cfg->video_min_avg_pkt_len)
+                score_bulk += cfg->weight_duration_bulk;
+        }
         else
             score_video += cfg->weight_duration_video;
     }
 
     if ((mask & FEATURE_RATIO) && stats->down_bytes > 0) {
-        __u32 ratio = (stats->up_bytes * 100) / stats->down_bytes;
+        __u32 ratio = ((__u64)stats->up_bytes * 100) / stats->down_bytes;
         if (ratio < cfg->up_down_ratio_low)
             score_video += cfg->weight_ratio_video;
         else if (ratio > cfg->up_down_ratio_high)
@@ -444,6 +1102,40 @@ static __always_inline __u32 classify_score(struct flow_stats *stats,
     if ((mask & FEATURE_IAT) && stats->iat_us > 0 && stats->iat_us < cfg->iat_threshold_us)
         score_realtime += cfg->weight_iat_realtime;
 
+    if ((mask & FEATURE_HIST) && packets >= cfg->game_sample_packets) {
+        __u32 total = 0, small = 0, large = 0, peak = 0, peak_bin = 0, i;
+
+        /* 大包、小包都多（满长数据包加 ACK）：视频/下载，均值会落在 normal 区间 */
+        for (i = 0; i < IDCLASS_HIST_BINS; i++) {
+            __u32 v = stats->len_hist[i];
+
+            total += v;
+            if (i < IDCLASS_HIST_SMALL_BIN)
+                small += v;
+            else if (i >= IDCLASS_HIST_LARGE_BIN)
+                large += v;
+        }
+        if (total && small * 100 >= total * cfg->hist_bimodal_pct &&
+            large * 100 >= total * cfg->hist_bimodal_pct)
+            score_video += cfg->weight_hist_video;
+
+        /* 包间隔集中在相邻两格（固定周期发包，如游戏 tick、VoIP 帧） */
+        total = 0;
+        for (i = 0; i < IDCLASS_HIST_BINS - 1; i++) {
+            __u32 pair = stats->iat_hist[i] + stats->iat_hist[i + 1];
+
+            total += stats->iat_hist[i];
+            if (pair > peak) {
+                peak = pair;
+                peak_bin = i;
+            }
+        }
+        total += stats->iat_hist[IDCLASS_HIST_BINS - 1];
+        if (total && peak * 100 >= total * cfg->hist_periodic_pct &&
+            peak_bin >= IDCLASS_HIST_PERIODIC_MIN && peak_bin <= IDCLASS_HIST_PERIODIC_MAX)
+            score_realtime += cfg->weight_hist_realtime;
+    }
+
     if ((mask & FEATURE_TCP_WINDOW) && stats->tcp_window > 0) {
         if (stats->tcp_window <= cfg->tcp_window_low)
             score_realtime += cfg->weight_window_realtime;
@@ -491,9 +1183,122 @@ static __always_inline __u32 classify_score(struct flow_stats *stats,
         max_score = score_bulk;
         selected = 3;
     }
+
+    /* 得分明细，供分类变化事件使用 */
+    scores[0] = score_realtime;
+    scores[1] = score_video;
+    scores[2] = score_normal;
+    scores[3] = score_bulk;
     return selected;
 }
 
+/* 逻辑优先级 → class_id → 最终 mark/DSCP 值 */
+static __always_inline int prio_to_mark(__u32 prio_level, __u8 ingress, __u32 *mark)
+{
+    __u32 *class_id_ptr, *val;
+
+    if (ingress)
+        class_id_ptr = bpf_map_lookup_elem(&prio_class_up, &prio_level);
+    else
+        class_id_ptr = bpf_map_lookup_elem(&prio_class_down, &prio_level);
+    if (!class_id_ptr)
+        return 0;
+
+    val = bpf_map_lookup_elem(&class_mark, class_id_ptr);
+    if (!val)
+        return 0;
+
+    *mark = *val;
+    return 1;
+}
+
+/* 缓存的判定是否仍可使用（rescore_ms/rescore_pkt_mask 为 0 时每包评分） */
+static __always_inline int verdict_fresh(struct flow_stats *stats, __u8 ingress,
+                                         struct global_config *gcfg, __u32 now_ms)
+{
+    __u8 want = ingress ? IDCLASS_VERDICT_INGRESS : IDCLASS_VERDICT_EGRESS;
+
+    /* 流键对两个方向相同，两个方向的 mark 分别缓存 */
+    if (!(stats->verdict_flags & want))
+        return 0;
+    if (!(stats->packets & gcfg->rescore_pkt_mask))
+        return 0;
+    return now_ms - stats->verdict_ms < gcfg->rescore_ms;
+}
+
+/* 把其他 CPU 的一个分片并入合并记录，平滑值取包数最多的分片 */
+static __always_inline void flow_stats_fold(struct flow_stats *m, struct flow_stats *s,
+                                            __u32 *best_packets)
+{
+    int i;
+
+    m->bytes += s->bytes;
+    m->win_packets += s->win_packets;
+    m->up_bytes += s->up_bytes;
+    m->down_bytes += s->down_bytes;
+    m->pps += s->pps;
+    m->burst_packets += s->burst_packets;
+    m->burst_bytes += s->burst_bytes;
+    m->syn_count += s->syn_count;
+    m->ack_count += s->ack_count;
+    m->fin_count += s->fin_count;
+    m->rst_count += s->rst_count;
+    m->data_segs += s->data_segs;
+    m->retrans_count += s->retrans_count;
+    m->reorder_count += s->reorder_count;
+    /* 直方图只看形状，相加后饱和到 8 位 */
+    for (i = 0; i < IDCLASS_HIST_BINS; i++) {
+        __u32 len = m->len_hist[i] + s->len_hist[i];
+        __u32 iat = m->iat_hist[i] + s->iat_hist[i];
+
+        m->len_hist[i] = len > 0xff ? 0xff : len;
+        m->iat_hist[i] = iat > 0xff ? 0xff : iat;
+    }
+    if ((__s32)(s->first_seen_ms - m->first_seen_ms) < 0)
+        m->first_seen_ms = s->first_seen_ms;
+    if (s->last_seen > m->last_seen)
+        m->last_seen = s->last_seen;
+
+    if (s->packets > *best_packets) {
+        *best_packets = s->packets;
+        m->avg_pkt_len = s->avg_pkt_len;
+        m->iat_us = s->iat_us;
+        m->tcp_window = s->tcp_window;
+        m->tcp_mss = s->tcp_mss;
+        m->tcp_rtt_us = s->tcp_rtt_us;
+    }
+    m->packets += s->packets;
+}
+
+/*
+ * 每 CPU 模式的评分输入：本 CPU 的分片加上其他 CPU 的分片。只在重新
+ * 评分时调用，每包路径只读写本 CPU 的分片。临时空间不可用时退回本分片。
+ */
+static __always_inline struct flow_stats *flow_stats_merged(struct flow_key *key,
+                                                            struct flow_stats *own)
+{
+    __u32 cpu = bpf_get_smp_processor_id();
+    __u32 zero = 0, best_packets = own->packets, i;
+    struct flow_stats *m;
+
+    m = bpf_map_lookup_elem(&flow_stats_scratch, &zero);
+    if (!m)
+        return own;
+
+    __builtin_memcpy(m, own, sizeof(*m));
+    for (i = 0; i < PERCPU_MAX_CPUS && i < nr_cpus; i++) {
+        struct flow_stats *s;
+
+        if (i == cpu)
+            continue;
+        s = bpf_map_lookup_percpu_elem(&flow_stats_percpu, key, i);
+        if (!s || !s->first_seen_ms)
+            continue;
+        flow_stats_fold(m, s, &best_packets);
+    }
+    return m;
+}
+
 static __always_inline void ipv4_set_dscp(struct __sk_buff *skb, __u32 offset, __u8 dscp)
 {
     struct iphdr *iph;
@@ -529,26 +1334,226 @@ static __always_inline void ipv6_set_dscp(struct __sk_buff *skb, __u32 offset, _
     ip6h->priority = (old & 0x03) | (dscp << 2);
 }
 
-SEC("classifier")
-int classify(struct __sk_buff *skb)
+#define DNS_HDR_LEN     12
+#define DNS_FLAG_QR     0x8000
+#define DNS_FLAG_OPCODE 0x7800
+#define DNS_FLAG_RCODE  0x000f
+#define DNS_TYPE_A      1
+#define DNS_TYPE_AAAA   28
+
+/*
+ * 查询名匹配 dns_names 中的规则，返回 seq 最小者的 DSCP。未命中，或该规则
+ * 可能被用户态规则抢先时返回 0xff
+ */
+static __always_inline __u8 dns_match_qname(struct idclass_dns_event *ev, __u32 *name_end)
+{
+    struct idclass_dns_key key = {};
+    __u32 starts[IDCLASS_DNS_MAX_LABELS] = {};
+    __u32 off = DNS_HDR_LEN, pos, h = IDCLASS_DNS_HASH_INIT;
+    __u32 best_seq = ~0U;
+    __u8 dscp = 0xff, flags = 0;
+    int i, j, n;
+
+    /* 第一遍：记录每个标签的起始位置 */
+    for (n = 0; n < IDCLASS_DNS_MAX_LABELS; n++) {
+        if (off >= ev->len || off >= IDCLASS_DNS_MAX_LEN)
+            return 0xff;
+        __u8 l = ev->data[off];
+        if (!l)
+            break;
+        if (l & 0xc0)       /* 问题部分不应出现压缩指针 */
+            return 0xff;
+        starts[n] = off;
+        off += l + 1;
+    }
+    if (!n || n == IDCLASS_DNS_MAX_LABELS || off - DNS_HDR_LEN > IDCLASS_DNS_NAME_MAX)
+        return 0xff;
+    *name_end = off;
+
+    /* 第二遍：从右向左计算 hash，每到一个标签起点查一次该后缀 */
+    pos = off;
+    for (i = n - 1; i >= 0; i--) {
+        __u32 start = starts[i & (IDCLASS_DNS_MAX_LABELS - 1)];
+
+        for (j = 0; j < 64; j++) {
+            if (pos <= start)
+                break;
+            pos--;
+            if (pos >= IDCLASS_DNS_MAX_LEN)
+                return 0xff;
+            __u8 c = ev->data[pos];
+            if (c >= 'A' && c <= 'Z')
+                c |= 0x20;
+            h = IDCLASS_DNS_HASH_STEP(h, c);
+        }
+
+        key.hash = h;
+        key.wildcard = i > 0;
+        struct idclass_dns_val *val = bpf_map_lookup_elem(&dns_names, &key);
+        if (val && val->seq < best_seq) {
+            best_seq = val->seq;
+            dscp = val->dscp;
+            flags = val->flags;
+        }
+    }
+
+    if (flags & IDCLASS_DNS_VAL_SHADOWED)
+        return 0xff;
+    return dscp;
+}
+
+/* 把应答中的 A/AAAA 地址预先写入 ipv4_map/ipv6_map（不覆盖已有条目） */
+static __always_inline void dns_premark(struct idclass_dns_event *ev, __u32 off,
+                                        __u16 answers, __u8 dscp)
+{
+    struct idclass_ip_map_val val = { .dscp = dscp };
+    int i;
+
+    /* 跳过根标签和 qtype/qclass */
+    off += 5;
+    for (i = 0; i < IDCLASS_DNS_MAX_ANSWERS && i < answers; i++) {
+        __u16 type, rdlen;
+
+        /* 压缩指针(2) + type(2) + class(2) + ttl(4) + rdlength(2) */
+        if (off + 12 > ev->len || off > IDCLASS_DNS_MAX_LEN - 12)
+            return;
+        if ((ev->data[off] & 0xc0) != 0xc0)
+            return;
+        type = (ev->data[off + 2] << 8) | ev->data[off + 3];
+        rdlen = (ev->data[off + 10] << 8) | ev->data[off + 11];
+        off += 12;
+
+        if (off + rdlen > ev->len || off > IDCLASS_DNS_MAX_LEN - 16)
+            return;
+        if (type == DNS_TYPE_A && rdlen == 4) {
+            __u32 addr;
+            __builtin_memcpy(&addr, &ev->data[off], sizeof(addr));
+            if (!bpf_map_update_elem(&ipv4_map, &addr, &val, BPF_NOEXIST))
+                count_inc(IDCLASS_CNT_DNS_PREMARK);
+        } else if (type == DNS_TYPE_AAAA && rdlen == 16) {
+            struct in6_addr addr;
+            __builtin_memcpy(&addr, &ev->data[off], sizeof(addr));
+            if (!bpf_map_update_elem(&ipv6_map, &addr, &val, BPF_NOEXIST))
+                count_inc(IDCLASS_CNT_DNS_PREMARK);
+        }
+        off += rdlen;
+    }
+}
+
+/*
+ * 上游 DNS 应答：只把 DNS 载荷复制进 ring buffer 交给用户态解析。
+ * 只有载荷成功交给用户态时才预先标记，这样每个内核写入的地址都有对应的
+ * 用户态条目负责超时回收。
+ */
+static __noinline int dns_capture(struct __sk_buff *skb, __u32 offset, __u32 proto)
+{
+    struct idclass_dns_event *ev;
+    __u16 hdr[DNS_HDR_LEN / 2];
+    __u32 name_end = 0;
+    __u64 flags = BPF_RB_FORCE_WAKEUP;
+    __u32 len;
+    __u8 dscp;
+
+    if (proto == IPPROTO_TCP) {
+        struct tcphdr tcp;
+        __u16 msg_len;
+
+        if (bpf_skb_load_bytes(skb, offset, &tcp, sizeof(tcp)) ||
+            tcp.source != bpf_htons(53) || tcp.doff < 5)
+            return 0;
+        /* TCP 上的 DNS 消息前有 2 字节长度 */
+        offset += tcp.doff * 4;
+        if (bpf_skb_load_bytes(skb, offset, &msg_len, sizeof(msg_len)))
+            return 0;
+        offset += sizeof(msg_len);
+        len = bpf_ntohs(msg_len);
+        if (offset + len > skb->len)
+            return 0;
+    } else {
+        struct udphdr udp;
+
+        if (bpf_skb_load_bytes(skb, offset, &udp, sizeof(udp)) ||
+            udp.source != bpf_htons(53))
+            return 0;
+        offset += sizeof(udp);
+        len = skb->len - offset;
+    }
+
+    if (bpf_skb_load_bytes(skb, offset, hdr, sizeof(hdr)))
+        return 0;
+    /* 只要单个问题、无错误的标准查询应答 */
+    if ((bpf_ntohs(hdr[1]) & (DNS_FLAG_QR | DNS_FLAG_OPCODE | DNS_FLAG_RCODE)) != DNS_FLAG_QR ||
+        hdr[2] != bpf_htons(1))
+        return 0;
+
+    if (len > IDCLASS_DNS_MAX_LEN)
+        len = IDCLASS_DNS_MAX_LEN;
+    if (len < DNS_HDR_LEN)
+        return 0;
+
+    ev = bpf_ringbuf_reserve(&dns_events, sizeof(*ev), 0);
+    if (!ev) {
+        count_inc(IDCLASS_CNT_DNS_DROP);
+        return 0;
+    }
+    if (bpf_skb_load_bytes(skb, offset, ev->data, len)) {
+        bpf_ringbuf_discard(ev, 0);
+        return 0;
+    }
+    ev->len = len;
+
+    dscp = dns_match_qname(ev, &name_end);
+    if (dscp != 0xff) {
+        dns_premark(ev, name_end, bpf_ntohs(hdr[3]), dscp);
+        /* 地址已标记，用户态只做超时记录，攒成一块再唤醒 */
+        if (bpf_ringbuf_query(&dns_events, BPF_RB_AVAIL_DATA) < IDCLASS_DNS_BLOCK_SIZE) {
+            flags = BPF_RB_NO_WAKEUP;
+            count_inc(IDCLASS_CNT_DNS_DEFERRED);
+        }
+    }
+    /*
+     * 其余应答可能要靠用户态的正则/通配规则分类，立即唤醒；即使前面还有
+     * 积压的延迟记录（此时默认的唤醒条件不成立）
+     */
+
+    bpf_ringbuf_submit(ev, flags);
+    count_inc(IDCLASS_CNT_DNS_SENT);
+    if (proto == IPPROTO_TCP)
+        count_inc(IDCLASS_CNT_DNS_TCP);
+    return 0;
+}
+
+/*
+ * 分类主体。prog_flags（IDCLASS_INGRESS/IDCLASS_IP_ONLY）由各入口以常量传入，
+ * 四个变体在同一个对象中共享全部 map。
+ */
+static __always_inline int classify(struct __sk_buff *skb, __u32 prog_flags)
 {
     struct skb_parser_info info;
-    __u8 ingress = !!(module_flags & IDCLASS_INGRESS);
+    __u8 ingress = !!(prog_flags & IDCLASS_INGRESS);
     struct global_config *gcfg;
     struct idclass_class *class = NULL;
+    struct idclass_flow_config *cfg = NULL;
     struct idclass_ip_map_val *ip_val;
     __u32 iph_offset;
     __u8 dscp = 0;
     int type;
-    __u32 hash;
+    struct flow_key fkey = {};
     struct flow_stats *stats;
+    struct ip_key client = {};
+    __u8 client_family = 0;
+    __u32 tcp_len = 0;
+    void *flow_map;
+    __u64 now;
     __u32 prio_level = 0;
+    __u32 mark = 0;
+    int has_mark;
 
     gcfg = get_global_config();
     if (!gcfg) return TC_ACT_UNSPEC;
 
     skb_parse_init(&info, skb);
-    if (module_flags & IDCLASS_IP_ONLY) {
+    if (prog_flags & IDCLASS_IP_ONLY) {
         type = info.proto = skb->protocol;
     } else if (skb_parse_ethernet(&info)) {
         skb_parse_vlan(&info);
@@ -567,6 +1572,11 @@ int classify(struct __sk_buff *skb)
     else
         return TC_ACT_UNSPEC;
 
+    /* 上游 DNS 应答（取代原先 ifb-dns 镜像 + AF_PACKET 的方式） */
+    if (ingress && gcfg->dns_capture &&
+        (info.proto == IPPROTO_UDP || info.proto == IPPROTO_TCP))
+        dns_capture(skb, info.offset, info.proto);
+
     if (ip_val) {
         if (!ip_val->seen)
             ip_val->seen = 1;
@@ -578,77 +1588,273 @@ int classify(struct __sk_buff *skb)
         class = bpf_map_lookup_elem(&class_map, &key);
         if (class && !(class->flags & IDCLASS_CLASS_FLAG_PRESENT))
             class = NULL;
+        if (class)
+            cfg = get_flow_config(gcfg, class->config);
     }
 
-    hash = bpf_get_hash_recalc(skb);
-    stats = bpf_map_lookup_elem(&flow_stats_map, &hash);
+    /*
+     * 客户端地址（IPv4 用 IPv4-mapped 格式），用于连接数统计；
+     * 流键取自同一个报头，不再每包重新计算 skb hash
+     */
+    if (type == bpf_htons(ETH_P_IP)) {
+        struct iphdr *iph = skb_ptr(skb, iph_offset, sizeof(*iph));
+        if (iph) {
+            __u32 ip = ingress ? iph->saddr : iph->daddr;
+            if (tcph)
+                tcp_len = bpf_ntohs(iph->tot_len) - iph->ihl * 4;
+            client.addr[10] = 0xff;
+            client.addr[11] = 0xff;
+            __builtin_memcpy(client.addr + 12, &ip, 4);
+            client_family = 4;
+
+            fkey.addr[0][2] = fkey.addr[1][2] = bpf_htonl(0xffff);
+            fkey.addr[0][3] = iph->saddr;
+            fkey.addr[1][3] = iph->daddr;
+        }
+    } else {
+        struct ipv6hdr *ip6h = skb_ptr(skb, iph_offset, sizeof(*ip6h));
+        if (ip6h) {
+            void *addr = ingress ? (void *)&ip6h->saddr : (void *)&ip6h->daddr;
+            if (tcph)
+                tcp_len = bpf_ntohs(ip6h->payload_len);
+            __builtin_memcpy(client.addr, addr, 16);
+            client_family = 6;
+
+            __builtin_memcpy(fkey.addr[0], &ip6h->saddr, 16);
+            __builtin_memcpy(fkey.addr[1], &ip6h->daddr, 16);
+        }
+    }
+    flow_key_finish(&fkey, skb, info.offset, info.proto);
+
+    if (module_flags & IDCLASS_PERCPU_STATS)
+        flow_map = &flow_stats_percpu;
+    else
+        flow_map = &flow_stats_map;
+
+    now = bpf_ktime_get_ns();
+    stats = bpf_map_lookup_elem(flow_map, &fkey);
     if (!stats) {
         struct flow_stats new = {};
-        new.first_seen = bpf_ktime_get_ns();
-        new.last_seen = new.first_seen;
-        new.last_pkt_ts = new.first_seen;
-        new.avg_pkt_len = skb->len;
-        new.burst_start_ts = bpf_ktime_get_ns() / 1000000ULL;
-        new.burst_packets = 1;
-        new.burst_bytes = skb->len;
-        __builtin_memset(new.client_ip, 0, 16);
-        new.client_family = 0;
-        bpf_map_update_elem(&flow_stats_map, &hash, &new, BPF_NOEXIST);
-        stats = bpf_map_lookup_elem(&flow_stats_map, &hash);
+        struct flow_info finfo = {};
+
+        new.first_seen_ms = now / 1000000ULL;
+        new.avg_pkt_len = skb->len << EWMA_SHIFT;
+        new.burst_start_ms = new.first_seen_ms;
+        if (!bpf_map_update_elem(flow_map, &fkey, &new, BPF_NOEXIST)) {
+            struct idclass_event *ev;
+
+            if (FEATURE_ON(FEATURE_CONN) && client_family && conn_inc(&client))
+                event_map_full(gcfg, IDCLASS_EV_MAP_CONN, flow_key_hash(&fkey));
+
+            ev = event_reserve(gcfg, IDCLASS_EV_FLOW_NEW);
+            if (ev) {
+                ev->hash = flow_key_hash(&fkey);
+                ev->ingress = ingress;
+                ev->client_family = client_family;
+                __builtin_memcpy(ev->client_ip, client.addr, 16);
+                event_submit(ev);
+            }
+        }
+        stats = bpf_map_lookup_elem(flow_map, &fkey);
+        if (!stats)
+            event_map_full(gcfg, IDCLASS_EV_MAP_FLOW, flow_key_hash(&fkey));
+
+        __builtin_memcpy(finfo.client_ip, client.addr, 16);
+        finfo.client_family = client_family;
+        bpf_map_update_elem(&flow_info_map, &fkey, &finfo, BPF_ANY);
+    } else if ((module_flags & IDCLASS_PERCPU_STATS) && !stats->first_seen_ms) {
+        /* 流由其他 CPU 创建，本 CPU 的分片为全零，在此初始化 */
+        stats->first_seen_ms = now / 1000000ULL;
+        stats->avg_pkt_len = skb->len << EWMA_SHIFT;
+        stats->burst_start_ms = stats->first_seen_ms;
     }
 
+    count_inc(IDCLASS_CNT_PACKETS);
+
     /* 无论是否有 class，都更新统计 */
     if (stats) {
-        update_flow_stats(stats, skb->len, bpf_ktime_get_ns(), ingress,
-                          class ? &class->config : NULL, tcph, skb);
-
-        if (type == bpf_htons(ETH_P_IP)) {
-            struct iphdr *iph = skb_ptr(skb, iph_offset, sizeof(*iph));
-            if (iph) {
-                __u32 src = iph->saddr;
-                __u32 dst = iph->daddr;
-                __u32 ip = (ingress) ? src : dst;
-                __builtin_memset(stats->client_ip, 0, 10);
-                stats->client_ip[10] = 0xff;
-                stats->client_ip[11] = 0xff;
-                __builtin_memcpy(stats->client_ip + 12, &ip, 4);
-                stats->client_family = 4;
+        update_flow_stats(stats, &fkey, &client, skb->len, now, ingress, gcfg->window_shift,
+                          cfg, tcph, tcp_len, skb);
+
+        /* 稳态包直接使用缓存的判定，每 N 个包或 M 毫秒重新评分一次 */
+        if (verdict_fresh(stats, ingress, gcfg, now / 1000000ULL)) {
+            mark = stats->verdict_mark[ingress];
+            has_mark = 1;
+        } else {
+            struct flow_stats *view = stats;
+            __u32 scores[4] = {};
+            __u32 other_mark = 0;
+            __u8 old_prio = stats->verdict_prio;
+            __u8 old_flags = stats->verdict_flags;
+
+            /* 每 CPU 模式下本分片只有部分包，按全部分片的合并结果评分 */
+            if (module_flags & IDCLASS_PERCPU_STATS)
+                view = flow_stats_merged(&fkey, stats);
+            if (cfg)
+                prio_level = classify_score(view, &client, cfg, scores);
+            has_mark = prio_to_mark(prio_level, ingress, &mark);
+
+            /* 已有判定的流优先级发生变化 */
+            if ((old_flags & IDCLASS_VERDICT_VALID) && old_prio != prio_level) {
+                struct idclass_event *ev = event_reserve(gcfg, IDCLASS_EV_CLASS_CHANGE);
+                if (ev) {
+                    ev->hash = flow_key_hash(&fkey);
+                    ev->ingress = ingress;
+                    ev->client_family = client_family;
+                    __builtin_memcpy(ev->client_ip, client.addr, 16);
+                    ev->old_prio = old_prio;
+                    ev->new_prio = prio_level;
+                    __builtin_memcpy(ev->scores, scores, sizeof(scores));
+                    ev->packets = view->packets;
+                    ev->bytes = view->bytes;
+                    ev->duration_ms = now / 1000000ULL - view->first_seen_ms;
+                    event_submit(ev);
+                }
             }
-        } else if (type == bpf_htons(ETH_P_IPV6)) {
-            struct ipv6hdr *ip6h = skb_ptr(skb, iph_offset, sizeof(*ip6h));
-            if (ip6h) {
-                void *addr = ingress ? (void *)&ip6h->saddr : (void *)&ip6h->daddr;
-                __builtin_memcpy(stats->client_ip, addr, 16);
-                stats->client_family = 6;
+
+            /*
+             * 优先级与方向无关，重新评分时同时更新两个方向的 mark，反方向
+             * 的包（如下载时的 ACK）不必再各自评分
+             */
+            stats->verdict_flags = 0;
+            stats->verdict_mark[ingress] = mark;
+            if (has_mark)
+                stats->verdict_flags |= ingress ? IDCLASS_VERDICT_INGRESS : IDCLASS_VERDICT_EGRESS;
+            if (prio_to_mark(prio_level, !ingress, &other_mark)) {
+                stats->verdict_mark[!ingress] = other_mark;
+                stats->verdict_flags |= ingress ? IDCLASS_VERDICT_EGRESS : IDCLASS_VERDICT_INGRESS;
             }
+            stats->verdict_prio = prio_level;
+            stats->verdict_ms = now / 1000000ULL;
+            count_inc(IDCLASS_CNT_RESCORE);
         }
+    } else {
+        has_mark = prio_to_mark(prio_level, ingress, &mark);
+    }
 
-        if (class)
-            prio_level = classify_score(stats, &class->config);
+    if (has_mark) {
+        if (module_flags & IDCLASS_SET_DSCP) {
+            __u8 dscp_val = mark & 0x3F;
+            if (type == bpf_htons(ETH_P_IP))
+                ipv4_set_dscp(skb, iph_offset, dscp_val);
+            else if (type == bpf_htons(ETH_P_IPV6))
+                ipv6_set_dscp(skb, iph_offset, dscp_val);
+        } else {
+            skb->mark = mark;   /* 直接赋值，无需辅助函数 */
+        }
     }
 
-    __u32 *class_id_ptr;
-    if (ingress)
-        class_id_ptr = bpf_map_lookup_elem(&prio_class_up, &prio_level);
-    else
-        class_id_ptr = bpf_map_lookup_elem(&prio_class_down, &prio_level);
+    return TC_ACT_UNSPEC;
+}
 
-    if (class_id_ptr) {
-        __u32 *val = bpf_map_lookup_elem(&class_mark, class_id_ptr);
-        if (val) {
-            if (module_flags & IDCLASS_SET_DSCP) {
-                __u8 dscp_val = *val & 0x3F;
-                if (type == bpf_htons(ETH_P_IP))
-                    ipv4_set_dscp(skb, iph_offset, dscp_val);
-                else if (type == bpf_htons(ETH_P_IPV6))
-                    ipv6_set_dscp(skb, iph_offset, dscp_val);
-            } else {
-                skb->mark = *val;   /* 直接赋值，无需辅助函数 */
-            }
+struct sweep_ctx {
+    __u64 now;
+    __u64 timeout_ns;
+    __u32 expired;
+};
+
+/* 删除空闲超时的流并减少其客户端的连接数 */
+static long sweep_flow(void *map, struct flow_key *key, struct flow_stats *stats,
+                       struct sweep_ctx *ctx)
+{
+    __u64 last_seen = stats->last_seen;
+    __u32 packets = stats->packets, bytes = stats->bytes;
+    __u32 first_seen_ms = stats->first_seen_ms;
+    struct global_config *gcfg;
+    struct idclass_event *ev;
+    struct flow_info *info;
+    __u32 i;
+
+    if (module_flags & IDCLASS_PERCPU_STATS) {
+        packets = bytes = 0;
+        for (i = 0; i < PERCPU_MAX_CPUS && i < nr_cpus; i++) {
+            struct flow_stats *s;
+
+            s = bpf_map_lookup_percpu_elem(&flow_stats_percpu, key, i);
+            if (!s || !s->first_seen_ms)
+                continue;
+            if (s->last_seen > last_seen)
+                last_seen = s->last_seen;
+            if ((__s32)(s->first_seen_ms - first_seen_ms) < 0 || !first_seen_ms)
+                first_seen_ms = s->first_seen_ms;
+            packets += s->packets;
+            bytes += s->bytes;
         }
     }
 
-    return TC_ACT_UNSPEC;
+    if (ctx->now - last_seen < ctx->timeout_ns)
+        return 0;
+
+    info = bpf_map_lookup_elem(&flow_info_map, key);
+    if (FEATURE_ON(FEATURE_CONN) && info && info->client_family)
+        conn_dec(info->client_ip);
+
+    gcfg = get_global_config();
+    ev = gcfg ? event_reserve(gcfg, IDCLASS_EV_FLOW_END) : NULL;
+    if (ev) {
+        ev->hash = flow_key_hash(key);
+        if (info) {
+            ev->client_family = info->client_family;
+            __builtin_memcpy(ev->client_ip, info->client_ip, 16);
+        }
+        ev->packets = packets;
+        ev->bytes = bytes;
+        ev->duration_ms = last_seen / 1000000ULL - first_seen_ms;
+        event_submit(ev);
+    }
+    bpf_map_delete_elem(&flow_info_map, key);
+    if (FEATURE_ON(FEATURE_TCP_RTT) && key->proto == IPPROTO_TCP)
+        bpf_map_delete_elem(&flow_rtt_map, key);
+    bpf_map_delete_elem(map, key);
+    ctx->expired++;
+    return 0;
+}
+
+/*
+ * 空闲流清理，由用户态通过 BPF_PROG_TEST_RUN 周期性触发，返回删除的流数。
+ * LRU 淘汰的流无法在此感知，由用户态定期校准连接数。
+ */
+SEC("classifier")
+int flow_sweep(struct __sk_buff *skb)
+{
+    struct global_config *gcfg = get_global_config();
+    struct sweep_ctx ctx = {};
+
+    if (!gcfg || !gcfg->active_timeout_s)
+        return 0;
+
+    ctx.now = bpf_ktime_get_ns();
+    ctx.timeout_ns = gcfg->active_timeout_s * 1000000000ULL;
+    if (module_flags & IDCLASS_PERCPU_STATS)
+        bpf_for_each_map_elem(&flow_stats_percpu, sweep_flow, &ctx, 0);
+    else
+        bpf_for_each_map_elem(&flow_stats_map, sweep_flow, &ctx, 0);
+
+    return ctx.expired;
+}
+
+SEC("classifier")
+int classify_egress_eth(struct __sk_buff *skb)
+{
+    return classify(skb, 0);
+}
+
+SEC("classifier")
+int classify_egress_ip(struct __sk_buff *skb)
+{
+    return classify(skb, IDCLASS_IP_ONLY);
+}
+
+SEC("classifier")
+int classify_ingress_eth(struct __sk_buff *skb)
+{
+    return classify(skb, IDCLASS_INGRESS);
+}
+
+SEC("classifier")
+int classify_ingress_ip(struct __sk_buff *skb)
+{
+    return classify(skb, IDCLASS_INGRESS | IDCLASS_IP_ONLY);
 }
 
 char _license[] SEC("license") = "GPL";
\ No newline at end of file
@@ -12,6 +12,12 @@
 #define IDCLASS_MAX_CLASS_ENTRIES	33
 #define IDCLASS_DEFAULT_CLASS_ENTRIES	2
 
+/*
+ * 固定 map 的布局版本：热重启时只有与之相同才复用上次运行留下的 map。
+ * 修改任何固定 map 的键、值结构或其含义时加一。
+ */
+#define IDCLASS_MAP_LAYOUT_VERSION	9
+
 #ifndef IDCLASS_FLOW_BUCKET_SHIFT
 #define IDCLASS_FLOW_BUCKET_SHIFT	13
 #endif
@@ -21,6 +27,7 @@
 #define IDCLASS_INGRESS			(1 << 0)
 #define IDCLASS_IP_ONLY			(1 << 1)
 #define IDCLASS_SET_DSCP			(1 << 2)
+#define IDCLASS_PERCPU_STATS		(1 << 3)
 
 #define IDCLASS_DSCP_VALUE_MASK		((1 << 6) - 1)
 #define IDCLASS_DSCP_FALLBACK_FLAG	(1 << 6)
@@ -28,6 +35,104 @@
 
 #define IDCLASS_CLASS_FLAG_PRESENT	(1 << 0)
 
+/* flow_stats.verdict_flags：每个方向的缓存判定各有一个有效位 */
+#define IDCLASS_VERDICT_EGRESS		(1 << 0)
+#define IDCLASS_VERDICT_INGRESS		(1 << 1)
+#define IDCLASS_VERDICT_VALID		(IDCLASS_VERDICT_EGRESS | IDCLASS_VERDICT_INGRESS)
+
+/* classify_counters（每 CPU 数组）的下标 */
+enum idclass_counter {
+    IDCLASS_CNT_PACKETS,
+    IDCLASS_CNT_RESCORE,
+    IDCLASS_CNT_EV_SENT,
+    IDCLASS_CNT_EV_DROP,
+    IDCLASS_CNT_DNS_SENT,
+    IDCLASS_CNT_DNS_DROP,
+    IDCLASS_CNT_DNS_PREMARK,
+    IDCLASS_CNT_DNS_DEFERRED,
+    IDCLASS_CNT_DNS_TCP,
+    __IDCLASS_CNT_MAX
+};
+
+/* 经 ring buffer 上报给用户态的事件 */
+enum idclass_event_type {
+    IDCLASS_EV_FLOW_NEW,
+    IDCLASS_EV_CLASS_CHANGE,
+    IDCLASS_EV_FLOW_END,
+    IDCLASS_EV_MAP_FULL,
+    __IDCLASS_EV_MAX
+};
+
+#define IDCLASS_EV_ALL			((1 << __IDCLASS_EV_MAX) - 1)
+
+/* IDCLASS_EV_MAP_FULL 的 map 标识 */
+enum idclass_event_map {
+    IDCLASS_EV_MAP_FLOW,
+    IDCLASS_EV_MAP_CONN,
+};
+
+struct idclass_event {
+    __u64 ts_ns;
+    __u32 type;
+    __u32 hash;
+    __u8 client_ip[16];         /* IPv4 用 IPv4-mapped 格式 */
+    __u8 client_family;
+    __u8 ingress;
+    __u8 old_prio;
+    __u8 new_prio;
+    __u32 scores[4];            /* realtime/video/normal/bulk 得分 */
+    __u32 packets;
+    __u32 bytes;
+    __u32 duration_ms;
+    __u32 map;                  /* enum idclass_event_map */
+};
+
+/*
+ * 上游 DNS 应答（UDP 或 TCP 源端口 53）的载荷，经 dns_events ring buffer
+ * 交给用户态。超过 IDCLASS_DNS_MAX_LEN 的部分被截断（EDNS 建议的最大 UDP
+ * 载荷）；TCP 只处理完整位于一个报文段内的应答。
+ */
+#define IDCLASS_DNS_MAX_LEN     1232
+#define IDCLASS_DNS_NAME_MAX    128     /* 数据路径能匹配的最长查询名（线格式） */
+#define IDCLASS_DNS_MAX_LABELS  16
+#define IDCLASS_DNS_MAX_ANSWERS 8
+
+/*
+ * 已在数据路径预先标记的应答不立即唤醒用户态，积压达到一个块的大小才唤醒，
+ * 其余由用户态定时（IDCLASS_DNS_DRAIN_MS）取走
+ */
+#define IDCLASS_DNS_BLOCK_SIZE  (64 * 1024)
+#define IDCLASS_DNS_DRAIN_MS    100
+
+struct idclass_dns_event {
+    __u16 len;
+    __u8 pad[2];
+    __u8 data[IDCLASS_DNS_MAX_LEN];
+};
+
+/*
+ * dns_names：用户态把可在内核匹配的域名规则（精确名和 "*.suffix"）写入，
+ * 命中后数据路径直接标记应答中的地址。hash 为小写线格式名（不含根标签）
+ * 从右向左的 FNV-1a，这样一次扫描即可得到每个后缀的 hash。
+ */
+#define IDCLASS_DNS_HASH_INIT       2166136261U
+#define IDCLASS_DNS_HASH_STEP(h, c) (((h) ^ (__u8)(c)) * 16777619U)
+
+struct idclass_dns_key {
+    __u32 hash;
+    __u32 wildcard;             /* 1: "*.suffix"，只匹配更长的名字 */
+};
+
+/* 有 seq 更小的用户态规则（正则/通配/仅 CNAME）可能命中，不能在内核预标记 */
+#define IDCLASS_DNS_VAL_SHADOWED    (1 << 0)
+
+struct idclass_dns_val {
+    __u32 seq;                  /* 与用户态规则顺序一致，小者优先 */
+    __u8 dscp;
+    __u8 flags;                 /* IDCLASS_DNS_VAL_* */
+    __u8 pad[2];
+};
+
 // 特征掩码宏（共12个）
 #define FEATURE_PKTLEN      (1 << 0)
 #define FEATURE_CONN        (1 << 1)
@@ -41,6 +146,10 @@
 #define FEATURE_TCP_WINDOW  (1 << 9)
 #define FEATURE_TCP_MSS     (1 << 10)
 #define FEATURE_TCP_RTT     (1 << 11)
+#define FEATURE_HIST        (1 << 12)
+#define FEATURE_ALL         ((FEATURE_HIST << 1) - 1)
+#define FEATURE_TCP_ALL     (FEATURE_RETRANS | FEATURE_TCPFLAGS | FEATURE_TCP_WINDOW | \
+                             FEATURE_TCP_MSS | FEATURE_TCP_RTT)
 
 /* 定义结构体，放在 map 定义之前 */
 struct idclass_ip_map_val {
@@ -48,6 +157,20 @@ struct idclass_ip_map_val {
     __u8 seen;
 };
 
+/* 前缀 map（LPM trie）的 key：prefixlen 必须在最前，地址按网络字节序 */
+struct idclass_lpm4_key {
+    __u32 prefixlen;
+    __u32 addr;
+};
+
+struct idclass_lpm6_key {
+    __u32 prefixlen;
+    __u32 addr[4];
+};
+
+#define IDCLASS_PREFIX_IPV4 (1 << 0)
+#define IDCLASS_PREFIX_IPV6 (1 << 1)
+
 struct idclass_dscp_val {
     __u8 ingress;
     __u8 egress;
@@ -91,6 +214,9 @@ struct idclass_flow_config {
     __u16 iat_threshold_us;
     __u16 retrans_threshold;
 
+    __u16 hist_bimodal_pct;     /* 大包、小包各占至少此比例视为双峰 */
+    __u16 hist_periodic_pct;    /* 包间隔集中在相邻两格的比例 */
+
     __u32 feature_mask;
 
     __u16 weight_pktlen_realtime;
@@ -129,6 +255,8 @@ struct idclass_flow_config {
     __u16 weight_rtt_video;
     __u16 weight_rtt_normal;
     __u16 weight_rtt_bulk;
+    __u16 weight_hist_video;
+    __u16 weight_hist_realtime;
 
     // 新增 TCP 特征阈值
     __u16 tcp_window_low;      // 窗口低于此值视为实时（小窗口）
@@ -146,51 +274,192 @@ struct idclass_flow_config {
     __u32 prio_bulk;
 } __attribute__((packed));
 
+/*
+ * 流表的键：连接的 5 元组，两端按 (地址, 端口) 排序后存放，同一连接的两个
+ * 方向（egress 上传和 ingress 下载）得到同一个键，统计落在同一条记录中。
+ * 完整元组作为键，不同连接不会因 hash 冲突共用一条记录。
+ */
+struct flow_key {
+    __u32 addr[2][4];           /* 两端地址，IPv4 用 IPv4-mapped 格式 */
+    __be16 port[2];             /* 对应端口，非 TCP/UDP 为 0 */
+    __u8 proto;
+    __u8 pad[3];
+};
+
+/*
+ * 重传/乱序检测（FEATURE_RETRANS）：每个方向记录已见到的最高序号之后的
+ * 下一个序号，比较一律用序号算术（RFC 1982），回绕不影响结果。段越过
+ * seq_next 时留下的空洞记在 hole_lo..hole_hi；之后落进空洞的段若在
+ * 重排窗口（约半个 RTT）内到达算乱序，否则算重传；整段早已见过的算重传。
+ */
+#define IDCLASS_REORDER_US      20000   /* RTT 未知时的重排窗口 */
+
+struct tcp_seq_state {
+    __u32 seq_next;             /* 已见最高序号 + 1，0 表示尚未初始化 */
+    __u32 hole_lo;              /* 最近一个空洞，hole_us 为 0 表示无 */
+    __u32 hole_hi;
+    __u32 hole_us;
+};
+
+/*
+ * 每 WAN 接口的丢包计数（wan_loss_map，每 CPU，键为 ifindex），下标为
+ * 报文方向。wan_lost 只计丢在 WAN 一侧的段：egress 方向为已经过路由器
+ * 又被重传的段，ingress 方向为迟迟才补上空洞的段。wan_lost / segs 可作为
+ * 带宽控制器的拥塞信号。
+ */
+struct idclass_wan_loss {
+    __u64 segs[2];
+    __u64 retrans[2];
+    __u64 reorder[2];
+    __u64 wan_lost[2];
+};
+
+/*
+ * 包长和包间隔的 log2 直方图（FEATURE_HIST）：len_hist[i] 统计长度在
+ * [2^i, 2^(i+1)) 字节的包，iat_hist[i] 统计间隔在 [2^i, 2^(i+1)) 个
+ * 2^IDCLASS_HIST_IAT_SHIFT 纳秒（约 16us）的包，超出范围的落进两端。
+ * 每格 8 位，某格满时整个直方图减半，并随 [W] 计数器一起衰减，只保留形状。
+ */
+#define IDCLASS_HIST_BINS           16
+#define IDCLASS_HIST_IAT_SHIFT      14
+#define IDCLASS_HIST_SMALL_BIN      8       /* 小于 256 字节为小包 */
+#define IDCLASS_HIST_LARGE_BIN      10      /* 不小于 1024 字节为大包 */
+#define IDCLASS_HIST_PERIODIC_MIN   6       /* 周期性发包的间隔范围，约 1ms */
+#define IDCLASS_HIST_PERIODIC_MAX   12      /* 到约 130ms */
+
+#define EWMA_SHIFT                  12      /* avg_pkt_len 的定点位数 */
+
+/*
+ * 每流统计（热数据）：自然对齐，classify() 每包都要读写的字段集中在前 64 字节，
+ * TCP 相关字段在其后。时间戳除 last_seen 外均为 32 位毫秒/微秒值，
+ * 只用于求差，回绕不影响结果。
+ *
+ * 标 [W] 的计数器按时间衰减：global_config.window_shift 不为 0 时，每过
+ * 2^window_shift 毫秒减半（只用移位），反映的是最近几个周期的行为而不是
+ * 整个生命周期，长连接改变行为后也能重新分类。
+ */
 struct flow_stats {
-    __u64 packets;
-    __u64 bytes;
-    __u32 avg_pkt_len;
-    __u64 first_seen;
-    __u64 last_seen;
+    /* 第一个 cache line：所有流每包访问 */
+    __u64 last_seen;            /* ns */
+    __u32 packets;              /* 低 32 位，高位在 flow_info */
+    __u32 bytes;                /* 低 32 位，高位在 flow_info */
+    __u32 avg_pkt_len;          /* EWMA，定点（<< EWMA_SHIFT） */
+    __u32 iat_us;               /* EWMA */
+    __u32 up_bytes;             /* [W] 仅用于上下行比例，溢出前两者同时减半 */
+    __u32 down_bytes;           /* [W] */
     __u32 pps;
-    __u64 last_pps_ts;
+    __u32 pps_window_ms;
     __u32 packets_in_window;
+    __u32 burst_start_ms;
     __u32 burst_packets;
     __u32 burst_bytes;
-    __u64 burst_start_ts;
-    __u32 syn_count;
-    __u32 ack_count;
-    __u32 fin_count;
-    __u32 rst_count;
-    __u32 retrans_count;
-    __u64 tcp_seq;
-    __u8  fin_rst_seen;
-    __u64 up_bytes;
-    __u64 down_bytes;
-    __u64 last_pkt_ts;
-    __u32 iat_us;
-    // 新增字段（优化 IPv6 支持）
-    __u8 client_ip[16];        // 客户端 IP（IPv4 用 IPv4-mapped 格式）
-    __u8 client_family;        // 地址族：4 或 6
-    __u64 max_seq;              // 最大 TCP 序列号
-
-    // 新增 TCP 特征字段
-    __u16 tcp_window;          // 当前 TCP 接收窗口大小（EWMA）
-    __u16 tcp_mss;             // TCP 最大段大小（从 SYN 包提取）
-    __u32 tcp_rtt_us;          // RTT 估计值（微秒，EWMA）
-    __u32 tcp_rtt_var_us;      // RTT 方差（可选，暂未使用）
-} __attribute__((packed));
+    __u32 verdict_mark[2];      /* 缓存的 class_mark 值（mark 或 DSCP），下标为报文方向 */
+
+    /* 重新评分时才访问 */
+    __u32 verdict_ms;
+    __u8  verdict_prio;
+    __u8  verdict_flags;        /* IDCLASS_VERDICT_*，对应方向的 verdict_mark 有效 */
+    __u16 tcp_window;           /* EWMA */
+    __u32 win_epoch;            /* 上次衰减时的 now_ms >> window_shift */
+    __u32 win_packets;          /* [W] 与 packets 相同，但按时间衰减 */
+    __u8  len_hist[IDCLASS_HIST_BINS];  /* [W] 按 64 位字整体移位，须 8 字节对齐 */
+    __u8  iat_hist[IDCLASS_HIST_BINS];  /* [W] */
+    __u32 first_seen_ms;
+
+    /* TCP 流才访问 */
+    __u32 tcp_rtt_us;           /* 远端与本地段 RTT 之和（被动测量） */
+    __u32 syn_count;            /* [W] */
+    __u32 ack_count;            /* [W] */
+    __u32 fin_count;            /* [W] */
+    __u32 rst_count;            /* [W] */
+    __u32 data_segs;            /* [W] 带负载的段数（两个方向） */
+    __u32 retrans_count;        /* [W] */
+    __u32 reorder_count;        /* [W] */
+    struct tcp_seq_state seq[2];    /* 下标为报文方向 */
+    __u16 tcp_mss;              /* 从 SYN 包提取 */
+} __attribute__((aligned(8)));
+
+/* 每包访问的字段必须正好占满第一个 cache line，直方图按 64 位字移位 */
+_Static_assert(__builtin_offsetof(struct flow_stats, verdict_ms) == 64,
+               "flow_stats: per-packet fields must fill exactly the first 64 bytes");
+_Static_assert(__builtin_offsetof(struct flow_stats, len_hist) % 8 == 0,
+               "flow_stats: histograms must be 8-byte aligned");
+
+/*
+ * 被动 TCP RTT 测量（FEATURE_TCP_RTT）：报文发出时记下其 TSval（或 SYN 的
+ * 序号），对端回显该 TSval（或确认该 SYN）时得到一个样本。每个方向最多
+ * 同时等待 IDCLASS_RTT_SLOTS 个 TSval，超过 IDCLASS_RTT_MAX_US 未被回显的
+ * 作废。
+ */
+#define IDCLASS_RTT_SLOTS       4
+#define IDCLASS_RTT_MAX_US      3000000
+
+struct idclass_rtt_slot {
+    __u32 tsval;
+    __u32 sent_us;              /* 0 表示空闲 */
+};
+
+/*
+ * 每条 TCP 流待匹配的时间戳（flow_rtt_map）。下标为报文方向：0 为 egress
+ * 发出、由 ingress 回显，测得路由器到远端的 RTT；1 为 ingress 发出、由
+ * egress 回显，测得路由器到本地主机的 RTT。
+ */
+struct flow_rtt {
+    struct idclass_rtt_slot pending[2][IDCLASS_RTT_SLOTS];
+    __u32 last_tsval[2];        /* 每个 TSval 只记录第一次出现 */
+    __u32 syn_seq[2];
+    __u32 syn_us[2];            /* 等待确认的 SYN 的发出时间，0 表示无 */
+    __u32 rtt_us[2];            /* 两段 RTT 的 EWMA */
+};
+
+/* 每个客户端地址的时延统计（client_rtt_map，键与 ip_conn_map 相同） */
+struct client_rtt {
+    __u32 rtt_us;               /* 远端 RTT 的 EWMA */
+    __u32 lan_rtt_us;           /* 本地段 RTT 的 EWMA */
+    __u32 min_rtt_us;           /* 远端 RTT 的最小值 */
+    __u32 samples;
+    __u32 last_ms;              /* 最近一个样本的时间（单调时钟毫秒） */
+};
+
+/* 每流冷数据：仅在新建流和计数器回绕时写入，由用户态读取 */
+struct flow_info {
+    __u8 client_ip[16];         /* 客户端 IP（IPv4 用 IPv4-mapped 格式） */
+    __u32 packets_hi;
+    __u32 bytes_hi;
+    __u8 client_family;         /* 地址族：4 或 6 */
+    __u8 pad[7];
+};
 
 struct global_config {
     __u8 dscp_icmp;
     __u32 wan_ifindex;
     __u32 ifb_ifindex;
+    __u16 rescore_ms;           /* 流判定缓存的最长有效期 */
+    __u16 rescore_pkt_mask;     /* 每 (mask + 1) 个包重新评分一次 */
+    __u16 active_timeout_s;     /* 空闲超过此时间的流由 flow_sweep 删除 */
+    __u8 event_mask;            /* 启用的事件类型（无订阅者时为 0） */
+    __u8 prefix_maps;           /* 非空的前缀 map（IDCLASS_PREFIX_*），为 0 时跳过 trie 查找 */
+    __u8 dns_capture;           /* 用户态在消费 dns_events 时为 1 */
+    __u8 config_gen;            /* flow_config_map 中当前使用的一代（0/1） */
+    __u8 window_shift;          /* 特征计数器的衰减周期为 2^shift 毫秒，0 为不衰减 */
 } __attribute__((packed));
 
+#define IDCLASS_WINDOW_SHIFT_DEFAULT    14      /* 16.4 秒 */
+#define IDCLASS_WINDOW_SHIFT_MAX        20
+
+/*
+ * 流特征配置按代存放在 flow_config_map 中，键为
+ * gen * IDCLASS_FLOW_CONFIG_SLOTS + slot，类通过 config 字段引用 slot。
+ * 用户态把新配置写进不在使用的一代，再翻转 global_config.config_gen；
+ * 数据路径每个包只从一代中读取，不会用新旧混合的阈值评分。
+ */
+#define IDCLASS_FLOW_CONFIG_SLOTS   4
+#define IDCLASS_FLOW_CONFIG_DEFAULT 0
+
 struct idclass_class {
-    struct idclass_flow_config config;
     struct idclass_dscp_val val;
     __u8 flags;
+    __u8 config;                /* flow_config_map 中的 slot */
     __u64 packets;
 } __attribute__((packed));
 
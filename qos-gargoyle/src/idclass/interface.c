@@ -2,18 +2,19 @@
 /*
  * interface.c - Network interface TC qdisc/filter management module
  *
- * Attaches eBPF classifiers to network interfaces using tc, and manages
- * IFB devices for ingress redirection. Supports both devices (like eth0)
- * and logical interfaces (like lan) that may be bridged.
+ * Attaches eBPF classifiers to network interfaces over rtnetlink (see
+ * rtnl_batch.c), and manages IFB devices for ingress redirection. Supports
+ * both devices (like eth0) and logical interfaces (like lan) that may be
+ * bridged. A rebuilt classifier is swapped into the existing filters in
+ * place, the qdiscs are only recreated if that fails.
  */
 #include "common.h"
 #include "ebpf_loader.h"
 #include "ubus_server.h"
 
+#include <time.h>
 #include <sys/ioctl.h>
 #include <net/if_arp.h>
-#include <linux/rtnetlink.h>
-#include <linux/pkt_cls.h>
 #include <libubox/vlist.h>
 
 #define APPEND(_buf, _ofs, _format, ...) \
@@ -42,6 +43,17 @@ struct idclass_iface {
     char ifname[IFNAMSIZ];
     bool active;
 
+    /* 最近一次启动的耗时和失败步骤数 */
+    uint32_t bringup_us;
+    int failed_steps;
+    /* 以太网设备（决定使用的程序变体） */
+    bool eth;
+
+    /* 程序原地替换的次数、最近一次的耗时和期间分类的包数 */
+    uint32_t swaps;
+    uint32_t swap_us;
+    uint64_t swap_packets;
+
     bool device;
     struct blob_attr *config_data;
     struct idclass_iface_config config;
@@ -91,63 +103,18 @@ static const char *interface_ifb_name(struct idclass_iface *iface) {
     return ifname;
 }
 
-/* 生成 qdisc 命令 */
-static int prepare_qdisc_cmd(char *buf, int len, const char *dev,
-                             bool add, const char *type) {
-    return snprintf(buf, len, "tc qdisc %s dev '%s' %s",
-                    add ? "add" : "del", dev, type);
-}
-
-/* 生成 filter 命令 */
-static int prepare_filter_cmd(char *buf, int len, const char *dev, int prio,
-                              bool add, bool egress) {
-    return snprintf(buf, len, "tc filter %s dev '%s' %sgress prio %d",
-                    add ? "add" : "del", dev, egress ? "e" : "in", prio);
-}
-
-/* 添加 BPF 过滤器（使用 tc 命令，不再依赖 libnl3） */
-static int cmd_add_bpf_filter(const char *ifname, int prio, bool egress, bool eth) {
-    int prog_fd = -1;
-    const char *suffix;
-    char cmd[512];
-    int ofs;
-
-    uint32_t flags = 0;
-    if (!egress) flags |= IDCLASS_INGRESS;
-    if (!eth) flags |= IDCLASS_IP_ONLY;
-    suffix = ebpf_loader_get_program(flags, &prog_fd);
-    if (!suffix || prog_fd < 0) {
-        ULOG_ERR("Failed to get eBPF program for iface %s (flags=0x%x), fd=%d\n",
-                 ifname, flags, prog_fd);
-        return -1;
-    }
-
-    /* 构造 tc filter 命令，使用已 pinned 的 BPF 程序路径 */
-    ofs = prepare_filter_cmd(cmd, sizeof(cmd), ifname, prio, true, egress);
-    APPEND(cmd, ofs, " protocol all bpf obj pinned %s_%s direct-action",
-           CLASSIFY_PIN_PATH, suffix);
-
-    return idclass_run_cmd(cmd, false);
-}
-
-/* 添加 qdisc 和 cake 整形器 */
-static int cmd_add_qdisc(struct idclass_iface *iface, const char *ifname,
-                         bool egress, bool eth) {
+/* 生成 cake 参数（tc 语法，rtnetlink 和 tc 回退共用） */
+static void prepare_cake_args(struct idclass_iface *iface, char *buf, int len,
+                              bool egress) {
     struct idclass_iface_config *cfg = &iface->config;
     const char *bw = egress ? cfg->bandwidth_up : cfg->bandwidth_down;
     const char *dir_opts = egress ? cfg->egress_opts : cfg->ingress_opts;
-    char buf[512];
-    int ofs;
-
-    /* 先添加 clsact qdisc（用于 ingress 和 egress 钩子） */
-    ofs = prepare_qdisc_cmd(buf, sizeof(buf), ifname, true, "clsact");
-    idclass_run_cmd(buf, true);
+    int ofs = 0;
 
-    /* 添加 root cake qdisc */
-    ofs = prepare_qdisc_cmd(buf, sizeof(buf), ifname, true, "root cake");
+    buf[0] = 0;
     if (bw)
-        APPEND(buf, ofs, " bandwidth %s", bw);
-    APPEND(buf, ofs, " %s %sgress", cfg->mode, egress ? "e" : "in");
+        APPEND(buf, ofs, "bandwidth %s ", bw);
+    APPEND(buf, ofs, "%s %sgress", cfg->mode, egress ? "e" : "in");
     if (!egress && cfg->autorate_ingress)
         APPEND(buf, ofs, " autorate-ingress");
     if (cfg->host_isolate)
@@ -156,107 +123,124 @@ static int cmd_add_qdisc(struct idclass_iface *iface, const char *ifname,
     else
         APPEND(buf, ofs, " flows");
     APPEND(buf, ofs, " %s %s", cfg->common_opts ?: "", dir_opts ?: "");
+}
+
+/*
+ * 添加 root cake 整形器（加入当前 rtnetlink 批次）。
+ * 返回 -1 表示参数中有无法转换的选项，需要在批次提交后用 tc 添加。
+ */
+static int cmd_add_cake(struct idclass_iface *iface, const char *ifname,
+                        int ifindex, bool egress) {
+    char args[512];
 
-    return idclass_run_cmd(buf, false);
+    prepare_cake_args(iface, args, sizeof(args), egress);
+    if (rtnl_add_cake(ifname, ifindex, args) == 0)
+        return 0;
+
+    ULOG_INFO("cake options for %s not handled natively, using tc\n", ifname);
+    return -1;
 }
 
-/* 添加 ingress 方向的所有配置（包括 IFB 重定向） */
-static int cmd_add_ingress(struct idclass_iface *iface, bool eth) {
-    const char *ifbdev = interface_ifb_name(iface);
-    char buf[256];
-    int prio = IDCLASS_PRIO_BASE;
-    int ofs;
+/* 回退：通过 tc 命令添加 root cake */
+static int cmd_add_cake_tc(struct idclass_iface *iface, const char *ifname, bool egress) {
+    char args[512];
+    char cmd[640];
 
-    /* 添加主 BPF 过滤器（ingress） */
-    if (cmd_add_bpf_filter(iface->ifname, prio++, false, eth) != 0) {
-        ULOG_ERR("Failed to add ingress BPF filter on %s\n", iface->ifname);
-        return -1;
-    }
+    prepare_cake_args(iface, args, sizeof(args), egress);
+    snprintf(cmd, sizeof(cmd), "tc qdisc add dev '%s' root cake %s", ifname, args);
+    return idclass_run_cmd(cmd, false);
+}
 
-    /* DNS 重定向到 ifb-dns（用于 DNS 解析模块） */
-    ofs = prepare_filter_cmd(buf, sizeof(buf), iface->ifname, prio++, true, false);
-    APPEND(buf, ofs, " protocol ip u32 match ip sport 53 0xffff "
-                     "flowid 1:1 action mirred egress redirect dev "
-                     IDCLASS_DNS_IFNAME);
-    idclass_run_cmd(buf, false);
-
-    ofs = prepare_filter_cmd(buf, sizeof(buf), iface->ifname, prio++, true, false);
-    APPEND(buf, ofs, " protocol 802.1Q u32 offset plus 4 match ip sport 53 0xffff "
-                     "flowid 1:1 action mirred egress redirect dev "
-                     IDCLASS_DNS_IFNAME);
-    idclass_run_cmd(buf, false);
-
-    ofs = prepare_filter_cmd(buf, sizeof(buf), iface->ifname, prio++, true, false);
-    APPEND(buf, ofs, " protocol ipv6 u32 match ip6 sport 53 0xffff "
-                     "flowid 1:1 action mirred egress redirect dev "
-                     IDCLASS_DNS_IFNAME);
-    idclass_run_cmd(buf, false);
-
-    ofs = prepare_filter_cmd(buf, sizeof(buf), iface->ifname, prio++, true, false);
-    APPEND(buf, ofs, " protocol ipv6 u32 offset plus 4 match ip6 sport 53 0xffff "
-                     "flowid 1:1 action mirred egress redirect dev "
-                     IDCLASS_DNS_IFNAME);
-    idclass_run_cmd(buf, false);
-
-    if (!iface->config.ingress)
-        return 0;
+/* 获取方向和链路类型对应的程序 fd 及过滤器名 */
+static int interface_get_prog(const char *ifname, bool egress, bool eth,
+                              int *prog_fd, char *name, size_t len) {
+    const char *suffix;
 
-    /* 创建 IFB 设备用于 ingress 重定向 */
-    snprintf(buf, sizeof(buf), "ip link add '%s' type ifb", ifbdev);
-    idclass_run_cmd(buf, false);
+    uint32_t flags = 0;
+    if (!egress) flags |= IDCLASS_INGRESS;
+    if (!eth) flags |= IDCLASS_IP_ONLY;
+    *prog_fd = -1;
+    suffix = ebpf_loader_get_program(flags, prog_fd);
+    if (!suffix || *prog_fd < 0) {
+        ULOG_ERR("Failed to get eBPF program for iface %s (flags=0x%x), fd=%d\n",
+                 ifname, flags, *prog_fd);
+        return -1;
+    }
 
-    cmd_add_qdisc(iface, ifbdev, false, eth);
+    snprintf(name, len, "idclass_%s", suffix);
+    return 0;
+}
 
-    snprintf(buf, sizeof(buf), "ip link set dev '%s' up", ifbdev);
-    idclass_run_cmd(buf, false);
+/* 添加 BPF 过滤器（按程序 fd 挂载，加入当前 rtnetlink 批次） */
+static int cmd_add_bpf_filter(const char *ifname, int ifindex, int prio,
+                              bool egress, bool eth) {
+    char name[64];
+    int prog_fd;
 
-    /* 将所有流量重定向到 IFB 设备 */
-    ofs = prepare_filter_cmd(buf, sizeof(buf), iface->ifname, prio++, true, false);
-    APPEND(buf, ofs, " protocol all u32 match u32 0 0 flowid 1:1"
-                     " action mirred egress redirect dev '%s'", ifbdev);
-    return idclass_run_cmd(buf, false);
+    if (interface_get_prog(ifname, egress, eth, &prog_fd, name, sizeof(name)))
+        return -1;
+    rtnl_add_bpf_filter(ifname, ifindex, egress, prio, prog_fd, name);
+    return 0;
 }
 
-/* 添加 egress 方向配置 */
-static int cmd_add_egress(struct idclass_iface *iface, bool eth) {
-    if (!iface->config.egress)
-        return 0;
+/* 程序 id（用于确认过滤器挂载的是哪个程序），失败返回 0 */
+static uint32_t interface_prog_id(int prog_fd) {
+    struct bpf_prog_info info = {};
+    uint32_t len = sizeof(info);
 
-    cmd_add_qdisc(iface, iface->ifname, true, eth);
-    return cmd_add_bpf_filter(iface->ifname, IDCLASS_PRIO_BASE, true, eth);
+    if (bpf_obj_get_info_by_fd(prog_fd, &info, &len))
+        return 0;
+    return info.id;
 }
 
-/* 清除接口上的所有 qdisc 和 filter */
-static void interface_clear_qdisc(struct idclass_iface *iface) {
-    char buf[64];
+/* 将清除接口上 qdisc/filter/IFB 的步骤加入当前批次（失败均忽略） */
+static void interface_clear_qdisc(struct idclass_iface *iface, int ifindex) {
     int i;
 
-    prepare_qdisc_cmd(buf, sizeof(buf), iface->ifname, false, "root");
-    idclass_run_cmd(buf, true);
-
-    for (i = 0; i < 6; i++) {
-        prepare_filter_cmd(buf, sizeof(buf), iface->ifname,
-                           IDCLASS_PRIO_BASE + i, false, false);
-        idclass_run_cmd(buf, true);
+    if (ifindex) {
+        rtnl_del_root_qdisc(iface->ifname, ifindex);
+        for (i = 0; i < 6; i++)
+            rtnl_del_filter(iface->ifname, ifindex, false, IDCLASS_PRIO_BASE + i);
+        rtnl_del_filter(iface->ifname, ifindex, true, IDCLASS_PRIO_BASE);
     }
+    rtnl_del_link(interface_ifb_name(iface));
+}
+
+/* Helper: monotonic time in microseconds (bring-up timing) */
+static uint64_t interface_now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
 
-    prepare_filter_cmd(buf, sizeof(buf), iface->ifname,
-                       IDCLASS_PRIO_BASE, false, true);
-    idclass_run_cmd(buf, true);
+/* 提交当前批次，累计失败的步骤数 */
+static void interface_commit(int *failed) {
+    int ret = rtnl_batch_commit();
 
-    snprintf(buf, sizeof(buf), "ip link del '%s'", interface_ifb_name(iface));
-    idclass_run_cmd(buf, true);
+    *failed += ret < 0 ? 1 : ret;
 }
 
-/* 启动接口上的 QoS */
+/*
+ * 启动接口上的 QoS。
+ * 所有 tc/ip 操作通过 rtnetlink 分两批发送：第一批清除旧配置、添加
+ * clsact、egress cake、两个方向的 BPF 过滤器并创建 IFB；第二批需要
+ * IFB 的 ifindex，添加 IFB 上的 cake 和 mirred 重定向。
+ */
 static void interface_start(struct idclass_iface *iface) {
+    struct idclass_iface_config *cfg = &iface->config;
+    const char *ifbdev = interface_ifb_name(iface);
+    bool cake_tc_egress = false, cake_tc_ingress = false;
     struct ifreq ifr = {};
+    int ifindex, ifb_index;
+    uint64_t start;
+    int failed = 0;
     bool eth;
 
     if (!iface->ifname[0] || iface->active)
         return;
 
     ULOG_INFO("start interface %s\n", iface->ifname);
+    start = interface_now_us();
 
     strncpy(ifr.ifr_name, iface->ifname, sizeof(ifr.ifr_name));
     if (ioctl(socket_fd, SIOCGIFHWADDR, &ifr) < 0) {
@@ -266,10 +250,50 @@ static void interface_start(struct idclass_iface *iface) {
     }
 
     eth = (ifr.ifr_hwaddr.sa_family == ARPHRD_ETHER);
+    iface->eth = eth;
+    ifindex = if_nametoindex(iface->ifname);
+    if (!ifindex) {
+        ULOG_ERR("Interface %s disappeared\n", iface->ifname);
+        return;
+    }
 
-    interface_clear_qdisc(iface);
-    cmd_add_egress(iface, eth);
-    cmd_add_ingress(iface, eth);
+    rtnl_batch_begin();
+    interface_clear_qdisc(iface, ifindex);
+    rtnl_add_clsact(iface->ifname, ifindex);
+    if (cfg->egress) {
+        cake_tc_egress = cmd_add_cake(iface, iface->ifname, ifindex, true) < 0;
+        if (cmd_add_bpf_filter(iface->ifname, ifindex, IDCLASS_PRIO_BASE, true, eth))
+            failed++;
+    }
+    if (cmd_add_bpf_filter(iface->ifname, ifindex, IDCLASS_PRIO_BASE, false, eth))
+        failed++;
+    if (cfg->ingress)
+        rtnl_add_ifb(ifbdev);
+    interface_commit(&failed);
+
+    if (cfg->ingress) {
+        ifb_index = if_nametoindex(ifbdev);
+        if (!ifb_index) {
+            ULOG_ERR("IFB device %s not found, ingress shaping disabled\n", ifbdev);
+            failed++;
+        } else {
+            rtnl_batch_begin();
+            cake_tc_ingress = cmd_add_cake(iface, ifbdev, ifb_index, false) < 0;
+            /* 将所有流量重定向到 IFB 设备 */
+            rtnl_add_redirect(iface->ifname, ifindex, IDCLASS_PRIO_BASE + 1, ifb_index);
+            interface_commit(&failed);
+        }
+    }
+
+    if (cake_tc_egress && cmd_add_cake_tc(iface, iface->ifname, true))
+        failed++;
+    if (cake_tc_ingress && cmd_add_cake_tc(iface, ifbdev, false))
+        failed++;
+
+    iface->bringup_us = interface_now_us() - start;
+    iface->failed_steps = failed;
+    ULOG_INFO("interface %s started in %u us, %d failed steps\n",
+              iface->ifname, iface->bringup_us, failed);
 
     iface->active = true;
 }
@@ -281,7 +305,76 @@ static void interface_stop(struct idclass_iface *iface) {
 
     ULOG_INFO("stop interface %s\n", iface->ifname);
     iface->active = false;
-    interface_clear_qdisc(iface);
+    rtnl_batch_begin();
+    interface_clear_qdisc(iface, if_nametoindex(iface->ifname));
+    rtnl_batch_commit();
+}
+
+/*
+ * 将接口上的分类程序原地替换为新加载的程序。
+ * 过滤器按 handle 替换，qdisc、IFB 重定向和 map 都保持不变；同一批次中
+ * 随后读回过滤器，挂载的程序 id 与新程序一致即说明过滤器从未被删除，
+ * 切换期间每个包都经过了旧程序或新程序。返回 0 表示替换成功。
+ */
+static int interface_swap_programs(struct idclass_iface *iface) {
+    struct idclass_iface_config *cfg = &iface->config;
+    uint32_t expect[2] = {}, attached[2] = {};
+    uint64_t start, packets;
+    char name[64];
+    int ifindex, prog_fd, failed = 0;
+    int i;
+
+    ifindex = if_nametoindex(iface->ifname);
+    if (!ifindex)
+        return -1;
+
+    start = interface_now_us();
+    packets = map_manager_read_counter(IDCLASS_CNT_PACKETS, false);
+
+    /* 0: ingress, 1: egress */
+    rtnl_batch_begin();
+    for (i = 0; i < 2; i++) {
+        if (i && !cfg->egress)
+            continue;
+        if (interface_get_prog(iface->ifname, i, iface->eth, &prog_fd, name, sizeof(name)))
+            return -1;
+        expect[i] = interface_prog_id(prog_fd);
+        rtnl_replace_bpf_filter(iface->ifname, ifindex, i, IDCLASS_PRIO_BASE, prog_fd, name);
+        rtnl_get_bpf_filter(iface->ifname, ifindex, i, IDCLASS_PRIO_BASE, &attached[i]);
+    }
+    interface_commit(&failed);
+
+    for (i = 0; i < 2; i++) {
+        if (i && !cfg->egress)
+            continue;
+        if (!expect[i] || attached[i] != expect[i]) {
+            ULOG_ERR("%sgress filter on %s runs program %u, expected %u\n",
+                     i ? "e" : "in", iface->ifname, attached[i], expect[i]);
+            failed++;
+        }
+    }
+    if (failed)
+        return -1;
+
+    iface->swaps++;
+    iface->swap_us = interface_now_us() - start;
+    iface->swap_packets = map_manager_read_counter(IDCLASS_CNT_PACKETS, false) - packets;
+    ULOG_INFO("programs on %s swapped in %u us, %llu packets classified meanwhile\n",
+              iface->ifname, iface->swap_us, (unsigned long long)iface->swap_packets);
+    return 0;
+}
+
+/* 程序重新加载后更新接口，原地替换失败时才重建 qdisc */
+static void interface_reload_iface(struct idclass_iface *iface) {
+    if (!iface->active)
+        return;
+    if (!interface_swap_programs(iface))
+        return;
+
+    ULOG_WARN("in-place program swap failed on %s, restarting interface\n",
+              iface->ifname);
+    interface_stop(iface);
+    interface_start(iface);
 }
 
 /* 解析接口配置 */
@@ -523,6 +616,15 @@ void interface_status(struct blob_buf *b) {
             blobmsg_add_string(b, "ifname", iface->ifname);
         blobmsg_add_u8(b, "egress", iface->config.egress);
         blobmsg_add_u8(b, "ingress", iface->config.ingress);
+        if (iface->active) {
+            blobmsg_add_u32(b, "bringup_us", iface->bringup_us);
+            blobmsg_add_u32(b, "failed_steps", iface->failed_steps);
+            blobmsg_add_u32(b, "program_swaps", iface->swaps);
+            if (iface->swaps) {
+                blobmsg_add_u32(b, "swap_us", iface->swap_us);
+                blobmsg_add_u64(b, "swap_packets", iface->swap_packets);
+            }
+        }
         blobmsg_close_table(b, d);
     }
     blobmsg_close_table(b, c);
@@ -535,11 +637,33 @@ void interface_status(struct blob_buf *b) {
             blobmsg_add_string(b, "ifname", iface->ifname);
         blobmsg_add_u8(b, "egress", iface->config.egress);
         blobmsg_add_u8(b, "ingress", iface->config.ingress);
+        if (iface->active) {
+            blobmsg_add_u32(b, "bringup_us", iface->bringup_us);
+            blobmsg_add_u32(b, "failed_steps", iface->failed_steps);
+            blobmsg_add_u32(b, "program_swaps", iface->swaps);
+            if (iface->swaps) {
+                blobmsg_add_u32(b, "swap_us", iface->swap_us);
+                blobmsg_add_u64(b, "swap_packets", iface->swap_packets);
+            }
+        }
         blobmsg_close_table(b, d);
     }
     blobmsg_close_table(b, c);
 }
 
+/*
+ * 外部接口：分类程序重新加载后把新程序换入接口上的过滤器。
+ * 已挂载的 tc 过滤器持有旧程序的引用，重新 pin 不会影响它们。
+ */
+void interface_reload_programs(void) {
+    struct idclass_iface *iface;
+
+    vlist_for_each_element(&interfaces, iface, node)
+        interface_reload_iface(iface);
+    vlist_for_each_element(&devices, iface, node)
+        interface_reload_iface(iface);
+}
+
 /* 外部接口：初始化接口模块 */
 int interface_init(void) {
     socket_fd = socket(AF_UNIX, SOCK_DGRAM, 0);
@@ -547,6 +671,10 @@ int interface_init(void) {
         ULOG_ERR("Failed to create AF_UNIX socket: %s\n", strerror(errno));
         return -1;
     }
+    if (rtnl_batch_init()) {
+        close(socket_fd);
+        return -1;
+    }
     return 0;
 }
 
@@ -559,5 +687,6 @@ void interface_stop(void) {
     vlist_for_each_element(&devices, iface, node)
         interface_stop(iface);
 
+    rtnl_batch_stop();
     close(socket_fd);
 }
\ No newline at end of file
@@ -8,6 +8,7 @@
  */
 #include "common.h"
 #include <ctype.h>
+#include <time.h>
 #include <sys/wait.h>
 
 /* Forward declarations for module interfaces (already in common.h) */
@@ -120,12 +121,21 @@ int idclass_map_dscp_value(const char *val, uint8_t *dscp_val) {
     return 0;
 }
 
+/* Helper: monotonic time in microseconds (startup timing) */
+static uint64_t idclass_now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
 static int usage(const char *progname) {
     fprintf(stderr, "Usage: %s [options]\n"
             "Options:\n"
             "	-l <file>	Load defaults from <file>\n"
             "	-o		only load program/maps without running as daemon\n"
             "	-c <name>	UCI config name (default: qos_gargoyle)\n"
+            "	-b <count>	benchmark the classifier with <count> packets per CPU and exit\n"
+            "	-d		benchmark domain rule lookups and exit\n"
             "\n", progname);
     return 1;
 }
@@ -134,9 +144,14 @@ int main(int argc, char **argv) {
     const char *load_file = NULL;
     const char *config_name = "qos_gargoyle";
     bool oneshot = false;
+    bool benchmark = false;
+    bool benchmark_dns = false;
+    unsigned int bench_iterations = 0;
+    uint64_t start_us, loaded_us, maps_us;
+    uint32_t startup_us;
     int ch;
 
-    while ((ch = getopt(argc, argv, "fl:oc:")) != -1) {
+    while ((ch = getopt(argc, argv, "fl:oc:b:d")) != -1) {
         switch (ch) {
         case 'f':
             break;
@@ -149,6 +164,13 @@ int main(int argc, char **argv) {
         case 'c':
             config_name = optarg;
             break;
+        case 'b':
+            benchmark = true;
+            bench_iterations = strtoul(optarg, NULL, 0);
+            break;
+        case 'd':
+            benchmark_dns = true;
+            break;
         default:
             return usage(argv[0]);
         }
@@ -157,11 +179,23 @@ int main(int argc, char **argv) {
     /* Set UCI config name before loading any config */
     config_set_name(config_name);
 
+    /* Benchmark mode uses private copies of the maps and exits */
+    if (benchmark)
+        return benchmark_run(bench_iterations) ? 2 : 0;
+    if (benchmark_dns)
+        return benchmark_dns_run() ? 2 : 0;
+
+    /* Modules register uloop fds and timers during init */
+    uloop_init();
+
+    start_us = idclass_now_us();
+
     /* Load eBPF programs */
     if (ebpf_loader_init()) {
         fprintf(stderr, "Failed to initialize eBPF loader\n");
         return 2;
     }
+    loaded_us = idclass_now_us();
 
     /* Initialize BPF map manager (opens maps, but does not load config) */
     if (map_manager_init()) {
@@ -169,6 +203,8 @@ int main(int argc, char **argv) {
         return 2;
     }
 
+    maps_us = idclass_now_us();
+
     /* Load UCI configuration (may also load class marks, etc.) */
     if (config_init()) {
         fprintf(stderr, "Failed to initialize config module\n");
@@ -187,7 +223,7 @@ int main(int argc, char **argv) {
         return 2;
     }
 
-    /* Initialize DNS parser (requires ifb-dns) */
+    /* Initialize DNS parser (consumes DNS responses from the classifier) */
     if (dns_parser_init()) {
         fprintf(stderr, "Failed to initialize DNS parser\n");
         return 2;
@@ -199,21 +235,36 @@ int main(int argc, char **argv) {
         return 2;
     }
 
+    startup_us = idclass_now_us() - start_us;
+
     /* If oneshot, just exit after setup */
-    if (oneshot)
+    if (oneshot) {
+        printf("startup: %u us (bpf load %u us, map setup %u us)\n", startup_us,
+               (uint32_t)(loaded_us - start_us), (uint32_t)(maps_us - loaded_us));
+        /* Nobody consumes DNS responses after exit */
+        dns_parser_stop();
         return 0;
+    }
 
     /* Daemon mode: start main loop */
     ulog_open(ULOG_SYSLOG, LOG_DAEMON, "idclass");
-    uloop_init();
+    ULOG_INFO("startup: %u us (bpf load %u us, map setup %u us)\n", startup_us,
+              (uint32_t)(loaded_us - start_us), (uint32_t)(maps_us - loaded_us));
+
+    /* Datapath event stream (ring buffer -> ubus notifications) */
+    if (event_stream_init())
+        ULOG_WARN("Datapath events disabled\n");
 
     /* Run the main event loop */
     uloop_run();
 
     /* Cleanup */
+    event_stream_stop();
     ubus_server_stop();
     interface_stop();
     dns_parser_stop();
+    map_manager_stop();
+    nft_batch_stop();
     uloop_done();
 
     return 0;
@@ -8,7 +8,6 @@
  */
 #include "common.h"
 #include <arpa/inet.h>
-#include <fnmatch.h>
 #include <glob.h>
 #include <sys/stat.h>
 #include <fcntl.h>
@@ -17,7 +16,10 @@
 #include <libubox/uloop.h>
 #include <libubox/list.h>
 #include <ctype.h>
+#include <stddef.h>
 #include <sys/wait.h>
+#include <sys/syscall.h>
+#include <linux/membarrier.h>
 
 #define PERSISTENT_CLASS_MARKS "/etc/qos_gargoyle/class_marks"
 
@@ -25,6 +27,8 @@
 struct idclass_map_entry {
     struct avl_node avl;
     uint32_t timeout;
+    uint32_t heap_pos;      /* 在过期堆中的位置（从 1 开始），0 表示不在堆中 */
+    uint32_t file_gen;      /* 最近一次在规则文件中出现时的 map_file_gen */
     struct idclass_map_data data;
 };
 
@@ -35,11 +39,19 @@ struct idclass_class_entry {
 
 struct idclass_map_file {
     struct list_head list;
+    dev_t dev;              /* 上次解析时的文件标识，用于判断内容是否可能变化 */
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
     char filename[];
 };
 
 /* 比较函数声明（必须在 AVL_TREE 宏之前） */
 static int idclass_map_entry_cmp(const void *k1, const void *k2, void *ptr);
+static void idclass_map_free_entry(struct idclass_map_entry *e);
+static int idclass_flow_stats_lookup(const struct flow_key *key, struct flow_stats *stats);
+static void idclass_flow_totals(const struct flow_key *key, const struct flow_stats *stats,
+                                uint64_t *packets, uint64_t *bytes);
 
 /* Global configuration instances */
 struct global_config global_config;
@@ -47,18 +59,101 @@ struct idclass_flow_config global_flow_config;
 int idclass_map_timeout = 3600;
 int idclass_active_timeout = 300;
 
+/* 空闲流清理与连接数校准的周期（秒） */
+#define IDCLASS_SWEEP_INTERVAL      5
+#define IDCLASS_RECONCILE_INTERVAL  60
+
+/* DNS 学习到的地址至少保留的时间（秒） */
+#define IDCLASS_DNS_MIN_TTL         30
+
 /* Internal static data */
 static int idclass_map_fds[__CL_MAP_MAX];
 static AVL_TREE(map_data, idclass_map_entry_cmp, false, NULL);
 static LIST_HEAD(map_files);
 static struct idclass_class_entry *map_class[IDCLASS_MAX_CLASS_ENTRIES];
-static uint32_t next_timeout;
 static uint8_t idclass_dscp_default[2] = { 0xff, 0xff };
 static uint32_t map_dns_seq;
+/* DNS 规则每次增删改都加一，dns_parser 的 CNAME 缓存据此失效 */
+static uint32_t dns_rules_gen;
+/* 用户态专用 DNS 规则（正则/通配/仅 CNAME）的最小 seq，没有时为 ~0 */
+static uint32_t dns_user_min_seq = ~0U;
+static uint32_t map_file_gen;
 static struct uloop_timeout idclass_map_timer;
+
+/*
+ * 重新加载配置时只写入真正变化的部分：已写入内核的全局配置、端口默认值，
+ * 以及与上次解析结果相同的规则文件都会被跳过
+ */
+static struct global_config config_applied;
+static bool config_applied_valid;
+static bool classes_applied;
+static uint8_t idclass_dscp_applied[2] = { 0xff, 0xff };
+
+/*
+ * 流特征配置的两代（见 IDCLASS_FLOW_CONFIG_SLOTS）：flow_config_gen 是数据路径
+ * 正在使用的一代，flow_config_flip_us 是上次翻转的时间，另一代在此之后的一个
+ * RCU 宽限期内可能仍有包在读
+ */
+#define IDCLASS_FLOW_CONFIG_GRACE_US    10000
+
+static struct idclass_flow_config flow_config_applied;
+static bool flow_config_valid;
+static uint8_t flow_config_gen;
+static uint64_t flow_config_flip_us;
+
+static struct {
+    uint64_t config_writes;
+    uint64_t config_skipped;
+    uint64_t flow_config_writes;
+    uint64_t flow_config_skipped;
+    uint64_t class_writes;
+    uint64_t class_skipped;
+    uint64_t file_reloads;
+    uint64_t file_skipped;
+    uint64_t file_dropped;
+} apply_stats;
+
+/* 重启后的恢复情况，以及分类多久恢复到重启前的水平 */
+static struct {
+    bool warm;                  /* 复用了上次运行固定的 map */
+    uint32_t restored;          /* 从快照恢复的 map_data 条目 */
+    uint32_t orphans;           /* 固定 map 中没有用户态条目而被删除的地址 */
+    uint32_t restore_us;
+    uint32_t flows_kept;
+    uint32_t target_pct;        /* 重启前达到采样包数的流所占百分比 */
+    uint32_t ready_pct;
+    uint32_t ready_ms;          /* 从 map_manager_init 起，0 表示尚未恢复 */
+    uint32_t checks;
+    uint64_t start_us;
+} restart_stats;
+
+/*
+ * 有限期的用户条目按 timeout 放在最小堆里，GC 只处理堆顶已到期的条目，
+ * 不再遍历整个 map_data
+ */
+static struct idclass_map_entry **expire_heap;
+static uint32_t expire_n, expire_alloc;
+static struct {
+    uint64_t expired;
+    uint64_t refreshed;
+    uint32_t last_us;
+    uint32_t max_us;
+} expire_stats;
 static int ip_conn_fd = -1;
 static int flow_stats_fd = -1;
+static int flow_info_fd = -1;
+static int client_rtt_fd = -1;
+static int wan_loss_fd = -1;
+static bool flow_stats_percpu;
+static int flow_stats_ncpus = 1;
+static void *flow_stats_buf;
+static int classify_counters_fd = -1;
 static struct uloop_timeout ip_conn_timer;
+static struct uloop_timeout flow_sweep_timer;
+static uint64_t flows_expired;
+static uint64_t ip_conn_corrected;
+static uint32_t prefix_entries[2];
+static struct dns_matcher *dns_rules;
 
 /* Helper: compare two map data entries for AVL tree */
 static int idclass_map_entry_cmp(const void *k1, const void *k2, void *ptr) {
@@ -89,13 +184,16 @@ static const char *idclass_map_path(enum idclass_map_id id) {
         [CL_MAP_UDP_PORTS] = "udp_ports",
         [CL_MAP_IPV4_ADDR] = "ipv4_map",
         [CL_MAP_IPV6_ADDR] = "ipv6_map",
+        [CL_MAP_IPV4_PREFIX] = "ipv4_prefix_map",
+        [CL_MAP_IPV6_PREFIX] = "ipv6_prefix_map",
         [CL_MAP_CLASS] = "class_map",
         [CL_MAP_GLOBAL_CONFIG] = "global_config",
-        [CL_MAP_DNS] = "dns",
         [CL_MAP_PRIO_CLASS_UP] = "prio_class_up",
         [CL_MAP_PRIO_CLASS_DOWN] = "prio_class_down",
         [CL_MAP_CLASS_MARK] = "class_mark",
         [CL_MAP_IP_CONN] = "ip_conn_map",
+        [CL_MAP_DNS_NAMES] = "dns_names",
+        [CL_MAP_FLOW_CONFIG] = "flow_config_map",
     };
     if (id >= __CL_MAP_MAX)
         return NULL;
@@ -106,6 +204,28 @@ static const char *idclass_map_path(enum idclass_map_id id) {
     return path;
 }
 
+/* 打开 map 时记录的类型，批量访问据此判断，不必每次查询内核 */
+#define IDCLASS_MAP_TYPES_MAX   32
+static struct {
+    int fd;
+    int type;
+} map_types[IDCLASS_MAP_TYPES_MAX];
+static int map_types_n;
+
+/* Helper: remember the map type of a newly opened map fd */
+static void idclass_map_note_type(int fd) {
+    struct bpf_map_info info = {};
+    uint32_t len = sizeof(info);
+
+    if (fd < 0 || map_types_n == IDCLASS_MAP_TYPES_MAX)
+        return;
+    if (bpf_obj_get_info_by_fd(fd, &info, &len))
+        return;
+    map_types[map_types_n].fd = fd;
+    map_types[map_types_n].type = info.type < 64 ? (int)info.type : -1;
+    map_types_n++;
+}
+
 /* Helper: get file descriptor for a map (opens if not already open) */
 static int map_manager_get_fd_internal(enum idclass_map_id id) {
     if (idclass_map_fds[id] >= 0)
@@ -119,6 +239,7 @@ static int map_manager_get_fd_internal(enum idclass_map_id id) {
         return -1;
     }
     idclass_map_fds[id] = fd;
+    idclass_map_note_type(fd);
     return fd;
 }
 
@@ -127,12 +248,312 @@ int map_manager_get_fd(enum idclass_map_id id) {
     return map_manager_get_fd_internal(id);
 }
 
-/* Helper: clear all entries in a map (for IPv4/IPv6 maps) */
+/*
+ * Batched map access. Bulk walks and updates go through the
+ * BPF_MAP_*_BATCH commands (one syscall per IDCLASS_BATCH_SIZE entries);
+ * kernels without batch support for a map type fall back to one syscall
+ * per entry. Every bulk operation is timed for get_stats.
+ */
+#define IDCLASS_BATCH_SIZE  1024
+
+enum idclass_bulk_op {
+    BULK_CLEAR_LIST,
+    BULK_IP_MAPPINGS,
+    BULK_CLASS_CONFIG,
+    BULK_IP_CONN,
+    __BULK_MAX
+};
+
+static struct idclass_bulk_stats {
+    const char *name;
+    uint32_t calls;
+    uint32_t last_us;
+    uint32_t max_us;
+    uint64_t total_us;
+    uint64_t entries;
+} bulk_stats[__BULK_MAX] = {
+    [BULK_CLEAR_LIST] = { .name = "clear_list" },
+    [BULK_IP_MAPPINGS] = { .name = "ip_mappings" },
+    [BULK_CLASS_CONFIG] = { .name = "class_config" },
+    [BULK_IP_CONN] = { .name = "ip_conn" },
+};
+
+/* 不支持批量命令的 map 类型，按 enum bpf_map_type 置位 */
+static uint64_t batch_unsupported;
+
+/* Helper: monotonic time in microseconds */
+static uint64_t idclass_gettime_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+/* Helper: account one bulk operation that started at start_us */
+static void idclass_bulk_done(enum idclass_bulk_op op, uint64_t start_us,
+                              uint64_t entries) {
+    struct idclass_bulk_stats *st = &bulk_stats[op];
+    uint32_t us = idclass_gettime_us() - start_us;
+
+    st->calls++;
+    st->last_us = us;
+    st->total_us += us;
+    st->entries += entries;
+    if (us > st->max_us)
+        st->max_us = us;
+}
+
+/* Helper: does this error mean the batch command is not available? */
+static bool idclass_batch_enosys(int err) {
+    err = abs(err);
+    return err == ENOTSUP || err == EOPNOTSUPP ||
+           err == ENOSYS || err == 524 /* ENOTSUPP */;
+}
+
+/* Helper: map type of fd recorded at open, -1 if unknown */
+static int idclass_map_type(int fd) {
+    int i;
+
+    for (i = 0; i < map_types_n; i++)
+        if (map_types[i].fd == fd)
+            return map_types[i].type;
+    return -1;
+}
+
+/* Helper: can batch commands be used on this map? (LPM tries have none) */
+static bool idclass_map_batch_ok(int fd) {
+    int type;
+
+    if (fd == idclass_map_fds[CL_MAP_IPV4_PREFIX] ||
+        fd == idclass_map_fds[CL_MAP_IPV6_PREFIX])
+        return false;
+
+    type = idclass_map_type(fd);
+    return type >= 0 && !(batch_unsupported & (1ULL << type));
+}
+
+/* Helper: stop using batch commands on maps of this type */
+static void idclass_map_batch_disable(int fd) {
+    int type = idclass_map_type(fd);
+
+    if (type >= 0)
+        batch_unsupported |= 1ULL << type;
+}
+
+typedef void (*idclass_batch_cb)(void *keys, void *vals, uint32_t n, void *ctx);
+
+/*
+ * Helper: walk a whole map, handing entries to cb in chunks. Values for
+ * per-CPU maps must be sized by the caller (ncpus * round_up(size, 8)).
+ * Returns the number of entries visited.
+ */
+static uint64_t idclass_map_walk(int fd, size_t key_size, size_t val_size,
+                                 idclass_batch_cb cb, void *ctx) {
+    size_t token_size = key_size > 8 ? key_size : 8;
+    void *keys, *vals, *token, *next_token;
+    uint64_t total = 0;
+    uint32_t n = 0;
+    bool first = true;
+    int err;
+
+    keys = malloc(IDCLASS_BATCH_SIZE * key_size);
+    vals = malloc(IDCLASS_BATCH_SIZE * val_size);
+    token = calloc(2, token_size);
+    if (!keys || !vals || !token)
+        goto out;
+    next_token = token + token_size;
+
+    while (idclass_map_batch_ok(fd)) {
+        DECLARE_LIBBPF_OPTS(bpf_map_batch_opts, opts);
+
+        n = IDCLASS_BATCH_SIZE;
+        err = bpf_map_lookup_batch(fd, first ? NULL : token, next_token,
+                                   keys, vals, &n, &opts);
+        if (err && errno != ENOENT) {
+            if (first && idclass_batch_enosys(errno)) {
+                idclass_map_batch_disable(fd);
+                break;
+            }
+            goto out;
+        }
+        if (n) {
+            cb(keys, vals, n, ctx);
+            total += n;
+        }
+        if (err)    /* ENOENT: 已到末尾 */
+            goto out;
+        memcpy(token, next_token, token_size);
+        first = false;
+    }
+
+    /* 回退：逐个 get_next_key + lookup */
+    n = 0;
+    err = bpf_map_get_next_key(fd, NULL, keys);
+    while (!err) {
+        void *key = keys + n * key_size;
+
+        if (bpf_map_lookup_elem(fd, key, vals + n * val_size) == 0)
+            n++;
+        if (n == IDCLASS_BATCH_SIZE) {
+            /* 回调可能修改 key 缓冲区，先保存游标 */
+            memcpy(token, keys + (n - 1) * key_size, key_size);
+            cb(keys, vals, n, ctx);
+            total += n;
+            n = 0;
+            err = bpf_map_get_next_key(fd, token, keys);
+            continue;
+        }
+        err = bpf_map_get_next_key(fd, key, keys + n * key_size);
+    }
+    if (n) {
+        cb(keys, vals, n, ctx);
+        total += n;
+    }
+
+out:
+    free(keys);
+    free(vals);
+    free(token);
+    return total;
+}
+
+/* Helper: update n entries in one batch (per-entry fallback) */
+static int idclass_map_update_many(int fd, void *keys, size_t key_size,
+                                   void *vals, size_t val_size, uint32_t n,
+                                   uint64_t flags) {
+    DECLARE_LIBBPF_OPTS(bpf_map_batch_opts, opts, .elem_flags = flags);
+    uint32_t i = 0, count = n;
+    int ret = 0;
+
+    if (!n)
+        return 0;
+    if (idclass_map_batch_ok(fd)) {
+        if (bpf_map_update_batch(fd, keys, vals, &count, &opts) == 0)
+            return 0;
+        /* 前 count 个已写入，从出错的条目开始逐个重试 */
+        if (idclass_batch_enosys(errno))
+            idclass_map_batch_disable(fd);
+        else if (count < n)
+            i = count;
+    }
+
+    for (; i < n; i++)
+        if (bpf_map_update_elem(fd, keys + i * key_size, vals + i * val_size, flags))
+            ret = -1;
+    return ret;
+}
+
+/* Helper: delete n entries in one batch (per-entry fallback) */
+static int idclass_map_delete_many(int fd, void *keys, size_t key_size, uint32_t n) {
+    DECLARE_LIBBPF_OPTS(bpf_map_batch_opts, opts);
+    uint32_t i = 0, count = n;
+    int ret = 0;
+
+    if (!n)
+        return 0;
+    if (idclass_map_batch_ok(fd)) {
+        if (bpf_map_delete_batch(fd, keys, &count, &opts) == 0)
+            return 0;
+        /* 前 count 个已删除，从出错的条目开始逐个重试 */
+        if (idclass_batch_enosys(errno))
+            idclass_map_batch_disable(fd);
+        else if (count < n)
+            i = count;
+    }
+
+    for (; i < n; i++)
+        if (bpf_map_delete_elem(fd, keys + i * key_size))
+            ret = -1;
+    return ret;
+}
+
+/* 收集全部 key 的动态数组 */
+struct idclass_key_list {
+    void *keys;
+    size_t key_size;
+    uint32_t n, alloc;
+};
+
+static void idclass_key_list_add(struct idclass_key_list *l, const void *key) {
+    if (l->n == l->alloc) {
+        uint32_t alloc = l->alloc ? l->alloc * 2 : IDCLASS_BATCH_SIZE;
+        void *p = realloc(l->keys, alloc * l->key_size);
+        if (!p)
+            return;
+        l->keys = p;
+        l->alloc = alloc;
+    }
+    memcpy(l->keys + l->n++ * l->key_size, key, l->key_size);
+}
+
+static void idclass_collect_keys_cb(void *keys, void *vals, uint32_t n, void *ctx) {
+    struct idclass_key_list *l = ctx;
+    uint32_t i;
+
+    for (i = 0; i < n; i++)
+        idclass_key_list_add(l, keys + i * l->key_size);
+}
+
+/* Helper: delete a list of keys in batches */
+static void idclass_key_list_delete(int fd, struct idclass_key_list *l) {
+    uint32_t i;
+
+    for (i = 0; i < l->n; i += IDCLASS_BATCH_SIZE) {
+        uint32_t n = l->n - i < IDCLASS_BATCH_SIZE ? l->n - i : IDCLASS_BATCH_SIZE;
+        idclass_map_delete_many(fd, l->keys + i * l->key_size, l->key_size, n);
+    }
+}
+
+/* Helper: emit bulk operation timings */
+static void idclass_bulk_stats_dump(struct blob_buf *b) {
+    void *c, *t;
+    int i;
+
+    c = blobmsg_open_table(b, "bulk");
+    blobmsg_add_u8(b, "batch", !batch_unsupported);
+    blobmsg_add_u64(b, "batch_unsupported_types", batch_unsupported);
+    for (i = 0; i < __BULK_MAX; i++) {
+        struct idclass_bulk_stats *st = &bulk_stats[i];
+
+        t = blobmsg_open_table(b, st->name);
+        blobmsg_add_u32(b, "calls", st->calls);
+        blobmsg_add_u64(b, "entries", st->entries);
+        blobmsg_add_u32(b, "last_us", st->last_us);
+        blobmsg_add_u32(b, "max_us", st->max_us);
+        blobmsg_add_u64(b, "total_us", st->total_us);
+        blobmsg_close_table(b, t);
+    }
+    blobmsg_close_table(b, c);
+}
+
+/* Helper: key size of an address map */
+static size_t idclass_map_key_size(enum idclass_map_id id) {
+    switch (id) {
+    case CL_MAP_IPV6_ADDR:
+        return sizeof(struct in6_addr);
+    case CL_MAP_IPV4_PREFIX:
+        return sizeof(struct idclass_lpm4_key);
+    case CL_MAP_IPV6_PREFIX:
+        return sizeof(struct idclass_lpm6_key);
+    case CL_MAP_DNS_NAMES:
+        return sizeof(struct idclass_dns_key);
+    default:
+        return sizeof(struct in_addr);
+    }
+}
+
+/* Helper: clear all entries in a map (address maps and dns_names) */
 static void idclass_map_clear_list(enum idclass_map_id id) {
     int fd = idclass_map_fds[id];
-    __u32 key[4] = {0};
-    while (bpf_map_get_next_key(fd, &key, &key) == 0)
-        bpf_map_delete_elem(fd, &key);
+    size_t key_size = idclass_map_key_size(id);
+    size_t val_size = (id == CL_MAP_DNS_NAMES) ? sizeof(struct idclass_dns_val) :
+                                                 sizeof(struct idclass_ip_map_val);
+    struct idclass_key_list l = { .key_size = key_size };
+    uint64_t start = idclass_gettime_us();
+
+    idclass_map_walk(fd, key_size, val_size, idclass_collect_keys_cb, &l);
+    idclass_key_list_delete(fd, &l);
+    free(l.keys);
+    idclass_bulk_done(BULK_CLEAR_LIST, start, l.n);
 }
 
 /* Helper: set default DSCP for a port map */
@@ -154,7 +575,7 @@ static void __idclass_map_set_dscp_default(enum idclass_map_id id, uint8_t val)
         else
             return;
         fd = map_manager_get_fd_internal(CL_MAP_CLASS);
-        memcpy(&class.config, &global_flow_config, sizeof(class.config));
+        class.config = IDCLASS_FLOW_CONFIG_DEFAULT;
         bpf_map_update_elem(fd, &key, &class, BPF_ANY);
         val = key | IDCLASS_DSCP_CLASS_FLAG;
     }
@@ -168,7 +589,11 @@ static void __idclass_map_set_dscp_default(enum idclass_map_id id, uint8_t val)
     }
 }
 
-/* External: set default DSCP for TCP/UDP port maps */
+/*
+ * External: set default DSCP for TCP/UDP port maps. A new value only takes
+ * effect with the next map_manager_update_config(), so a reset followed by
+ * the same value rewrites nothing; 0xff reapplies the current default now.
+ */
 void map_manager_set_dscp_default(enum idclass_map_id id, uint8_t val) {
     bool udp;
 
@@ -180,13 +605,313 @@ void map_manager_set_dscp_default(enum idclass_map_id id, uint8_t val) {
         return;
 
     if (val != 0xff) {
-        if (idclass_dscp_default[udp] == val)
-            return;
         idclass_dscp_default[udp] = val;
+        return;
     }
+    idclass_dscp_applied[udp] = idclass_dscp_default[udp];
     __idclass_map_set_dscp_default(id, idclass_dscp_default[udp]);
 }
 
+/* Helper: write port defaults that changed since they were last applied */
+static void idclass_dscp_default_apply(void) {
+    int udp;
+
+    for (udp = 0; udp < 2; udp++) {
+        if (idclass_dscp_applied[udp] == idclass_dscp_default[udp])
+            continue;
+        map_manager_set_dscp_default(udp ? CL_MAP_UDP_PORTS : CL_MAP_TCP_PORTS, 0xff);
+    }
+}
+
+/* Helper: is this one of the CIDR (LPM trie) maps? */
+static bool idclass_is_prefix(enum idclass_map_id id) {
+    return id == CL_MAP_IPV4_PREFIX || id == CL_MAP_IPV6_PREFIX;
+}
+
+/* Helper: track the number of prefix entries, trie lookups are skipped while empty */
+static void idclass_prefix_count(enum idclass_map_id id, int delta) {
+    uint32_t *count;
+
+    if (!idclass_is_prefix(id))
+        return;
+    count = &prefix_entries[id == CL_MAP_IPV6_PREFIX];
+    *count += delta;
+    if (!*count)
+        map_manager_update_config();
+}
+
+/*
+ * Helper: parse "addr" or "addr/len". Full-length prefixes stay in the exact
+ * host map, shorter ones go to the prefix map with the host bits cleared.
+ */
+static int idclass_parse_ip_entry(struct idclass_map_data *data, bool ipv6,
+                                  const char *str) {
+    int af = ipv6 ? AF_INET6 : AF_INET;
+    unsigned int max_len = ipv6 ? 128 : 32;
+    char buf[INET6_ADDRSTRLEN];
+    const char *sep = strchr(str, '/');
+    unsigned long len = max_len;
+    uint8_t *addr;
+    char *err;
+    int i;
+
+    data->id = ipv6 ? CL_MAP_IPV6_ADDR : CL_MAP_IPV4_ADDR;
+    if (!sep)
+        return inet_pton(af, str, &data->addr) == 1 ? 0 : -1;
+
+    if (sep - str >= sizeof(buf))
+        return -1;
+    memcpy(buf, str, sep - str);
+    buf[sep - str] = 0;
+    len = strtoul(sep + 1, &err, 10);
+    if (!sep[1] || *err || len > max_len)
+        return -1;
+
+    if (len == max_len)
+        return inet_pton(af, buf, &data->addr) == 1 ? 0 : -1;
+
+    if (ipv6) {
+        data->id = CL_MAP_IPV6_PREFIX;
+        data->addr.prefix6.prefixlen = len;
+        addr = (uint8_t *)data->addr.prefix6.addr;
+    } else {
+        data->id = CL_MAP_IPV4_PREFIX;
+        data->addr.prefix4.prefixlen = len;
+        addr = (uint8_t *)&data->addr.prefix4.addr;
+    }
+    if (inet_pton(af, buf, addr) != 1)
+        return -1;
+
+    /* 清掉主机位，保证同一网段只对应一个 key */
+    for (i = 0; i < max_len / 8; i++) {
+        if (len >= 8)
+            len -= 8;
+        else if (len) {
+            addr[i] &= 0xff << (8 - len);
+            len = 0;
+        } else
+            addr[i] = 0;
+    }
+    return 0;
+}
+
+/*
+ * Helper: kernel key for a DNS rule the datapath can match by itself, i.e. an
+ * exact name or "*.suffix" without further wildcards. Regex and CNAME-only
+ * rules stay in userspace.
+ */
+static bool idclass_dns_rule_key(const struct idclass_map_data *data,
+                                 struct idclass_dns_key *key) {
+    const char *name = data->addr.dns.pattern;
+    uint8_t wire[IDCLASS_DNS_NAME_MAX];
+    uint32_t h = IDCLASS_DNS_HASH_INIT;
+    int len = 0, i;
+
+    if (data->addr.dns.only_cname || name[0] == '/')
+        return false;
+
+    key->wildcard = !strncmp(name, "*.", 2);
+    if (key->wildcard)
+        name += 2;
+    if (!*name || strpbrk(name, "*?[\\"))
+        return false;
+
+    /* 转成线格式（不含根标签）：每个标签前是其长度 */
+    for (;;) {
+        const char *dot = strchr(name, '.');
+        int l = dot ? dot - name : strlen(name);
+
+        if (!l || l > 63 || len + 1 + l > sizeof(wire))
+            return false;
+        wire[len++] = l;
+        memcpy(wire + len, name, l);
+        len += l;
+        if (!dot)
+            break;
+        name = dot + 1;
+    }
+
+    for (i = len - 1; i >= 0; i--)
+        h = IDCLASS_DNS_HASH_STEP(h, wire[i]);
+    key->hash = h;
+    return true;
+}
+
+/* Helper: mirror a DNS rule into dns_names (or remove it) */
+static void idclass_dns_rule_sync(struct idclass_map_entry *e, bool add) {
+    int fd = map_manager_get_fd_internal(CL_MAP_DNS_NAMES);
+    struct idclass_dns_key key;
+    struct idclass_dns_val val = {
+        .seq = e->data.addr.dns.seq,
+        .dscp = e->data.dscp,
+    };
+
+    if (fd < 0 || !idclass_dns_rule_key(&e->data, &key))
+        return;
+    if (val.seq > dns_user_min_seq)
+        val.flags = IDCLASS_DNS_VAL_SHADOWED;
+    if (add)
+        bpf_map_update_elem(fd, &key, &val, BPF_ANY);
+    else
+        bpf_map_delete_elem(fd, &key);
+}
+
+/*
+ * Helper: a userspace-only DNS rule whose seq was old_seq changed or went
+ * away. Recompute the smallest such seq and refresh the shadow flags of the
+ * kernel rules if it moved. A new rule always gets the largest seq, so this
+ * only rescans when the old minimum was involved.
+ */
+static void idclass_dns_user_rule_changed(uint32_t old_seq) {
+    struct idclass_map_entry *e;
+    struct idclass_dns_key key;
+    uint32_t min_seq = ~0U;
+
+    if (old_seq != dns_user_min_seq && dns_user_min_seq != ~0U)
+        return;
+
+    avl_for_each_element(&map_data, e, avl) {
+        if (e->data.id == CL_MAP_DNS && !idclass_dns_rule_key(&e->data, &key) &&
+            e->data.addr.dns.seq < min_seq)
+            min_seq = e->data.addr.dns.seq;
+    }
+    if (min_seq == dns_user_min_seq)
+        return;
+
+    dns_user_min_seq = min_seq;
+    avl_for_each_element(&map_data, e, avl) {
+        if (e->data.id == CL_MAP_DNS)
+            idclass_dns_rule_sync(e, true);
+    }
+}
+
+/* Helper: does a expire before b? (wrap-safe) */
+static bool idclass_expire_before(const struct idclass_map_entry *a,
+                                  const struct idclass_map_entry *b) {
+    return (int32_t)(a->timeout - b->timeout) < 0;
+}
+
+static void idclass_expire_place(uint32_t pos, struct idclass_map_entry *e) {
+    expire_heap[pos - 1] = e;
+    e->heap_pos = pos;
+}
+
+/* Helper: restore the heap property around pos */
+static void idclass_expire_fix(uint32_t pos) {
+    struct idclass_map_entry *e = expire_heap[pos - 1];
+
+    while (pos > 1 && idclass_expire_before(e, expire_heap[pos / 2 - 1])) {
+        idclass_expire_place(pos, expire_heap[pos / 2 - 1]);
+        pos /= 2;
+    }
+    for (;;) {
+        uint32_t child = pos * 2;
+
+        if (child > expire_n)
+            break;
+        if (child < expire_n &&
+            idclass_expire_before(expire_heap[child], expire_heap[child - 1]))
+            child++;
+        if (!idclass_expire_before(expire_heap[child - 1], e))
+            break;
+        idclass_expire_place(pos, expire_heap[child - 1]);
+        pos = child;
+    }
+    idclass_expire_place(pos, e);
+}
+
+/* Helper: (re)queue an entry to expire at timeout */
+static void idclass_expire_set(struct idclass_map_entry *e, uint32_t timeout) {
+    e->timeout = timeout;
+    if (e->heap_pos) {
+        idclass_expire_fix(e->heap_pos);
+        return;
+    }
+
+    if (expire_n == expire_alloc) {
+        uint32_t alloc = expire_alloc ? expire_alloc * 2 : 256;
+        void *p = realloc(expire_heap, alloc * sizeof(*expire_heap));
+
+        if (!p) {
+            ULOG_ERR("Failed to grow expiry heap, entry will not expire\n");
+            return;
+        }
+        expire_heap = p;
+        expire_alloc = alloc;
+    }
+    idclass_expire_place(++expire_n, e);
+    idclass_expire_fix(expire_n);
+}
+
+/* Helper: remove an entry from the expiry heap */
+static void idclass_expire_del(struct idclass_map_entry *e) {
+    uint32_t pos = e->heap_pos;
+    struct idclass_map_entry *last;
+
+    if (!pos)
+        return;
+    e->heap_pos = 0;
+    last = expire_heap[--expire_n];
+    if (last == e)
+        return;
+    idclass_expire_place(pos, last);
+    idclass_expire_fix(pos);
+}
+
+/* Helper: program the GC timer for the earliest pending expiry */
+static void idclass_expire_arm(void) {
+    int32_t delta;
+
+    if (!expire_n) {
+        uloop_timeout_cancel(&idclass_map_timer);
+        return;
+    }
+    delta = expire_heap[0]->timeout - idclass_gettime();
+    uloop_timeout_set(&idclass_map_timer, delta > 0 ? delta * 1000 : 1);
+}
+
+/*
+ * 到期但仍活跃的 IP 条目需要把 seen 清零，同一个 map 的写操作合并成
+ * 批量更新
+ */
+struct idclass_refresh_batch {
+    uint32_t n;
+    uint8_t keys[IDCLASS_BATCH_SIZE * sizeof(struct idclass_lpm6_key)];
+    struct idclass_ip_map_val vals[IDCLASS_BATCH_SIZE];
+};
+
+static struct idclass_refresh_batch *refresh_batch[CL_MAP_IPV6_PREFIX - CL_MAP_IPV4_ADDR + 1];
+
+/* Helper: write out the pending seen resets of one map */
+static void idclass_refresh_flush(enum idclass_map_id id) {
+    struct idclass_refresh_batch *rb = refresh_batch[id - CL_MAP_IPV4_ADDR];
+
+    if (!rb || !rb->n)
+        return;
+    /* BPF_EXIST：不要重新创建期间已被删除的条目 */
+    idclass_map_update_many(map_manager_get_fd_internal(id), rb->keys,
+                            idclass_map_key_size(id), rb->vals,
+                            sizeof(rb->vals[0]), rb->n, BPF_EXIST);
+    rb->n = 0;
+}
+
+/* Helper: queue "seen = 0" for an IP entry */
+static void idclass_refresh_add(struct idclass_map_entry *e, uint8_t dscp) {
+    struct idclass_refresh_batch **rb = &refresh_batch[e->data.id - CL_MAP_IPV4_ADDR];
+    size_t key_size = idclass_map_key_size(e->data.id);
+
+    if (!*rb) {
+        *rb = calloc(1, sizeof(**rb));
+        if (!*rb)
+            return;
+    }
+    memcpy((*rb)->keys + (*rb)->n * key_size, &e->data.addr, key_size);
+    (*rb)->vals[(*rb)->n].dscp = dscp;
+    (*rb)->vals[(*rb)->n].seen = 0;
+    if (++(*rb)->n == IDCLASS_BATCH_SIZE)
+        idclass_refresh_flush(e->data.id);
+}
+
 /* Helper: allocate a new map entry */
 static struct idclass_map_entry *__idclass_map_alloc_entry(struct idclass_map_data *data) {
     struct idclass_map_entry *e;
@@ -204,6 +929,7 @@ static struct idclass_map_entry *__idclass_map_alloc_entry(struct idclass_map_da
     if (!e) return NULL;
     strcpy(pattern, data->addr.dns.pattern);
     e->data.addr.dns.pattern = pattern;
+    e->data.addr.dns.only_cname = data->addr.dns.only_cname;
     for (c = pattern; *c; c++)
         *c = tolower(*c);
     if (pattern[0] == '/' &&
@@ -221,7 +947,6 @@ void map_manager_set_entry_data(struct idclass_map_data *data) {
     struct idclass_map_entry *e;
     bool file = data->file;
     uint8_t prev_dscp = 0xff;
-    int32_t delta = 0;
     bool add = data->dscp != 0xff;
 
     e = avl_find_element(&map_data, data, e, avl);
@@ -231,17 +956,27 @@ void map_manager_set_entry_data(struct idclass_map_data *data) {
         e = __idclass_map_alloc_entry(data);
         if (!e)
             return;
+        /* 匹配器拒绝的 DNS 规则（标签过长）不加入 */
+        if (data->id == CL_MAP_DNS && dns_matcher_add(dns_rules, &e->data)) {
+            if (e->data.addr.dns.pattern[0] == '/')
+                regfree(&e->data.addr.dns.regex);
+            free(e);
+            return;
+        }
         e->avl.key = &e->data;
         e->data.id = data->id;
         avl_insert(&map_data, &e->avl);
+        idclass_prefix_count(data->id, 1);
     } else {
         prev_dscp = e->data.dscp;
     }
 
-    if (file)
+    if (file) {
         e->data.file = add;
-    else
+        e->file_gen = map_file_gen;
+    } else {
         e->data.user = add;
+    }
 
     if (add) {
         if (file)
@@ -258,22 +993,40 @@ void map_manager_set_entry_data(struct idclass_map_data *data) {
             .seen = 1,
         };
         bpf_map_update_elem(fd, &data->addr, &val, BPF_ANY);
+        /* trie 中已有条目后再让数据路径去查 */
+        if (idclass_is_prefix(data->id) && !(global_config.prefix_maps &
+            (data->id == CL_MAP_IPV6_PREFIX ? IDCLASS_PREFIX_IPV6 : IDCLASS_PREFIX_IPV4)))
+            map_manager_update_config();
     }
 
-    if (data->id == CL_MAP_DNS)
+    if (data->id == CL_MAP_DNS) {
+        struct idclass_dns_key key;
+        uint32_t old_seq = e->data.addr.dns.seq;
+
         e->data.addr.dns.seq = ++map_dns_seq;
+        dns_rules_gen++;
+        if (idclass_dns_rule_key(&e->data, &key))
+            idclass_dns_rule_sync(e, true);
+        else
+            idclass_dns_user_rule_changed(old_seq);
+    }
 
     if (add) {
-        if (idclass_map_timeout == ~0 || file) {
+        uint32_t lifetime = data->timeout ? data->timeout : idclass_map_timeout;
+
+        if (lifetime == ~0 || file) {
             e->timeout = ~0;
-            return;
+            idclass_expire_del(e);
+        } else {
+            idclass_expire_set(e, idclass_gettime() + lifetime);
         }
-        e->timeout = idclass_gettime() + idclass_map_timeout;
-        delta = e->timeout - next_timeout;
-        if (next_timeout && delta >= 0)
-            return;
+    } else {
+        if (!e->data.user)
+            idclass_expire_del(e);
+        if (!e->data.file && !e->data.user)
+            idclass_map_free_entry(e);
     }
-    uloop_timeout_set(&idclass_map_timer, 1);
+    idclass_expire_arm();
 }
 
 /* External: set a map entry by string (for ubus) */
@@ -309,12 +1062,10 @@ int map_manager_set_entry(enum idclass_map_id id, bool file, const char *str,
         return 0;
     }
     case CL_MAP_IPV4_ADDR:
-    case CL_MAP_IPV6_ADDR: {
-        int af = (id == CL_MAP_IPV6_ADDR) ? AF_INET6 : AF_INET;
-        if (inet_pton(af, str, &data.addr) != 1)
+    case CL_MAP_IPV6_ADDR:
+        if (idclass_parse_ip_entry(&data, id == CL_MAP_IPV6_ADDR, str))
             return -1;
         break;
-    }
     default:
         return -1;
     }
@@ -322,19 +1073,20 @@ int map_manager_set_entry(enum idclass_map_id id, bool file, const char *str,
     return 0;
 }
 
-/* External: clear all file-based entries and reload files */
+/*
+ * External: reset global settings to their defaults. The rule files are
+ * kept, map_manager_set_files() decides which of them have to be reparsed.
+ */
 void map_manager_reset_config(void) {
-    struct idclass_map_file *f, *tmp;
-    list_for_each_entry_safe(f, tmp, &map_files, list) {
-        list_del(&f->list);
-        free(f);
-    }
     map_manager_set_dscp_default(CL_MAP_TCP_PORTS, 0);
     map_manager_set_dscp_default(CL_MAP_UDP_PORTS, 0);
     idclass_map_timeout = 3600;
     idclass_active_timeout = 300;
     memset(&global_config, 0, sizeof(global_config));
     global_config.dscp_icmp = 0xff;
+    global_config.rescore_ms = 100;
+    global_config.rescore_pkt_mask = 15;
+    global_config.window_shift = IDCLASS_WINDOW_SHIFT_DEFAULT;
     memset(&global_flow_config, 0, sizeof(global_flow_config));
 }
 
@@ -373,27 +1125,33 @@ static void idclass_map_parse_line(char *str) {
     }
 }
 
-/* External: load a file containing rules */
-int map_manager_load_file(const char *file) {
-    struct idclass_map_file *f;
+/* Helper: remember the identity of a rule file, returns true if it changed */
+static bool idclass_map_file_stat(struct idclass_map_file *f) {
+    struct stat st;
+    bool changed;
+
+    if (stat(f->filename, &st))
+        memset(&st, 0, sizeof(st));
+
+    changed = f->dev != st.st_dev || f->ino != st.st_ino || f->size != st.st_size ||
+              f->mtime.tv_sec != st.st_mtim.tv_sec ||
+              f->mtime.tv_nsec != st.st_mtim.tv_nsec;
+    f->dev = st.st_dev;
+    f->ino = st.st_ino;
+    f->size = st.st_size;
+    f->mtime = st.st_mtim;
+    return changed;
+}
+
+/* Helper: parse all lines of a rule file */
+static int idclass_map_parse_file(const char *file) {
     FILE *fp;
     char line[1024];
     char *cur;
 
-    if (!file)
-        return 0;
-
-    f = calloc(1, sizeof(*f) + strlen(file) + 1);
-    if (!f) return -1;
-    strcpy(f->filename, file);
-    list_add_tail(&f->list, &map_files);
-
     fp = fopen(file, "r");
-    if (!fp) {
-        free(f);
-        list_del(&f->list);
+    if (!fp)
         return -1;
-    }
 
     while (fgets(line, sizeof(line), fp)) {
         cur = strchr(line, '#');
@@ -409,94 +1167,285 @@ int map_manager_load_file(const char *file) {
     return 0;
 }
 
-/* External: clear all loaded files */
-void map_manager_clear_files(void) {
-    struct idclass_map_file *f, *tmp;
-    list_for_each_entry_safe(f, tmp, &map_files, list) {
-        list_del(&f->list);
-        free(f);
-    }
-}
+/* Helper: allocate a rule file record */
+static struct idclass_map_file *idclass_map_file_new(const char *file) {
+    struct idclass_map_file *f;
 
-/* External: reload all file-based entries */
+    f = calloc(1, sizeof(*f) + strlen(file) + 1);
+    if (!f)
+        return NULL;
+    strcpy(f->filename, file);
+    return f;
+}
+
+/* External: load a file containing rules */
+int map_manager_load_file(const char *file) {
+    struct idclass_map_file *f;
+
+    if (!file)
+        return 0;
+
+    f = idclass_map_file_new(file);
+    if (!f) return -1;
+    idclass_map_file_stat(f);
+
+    if (idclass_map_parse_file(file)) {
+        free(f);
+        return -1;
+    }
+    list_add_tail(&f->list, &map_files);
+    return 0;
+}
+
+/*
+ * External: make the given array of file names the set of rule files. Files
+ * that are still listed and unchanged on disk (same inode, size and mtime)
+ * are not read again; only if something differs are all files reparsed and
+ * the file part of the entries that are no longer listed removed.
+ */
+void map_manager_set_files(struct blob_attr *files) {
+    struct idclass_map_file *f, *tmp;
+    struct blob_attr *cur;
+    LIST_HEAD(old);
+    bool changed = false;
+    int rem;
+
+    list_splice_init(&map_files, &old);
+
+    blobmsg_for_each_attr(cur, files, rem) {
+        const char *name = blobmsg_get_string(cur);
+        bool found = false;
+
+        list_for_each_entry(f, &old, list) {
+            if (strcmp(f->filename, name))
+                continue;
+            found = true;
+            break;
+        }
+        if (found) {
+            list_move_tail(&f->list, &map_files);
+        } else {
+            f = idclass_map_file_new(name);
+            if (!f)
+                continue;
+            list_add_tail(&f->list, &map_files);
+        }
+        if (idclass_map_file_stat(f) || !found)
+            changed = true;
+    }
+
+    list_for_each_entry_safe(f, tmp, &old, list) {
+        list_del(&f->list);
+        free(f);
+        changed = true;
+    }
+
+    if (!changed) {
+        apply_stats.file_skipped++;
+        return;
+    }
+    map_manager_reload_files();
+}
+
+/* External: clear all loaded files and their entries */
+void map_manager_clear_files(void) {
+    map_manager_set_files(NULL);
+}
+
+/* Helper: drop the file part of entries not seen in the last pass over the files */
+static void idclass_map_sweep_files(void) {
+    struct idclass_map_entry *e, *tmp;
+    bool ports = false;
+
+    avl_for_each_element_safe(&map_data, e, avl, tmp) {
+        if (!e->data.file || e->file_gen == map_file_gen)
+            continue;
+        apply_stats.file_dropped++;
+        if (e->data.id == CL_MAP_TCP_PORTS || e->data.id == CL_MAP_UDP_PORTS)
+            ports = true;
+
+        /* 与 set_entry_data 删除文件条目相同：有用户条目时保留其值 */
+        e->data.file = false;
+        if (!e->data.user)
+            idclass_map_free_entry(e);
+    }
+
+    /* 删除的端口条目恢复为默认值 */
+    if (ports) {
+        map_manager_set_dscp_default(CL_MAP_TCP_PORTS, 0xff);
+        map_manager_set_dscp_default(CL_MAP_UDP_PORTS, 0xff);
+    }
+}
+
+/* External: reparse all rule files, entries no longer listed lose their file part */
 void map_manager_reload_files(void) {
     struct idclass_map_file *f;
+
+    map_file_gen++;
     list_for_each_entry(f, &map_files, list) {
-        FILE *fp = fopen(f->filename, "r");
-        if (!fp) continue;
-        char line[1024];
-        while (fgets(line, sizeof(line), fp)) {
-            char *cur = strchr(line, '#');
-            if (cur) *cur = 0;
-            cur = line + strlen(line);
-            while (cur > line && isspace(cur[-1])) cur--;
-            *cur = 0;
-            if (!*line) continue;
-            idclass_map_parse_line(line);
-        }
-        fclose(fp);
+        idclass_map_file_stat(f);
+        idclass_map_parse_file(f->filename);
     }
+    apply_stats.file_reloads++;
+    idclass_map_sweep_files();
     map_manager_gc();
-    map_manager_set_dscp_default(CL_MAP_TCP_PORTS, 0xff);
-    map_manager_set_dscp_default(CL_MAP_UDP_PORTS, 0xff);
 }
 
 /* Helper: free a map entry */
 static void idclass_map_free_entry(struct idclass_map_entry *e) {
     int fd = map_manager_get_fd_internal(e->data.id);
+    idclass_expire_del(e);
     avl_delete(&map_data, &e->avl);
     if (e->data.id < CL_MAP_DNS)
         bpf_map_delete_elem(fd, &e->data.addr);
+    if (e->data.id == CL_MAP_DNS) {
+        struct idclass_dns_key key;
+
+        idclass_dns_rule_sync(e, false);
+        dns_matcher_del(dns_rules, &e->data);
+        dns_rules_gen++;
+        if (!idclass_dns_rule_key(&e->data, &key))
+            idclass_dns_user_rule_changed(e->data.addr.dns.seq);
+        if (e->data.addr.dns.pattern[0] == '/')
+            regfree(&e->data.addr.dns.regex);
+    }
+    idclass_prefix_count(e->data.id, -1);
     free(e);
 }
 
-/* Helper: refresh timeout for active IP entries */
-static bool idclass_map_entry_refresh_timeout(struct idclass_map_entry *e) {
+/* Helper: an expired IP entry that the datapath used since the last check stays */
+static bool idclass_map_entry_refresh_timeout(struct idclass_map_entry *e, uint32_t now) {
     struct idclass_ip_map_val val;
     int fd = map_manager_get_fd_internal(e->data.id);
 
-    if (e->data.id != CL_MAP_IPV4_ADDR && e->data.id != CL_MAP_IPV6_ADDR)
+    if (e->data.id != CL_MAP_IPV4_ADDR && e->data.id != CL_MAP_IPV6_ADDR &&
+        !idclass_is_prefix(e->data.id))
         return false;
     if (bpf_map_lookup_elem(fd, &e->data.addr, &val) != 0)
         return false;
     if (!val.seen)
         return false;
-    e->timeout = idclass_gettime() + idclass_active_timeout;
-    val.seen = 0;
-    bpf_map_update_elem(fd, &e->data.addr, &val, BPF_ANY);
+    idclass_expire_set(e, now + (idclass_active_timeout > 0 ? idclass_active_timeout : 1));
+    idclass_refresh_add(e, val.dscp);
     return true;
 }
 
-/* External: garbage collect expired map entries */
+/* Helper: drop the user part of an expired entry */
+static void idclass_map_expire_entry(struct idclass_map_entry *e) {
+    idclass_expire_del(e);
+    e->data.user = false;
+    if (!e->data.file) {
+        idclass_map_free_entry(e);
+        return;
+    }
+
+    /* 回落到规则文件中的值 */
+    if (e->data.dscp == e->data.file_dscp)
+        return;
+    e->data.dscp = e->data.file_dscp;
+    if (e->data.id < CL_MAP_DNS) {
+        struct idclass_ip_map_val val = {
+            .dscp = e->data.dscp,
+            .seen = 1,
+        };
+        bpf_map_update_elem(map_manager_get_fd_internal(e->data.id),
+                            &e->data.addr, &val, BPF_ANY);
+    } else if (e->data.id == CL_MAP_DNS) {
+        idclass_dns_rule_sync(e, true);
+        dns_rules_gen++;
+    }
+}
+
+/* External: expire the user entries that are due (only those are touched) */
 void map_manager_gc(void) {
-    struct idclass_map_entry *e, *tmp;
-    int32_t timeout = 0;
     uint32_t cur_time = idclass_gettime();
+    uint64_t start = idclass_gettime_us();
+    struct idclass_map_entry *e;
+    enum idclass_map_id id;
+    uint32_t us;
 
-    next_timeout = 0;
-    avl_for_each_element_safe(&map_data, e, avl, tmp) {
-        int32_t cur_timeout;
-
-        if (e->data.user && e->timeout != ~0) {
-            cur_timeout = e->timeout - cur_time;
-            if (cur_timeout <= 0 &&
-                idclass_map_entry_refresh_timeout(e))
-                cur_timeout = e->timeout - cur_time;
-            if (cur_timeout <= 0) {
-                e->data.user = false;
-                e->data.dscp = e->data.file_dscp;
-            } else if (!timeout || cur_timeout < timeout) {
-                timeout = cur_timeout;
-                next_timeout = e->timeout;
-            }
-        }
-        if (e->data.file || e->data.user)
+    while (expire_n) {
+        e = expire_heap[0];
+        if ((int32_t)(e->timeout - cur_time) > 0)
+            break;
+        if (idclass_map_entry_refresh_timeout(e, cur_time)) {
+            expire_stats.refreshed++;
             continue;
-        idclass_map_free_entry(e);
+        }
+        idclass_map_expire_entry(e);
+        expire_stats.expired++;
     }
-    if (!timeout)
-        return;
-    uloop_timeout_set(&idclass_map_timer, timeout * 1000);
+
+    for (id = CL_MAP_IPV4_ADDR; id <= CL_MAP_IPV6_PREFIX; id++)
+        idclass_refresh_flush(id);
+
+    us = idclass_gettime_us() - start;
+    expire_stats.last_us = us;
+    if (us > expire_stats.max_us)
+        expire_stats.max_us = us;
+    idclass_expire_arm();
+}
+
+static void idclass_map_timer_cb(struct uloop_timeout *t) {
+    map_manager_gc();
+}
+
+/* Helper: emit expiry statistics */
+static void idclass_expire_stats_dump(struct blob_buf *b, bool reset) {
+    void *c;
+
+    c = blobmsg_open_table(b, "expiry");
+    blobmsg_add_u32(b, "pending", expire_n);
+    if (expire_n) {
+        int32_t next = expire_heap[0]->timeout - idclass_gettime();
+        blobmsg_add_u32(b, "next", next > 0 ? next : 0);
+    }
+    blobmsg_add_u64(b, "expired", expire_stats.expired);
+    blobmsg_add_u64(b, "refreshed", expire_stats.refreshed);
+    blobmsg_add_u32(b, "last_gc_us", expire_stats.last_us);
+    blobmsg_add_u32(b, "max_gc_us", expire_stats.max_us);
+    blobmsg_close_table(b, c);
+
+    if (reset)
+        memset(&expire_stats, 0, sizeof(expire_stats));
+}
+
+/* Helper: emit how much of the configuration reloads actually rewrote */
+static void idclass_apply_stats_dump(struct blob_buf *b, bool reset) {
+    void *c;
+
+    c = blobmsg_open_table(b, "apply");
+    blobmsg_add_u64(b, "config_writes", apply_stats.config_writes);
+    blobmsg_add_u64(b, "config_skipped", apply_stats.config_skipped);
+    blobmsg_add_u64(b, "flow_config_writes", apply_stats.flow_config_writes);
+    blobmsg_add_u64(b, "flow_config_skipped", apply_stats.flow_config_skipped);
+    blobmsg_add_u32(b, "flow_config_gen", flow_config_gen);
+    blobmsg_add_u64(b, "class_writes", apply_stats.class_writes);
+    blobmsg_add_u64(b, "class_skipped", apply_stats.class_skipped);
+    blobmsg_add_u64(b, "file_reloads", apply_stats.file_reloads);
+    blobmsg_add_u64(b, "file_skipped", apply_stats.file_skipped);
+    blobmsg_add_u64(b, "file_dropped", apply_stats.file_dropped);
+    blobmsg_close_table(b, c);
+
+    if (reset)
+        memset(&apply_stats, 0, sizeof(apply_stats));
+}
+
+/* Helper: emit what a restart kept and how long classification took to recover */
+static void idclass_restart_stats_dump(struct blob_buf *b) {
+    void *c;
+
+    c = blobmsg_open_table(b, "restart");
+    blobmsg_add_u8(b, "warm_restart", ebpf_loader_warm_restart());
+    blobmsg_add_u8(b, "maps_reused", restart_stats.warm);
+    blobmsg_add_u32(b, "restored", restart_stats.restored);
+    blobmsg_add_u32(b, "orphans", restart_stats.orphans);
+    blobmsg_add_u32(b, "restore_us", restart_stats.restore_us);
+    blobmsg_add_u32(b, "flows_kept", restart_stats.flows_kept);
+    blobmsg_add_u32(b, "target_pct", restart_stats.target_pct);
+    blobmsg_add_u32(b, "ready_ms", restart_stats.ready_ms);
+    blobmsg_add_u32(b, "ready_pct", restart_stats.ready_pct);
+    blobmsg_close_table(b, c);
 }
 
 /* External: dump map entries to blob */
@@ -537,6 +1486,18 @@ void map_manager_dump(struct blob_buf *b) {
             inet_ntop(af, &e->data.addr, buf, buf_len);
             blobmsg_add_string_buffer(b);
             break;
+        case CL_MAP_IPV4_PREFIX:
+        case CL_MAP_IPV6_PREFIX: {
+            char addr[INET6_ADDRSTRLEN];
+
+            if (e->data.id == CL_MAP_IPV6_PREFIX)
+                inet_ntop(AF_INET6, e->data.addr.prefix6.addr, addr, sizeof(addr));
+            else
+                inet_ntop(AF_INET, &e->data.addr.prefix4.addr, addr, sizeof(addr));
+            blobmsg_printf(b, "addr", "%s/%u", addr, e->data.id == CL_MAP_IPV6_PREFIX ?
+                           e->data.addr.prefix6.prefixlen : e->data.addr.prefix4.prefixlen);
+            break;
+        }
         case CL_MAP_DNS:
             blobmsg_add_string(b, "addr", e->data.addr.dns.pattern);
             break;
@@ -548,11 +1509,284 @@ void map_manager_dump(struct blob_buf *b) {
     blobmsg_close_array(b, a);
 }
 
+static void idclass_hist_add(struct blob_buf *b, const char *name, const uint8_t *hist) {
+    void *a = blobmsg_open_array(b, name);
+    int i;
+
+    for (i = 0; i < IDCLASS_HIST_BINS; i++)
+        blobmsg_add_u32(b, NULL, hist[i]);
+    blobmsg_close_array(b, a);
+}
+
+static void idclass_flow_addr_add(struct blob_buf *b, const uint32_t *addr) {
+    char buf[INET6_ADDRSTRLEN];
+
+    if (IN6_IS_ADDR_V4MAPPED((const struct in6_addr *)addr))
+        inet_ntop(AF_INET, &addr[3], buf, sizeof(buf));
+    else
+        inet_ntop(AF_INET6, addr, buf, sizeof(buf));
+    blobmsg_add_string(b, NULL, buf);
+}
+
+/*
+ * External: export up to limit flows with their current verdict and the
+ * packet length / inter-arrival time histograms, for tuning the classifier
+ */
+void map_manager_flows(struct blob_buf *b, uint32_t limit) {
+    struct flow_key key, next_key;
+    struct flow_stats stats;
+    uint64_t packets, bytes;
+    uint32_t n = 0;
+    void *prev = NULL;
+    void *a, *c, *e;
+    int i;
+
+    if (flow_stats_fd < 0)
+        return;
+
+    /* 第 i 格：长度 [2^i, 2^(i+1)) 字节，间隔 [2^i, 2^(i+1)) * iat_unit_ns */
+    blobmsg_add_u32(b, "iat_unit_ns", 1 << IDCLASS_HIST_IAT_SHIFT);
+    a = blobmsg_open_array(b, "flows");
+    while (n < limit && bpf_map_get_next_key(flow_stats_fd, prev, &next_key) == 0) {
+        key = next_key;
+        prev = &key;
+        if (idclass_flow_stats_lookup(&key, &stats) != 0)
+            continue;
+        idclass_flow_totals(&key, &stats, &packets, &bytes);
+
+        c = blobmsg_open_table(b, NULL);
+        e = blobmsg_open_array(b, "addr");
+        for (i = 0; i < 2; i++)
+            idclass_flow_addr_add(b, key.addr[i]);
+        blobmsg_close_array(b, e);
+        e = blobmsg_open_array(b, "port");
+        for (i = 0; i < 2; i++)
+            blobmsg_add_u32(b, NULL, ntohs(key.port[i]));
+        blobmsg_close_array(b, e);
+        blobmsg_add_u32(b, "proto", key.proto);
+        blobmsg_add_u64(b, "packets", packets);
+        blobmsg_add_u64(b, "bytes", bytes);
+        blobmsg_add_u32(b, "avg_pkt_len", stats.avg_pkt_len >> EWMA_SHIFT);
+        blobmsg_add_u32(b, "iat_us", stats.iat_us);
+        if (stats.verdict_flags & IDCLASS_VERDICT_VALID)
+            blobmsg_add_u32(b, "prio", stats.verdict_prio);
+        idclass_hist_add(b, "len_hist", stats.len_hist);
+        idclass_hist_add(b, "iat_hist", stats.iat_hist);
+        blobmsg_close_table(b, c);
+        n++;
+    }
+    blobmsg_close_array(b, a);
+}
+
+/* Helper: summarize the flow statistics map (totals summed over all CPUs) */
+static void idclass_flow_stats_summary(struct blob_buf *b) {
+    struct flow_key key, next_key;
+    struct flow_stats stats;
+    uint64_t packets = 0, bytes = 0;
+    uint64_t flow_packets, flow_bytes;
+    uint32_t flows = 0;
+    void *prev = NULL;
+    void *c;
+
+    if (flow_stats_fd < 0)
+        return;
+
+    while (bpf_map_get_next_key(flow_stats_fd, prev, &next_key) == 0) {
+        if (idclass_flow_stats_lookup(&next_key, &stats) == 0) {
+            idclass_flow_totals(&next_key, &stats, &flow_packets, &flow_bytes);
+            flows++;
+            packets += flow_packets;
+            bytes += flow_bytes;
+        }
+        key = next_key;
+        prev = &key;
+    }
+
+    c = blobmsg_open_table(b, "flows");
+    blobmsg_add_u8(b, "percpu", flow_stats_percpu);
+    blobmsg_add_u32(b, "record_size", sizeof(struct flow_stats) + sizeof(struct flow_info));
+    blobmsg_add_u32(b, "key_size", sizeof(struct flow_key));
+    blobmsg_add_u32(b, "count", flows);
+    blobmsg_add_u64(b, "packets", packets);
+    blobmsg_add_u64(b, "bytes", bytes);
+    blobmsg_add_u64(b, "expired", flows_expired);
+    blobmsg_add_u64(b, "conn_corrected", ip_conn_corrected);
+    blobmsg_close_table(b, c);
+}
+
+/* External: sum a per-CPU datapath counter, optionally clearing it */
+uint64_t map_manager_read_counter(uint32_t key, bool reset) {
+    int ncpus = libbpf_num_possible_cpus();
+    uint64_t *vals, sum = 0;
+    int i;
+
+    if (classify_counters_fd < 0 || ncpus < 1)
+        return 0;
+    vals = calloc(ncpus, sizeof(*vals));
+    if (!vals)
+        return 0;
+    if (bpf_map_lookup_elem(classify_counters_fd, &key, vals) == 0) {
+        for (i = 0; i < ncpus; i++)
+            sum += vals[i];
+        if (reset) {
+            memset(vals, 0, ncpus * sizeof(*vals));
+            bpf_map_update_elem(classify_counters_fd, &key, vals, BPF_ANY);
+        }
+    }
+    free(vals);
+    return sum;
+}
+
+struct idclass_latency_ctx {
+    struct blob_buf *b;
+    uint32_t now_ms;
+};
+
+static void idclass_latency_cb(void *keys, void *vals, uint32_t n, void *ctx) {
+    struct idclass_latency_ctx *lc = ctx;
+    struct client_rtt *rtt = vals;
+    char addr[INET6_ADDRSTRLEN];
+    uint32_t i;
+
+    for (i = 0; i < n; i++) {
+        const uint8_t *ip = keys + i * 16;
+        void *c;
+
+        if (!rtt[i].samples)
+            continue;
+        if (IN6_IS_ADDR_V4MAPPED((const struct in6_addr *)ip))
+            inet_ntop(AF_INET, ip + 12, addr, sizeof(addr));
+        else
+            inet_ntop(AF_INET6, ip, addr, sizeof(addr));
+
+        c = blobmsg_open_table(lc->b, addr);
+        blobmsg_add_u32(lc->b, "rtt_us", rtt[i].rtt_us);
+        blobmsg_add_u32(lc->b, "lan_rtt_us", rtt[i].lan_rtt_us);
+        blobmsg_add_u32(lc->b, "min_rtt_us", rtt[i].min_rtt_us);
+        blobmsg_add_u32(lc->b, "samples", rtt[i].samples);
+        blobmsg_add_u32(lc->b, "age_ms", lc->now_ms - rtt[i].last_ms);
+        blobmsg_close_table(lc->b, c);
+    }
+}
+
+/* Helper: per-client latency from the passive TCP RTT samples */
+static void idclass_latency_summary(struct blob_buf *b) {
+    struct idclass_latency_ctx lc = {
+        .b = b,
+        .now_ms = idclass_gettime_us() / 1000,
+    };
+    void *c;
+
+    if (client_rtt_fd < 0)
+        return;
+
+    c = blobmsg_open_table(b, "latency");
+    idclass_map_walk(client_rtt_fd, 16, sizeof(struct client_rtt),
+                     idclass_latency_cb, &lc);
+    blobmsg_close_table(b, c);
+}
+
+static void idclass_loss_dir(struct blob_buf *b, const char *name,
+                             const struct idclass_wan_loss *l, int dir) {
+    void *c = blobmsg_open_table(b, name);
+
+    blobmsg_add_u64(b, "segments", l->segs[dir]);
+    blobmsg_add_u64(b, "retrans", l->retrans[dir]);
+    blobmsg_add_u64(b, "reorder", l->reorder[dir]);
+    blobmsg_add_u64(b, "wan_lost", l->wan_lost[dir]);
+    /* WAN 一侧丢包率，单位 0.01% */
+    blobmsg_add_u32(b, "loss_rate", l->segs[dir] ? l->wan_lost[dir] * 10000 / l->segs[dir] : 0);
+    blobmsg_close_table(b, c);
+}
+
+/* Helper: per-WAN TCP retransmission, reordering and loss counters */
+static void idclass_loss_summary(struct blob_buf *b, bool reset) {
+    int ncpus = libbpf_num_possible_cpus();
+    struct idclass_wan_loss *vals, sum;
+    uint32_t key, next;
+    char ifname[IF_NAMESIZE];
+    bool first = true;
+    void *c;
+    int i;
+
+    if (wan_loss_fd < 0 || ncpus < 1)
+        return;
+    vals = calloc(ncpus, sizeof(*vals));
+    if (!vals)
+        return;
+
+    c = blobmsg_open_table(b, "loss");
+    while (!bpf_map_get_next_key(wan_loss_fd, first ? NULL : &key, &next)) {
+        void *t;
+
+        first = false;
+        key = next;
+        if (bpf_map_lookup_elem(wan_loss_fd, &key, vals))
+            continue;
+        memset(&sum, 0, sizeof(sum));
+        for (i = 0; i < ncpus; i++) {
+            int d;
+
+            for (d = 0; d < 2; d++) {
+                sum.segs[d] += vals[i].segs[d];
+                sum.retrans[d] += vals[i].retrans[d];
+                sum.reorder[d] += vals[i].reorder[d];
+                sum.wan_lost[d] += vals[i].wan_lost[d];
+            }
+        }
+        if (!if_indextoname(key, ifname))
+            snprintf(ifname, sizeof(ifname), "if%u", key);
+
+        t = blobmsg_open_table(b, ifname);
+        idclass_loss_dir(b, "egress", &sum, 0);
+        idclass_loss_dir(b, "ingress", &sum, 1);
+        blobmsg_close_table(b, t);
+
+        if (reset) {
+            memset(vals, 0, ncpus * sizeof(*vals));
+            bpf_map_update_elem(wan_loss_fd, &key, vals, BPF_EXIST);
+        }
+    }
+    blobmsg_close_table(b, c);
+    free(vals);
+}
+
+/* Helper: report how often the cached per-flow verdict had to be recomputed */
+static void idclass_verdict_summary(struct blob_buf *b, bool reset) {
+    uint64_t packets = map_manager_read_counter(IDCLASS_CNT_PACKETS, reset);
+    uint64_t rescored = map_manager_read_counter(IDCLASS_CNT_RESCORE, reset);
+    void *c;
+
+    c = blobmsg_open_table(b, "verdict");
+    blobmsg_add_u64(b, "packets", packets);
+    blobmsg_add_u64(b, "rescored", rescored);
+    /* 重新评分比例，单位 0.01% */
+    blobmsg_add_u32(b, "rescore_rate", packets ? rescored * 10000 / packets : 0);
+    blobmsg_add_u32(b, "rescore_ms", global_config.rescore_ms);
+    blobmsg_add_u32(b, "rescore_packets", global_config.rescore_pkt_mask + 1);
+    blobmsg_add_u32(b, "feature_window_ms",
+                    global_config.window_shift ? 1U << global_config.window_shift : 0);
+    blobmsg_close_table(b, c);
+}
+
 /* External: get statistics (packet counts) per class */
 void map_manager_stats(struct blob_buf *b, bool reset) {
     struct idclass_class data;
     uint32_t i;
 
+    idclass_flow_stats_summary(b);
+    idclass_verdict_summary(b, reset);
+    idclass_latency_summary(b);
+    idclass_loss_summary(b, reset);
+    idclass_bulk_stats_dump(b);
+    idclass_expire_stats_dump(b, reset);
+    idclass_apply_stats_dump(b, reset);
+    idclass_restart_stats_dump(b);
+    event_stream_stats(b, reset);
+    dns_parser_stats(b, reset);
+    dns_matcher_stats(dns_rules, b);
+    nft_batch_stats(b, reset);
+
     for (i = 0; i < ARRAY_SIZE(map_class); i++) {
         void *c;
         if (!map_class[i])
@@ -573,7 +1807,27 @@ void map_manager_stats(struct blob_buf *b, bool reset) {
 void map_manager_update_config(void) {
     int fd = map_manager_get_fd_internal(CL_MAP_GLOBAL_CONFIG);
     uint32_t key = 0;
-    bpf_map_update_elem(fd, &key, &global_config, BPF_ANY);
+    global_config.active_timeout_s = idclass_active_timeout > 0xffff ?
+                                     0xffff : idclass_active_timeout;
+    global_config.event_mask = event_stream_get_mask();
+    global_config.prefix_maps = (prefix_entries[0] ? IDCLASS_PREFIX_IPV4 : 0) |
+                                (prefix_entries[1] ? IDCLASS_PREFIX_IPV6 : 0);
+    global_config.dns_capture = dns_parser_active();
+    global_config.config_gen = flow_config_gen;
+    idclass_dscp_default_apply();
+
+    if (config_applied_valid &&
+        !memcmp(&config_applied, &global_config, sizeof(global_config))) {
+        apply_stats.config_skipped++;
+        return;
+    }
+    if (bpf_map_update_elem(fd, &key, &global_config, BPF_ANY)) {
+        config_applied_valid = false;
+        return;
+    }
+    config_applied = global_config;
+    config_applied_valid = true;
+    apply_stats.config_writes++;
 }
 
 /* Helper: get class ID by name */
@@ -641,100 +1895,150 @@ static int idclass_map_create_class(struct blob_attr *attr) {
         return -1;
     }
 
-    class->data.config = global_flow_config;
+    class->data.config = IDCLASS_FLOW_CONFIG_DEFAULT;
     return 0;
 }
 
+/* 类 ID 重映射的遍历上下文 */
+struct idclass_remap_ctx {
+    int fd;
+    size_t key_size;
+    int new_id[IDCLASS_MAX_CLASS_ENTRIES];
+    uint64_t updated;
+};
+
+/* Helper: rewrite the class ID of one chunk of IP map entries */
+static void idclass_remap_class_cb(void *keys, void *vals, uint32_t n, void *ctx) {
+    struct idclass_remap_ctx *rc = ctx;
+    struct idclass_ip_map_val *val = vals;
+    uint32_t i, changed = 0;
+
+    for (i = 0; i < n; i++) {
+        uint8_t old_class_id = val[i].dscp & IDCLASS_DSCP_VALUE_MASK;
+        int new_id;
+
+        if (!(val[i].dscp & IDCLASS_DSCP_CLASS_FLAG) ||
+            old_class_id >= ARRAY_SIZE(rc->new_id))
+            continue;
+        new_id = rc->new_id[old_class_id];
+        if (new_id < 0 || new_id == old_class_id)
+            continue;
+
+        /* 把需要更新的条目压缩到块的前部，一次批量写回 */
+        memmove(keys + changed * rc->key_size, keys + i * rc->key_size, rc->key_size);
+        val[changed] = val[i];
+        val[changed].dscp = (val[i].dscp & ~IDCLASS_DSCP_VALUE_MASK) | new_id;
+        changed++;
+    }
+
+    idclass_map_update_many(rc->fd, keys, rc->key_size, vals, sizeof(*val),
+                            changed, BPF_EXIST);
+    rc->updated += changed;
+}
+
 /* Helper: update IP mappings when class IDs change */
 static void map_manager_update_ip_mappings(void) {
-    int fd_v4 = map_manager_get_fd_internal(CL_MAP_IPV4_ADDR);
-    int fd_v6 = map_manager_get_fd_internal(CL_MAP_IPV6_ADDR);
-    struct in_addr key4;
-    struct in6_addr key6;
-    struct idclass_ip_map_val val;
-    uint32_t next_key[4] = {0};
-    uint32_t cur_key[4] = {0};
-    int i;
+    struct idclass_remap_ctx rc = {};
+    uint64_t start = idclass_gettime_us();
+    uint64_t entries = 0;
+    int i, j;
 
-    // Build class name -> new ID mapping
-    int class_name_to_id[IDCLASS_MAX_CLASS_ENTRIES];
-    memset(class_name_to_id, -1, sizeof(class_name_to_id));
+    // Build old class ID -> new class ID mapping (by class name)
     for (i = 0; i < ARRAY_SIZE(map_class); i++) {
-        if (map_class[i] && (map_class[i]->data.flags & IDCLASS_CLASS_FLAG_PRESENT)) {
-            class_name_to_id[i] = i; // store index as new ID
+        rc.new_id[i] = -1;
+        if (!map_class[i])
+            continue;
+        for (j = 0; j < ARRAY_SIZE(map_class); j++) {
+            if (map_class[j] && !strcmp(map_class[j]->name, map_class[i]->name)) {
+                rc.new_id[i] = j;
+                break;
+            }
         }
     }
 
-    // Update IPv4 map
-    memset(&cur_key, 0, sizeof(cur_key));
-    while (bpf_map_get_next_key(fd_v4, &cur_key, &key4) == 0) {
-        if (bpf_map_lookup_elem(fd_v4, &key4, &val) == 0) {
-            if (val.dscp & IDCLASS_DSCP_CLASS_FLAG) {
-                uint8_t old_class_id = val.dscp & IDCLASS_DSCP_VALUE_MASK;
-                // Find the class name for old_class_id
-                const char *class_name = NULL;
-                if (old_class_id < ARRAY_SIZE(map_class) && map_class[old_class_id]) {
-                    class_name = map_class[old_class_id]->name;
-                }
-                if (class_name) {
-                    // Find new ID for this class name
-                    int new_id = -1;
-                    for (i = 0; i < ARRAY_SIZE(map_class); i++) {
-                        if (map_class[i] && !strcmp(map_class[i]->name, class_name)) {
-                            new_id = i;
-                            break;
-                        }
-                    }
-                    if (new_id >= 0 && new_id != old_class_id) {
-                        val.dscp = (val.dscp & ~IDCLASS_DSCP_VALUE_MASK) | new_id;
-                        bpf_map_update_elem(fd_v4, &key4, &val, BPF_ANY);
-                    }
-                }
-            }
-        }
-        cur_key[0] = key4.s_addr;
-    }
-
-    // Update IPv6 map
-    memset(&cur_key, 0, sizeof(cur_key));
-    while (bpf_map_get_next_key(fd_v6, &cur_key, &key6) == 0) {
-        if (bpf_map_lookup_elem(fd_v6, &key6, &val) == 0) {
-            if (val.dscp & IDCLASS_DSCP_CLASS_FLAG) {
-                uint8_t old_class_id = val.dscp & IDCLASS_DSCP_VALUE_MASK;
-                const char *class_name = NULL;
-                if (old_class_id < ARRAY_SIZE(map_class) && map_class[old_class_id]) {
-                    class_name = map_class[old_class_id]->name;
-                }
-                if (class_name) {
-                    int new_id = -1;
-                    for (i = 0; i < ARRAY_SIZE(map_class); i++) {
-                        if (map_class[i] && !strcmp(map_class[i]->name, class_name)) {
-                            new_id = i;
-                            break;
-                        }
-                    }
-                    if (new_id >= 0 && new_id != old_class_id) {
-                        val.dscp = (val.dscp & ~IDCLASS_DSCP_VALUE_MASK) | new_id;
-                        bpf_map_update_elem(fd_v6, &key6, &val, BPF_ANY);
-                    }
-                }
-            }
-        }
-        memcpy(&cur_key, &key6, sizeof(key6));
+    for (i = CL_MAP_IPV4_ADDR; i <= CL_MAP_IPV6_PREFIX; i++) {
+        rc.fd = map_manager_get_fd_internal(i);
+        rc.key_size = idclass_map_key_size(i);
+        entries += idclass_map_walk(rc.fd, rc.key_size, sizeof(struct idclass_ip_map_val),
+                                    idclass_remap_class_cb, &rc);
+    }
+
+    idclass_bulk_done(BULK_IP_MAPPINGS, start, entries);
+}
+
+/*
+ * Helper: publish global_flow_config, which all classes reference through
+ * IDCLASS_FLOW_CONFIG_DEFAULT. The value is written into the generation the
+ * datapath does not use and then global_config.config_gen is flipped, so no
+ * packet sees a half-written config. If the other generation was in use
+ * until recently, wait for an RCU grace period first (tc programs run in RCU
+ * read sections and membarrier's global command waits for one).
+ */
+static void idclass_flow_config_push(void) {
+    int fd = map_manager_get_fd_internal(CL_MAP_FLOW_CONFIG);
+    uint64_t start = idclass_gettime_us();
+    uint32_t key;
+
+    if (flow_config_valid &&
+        !memcmp(&flow_config_applied, &global_flow_config, sizeof(global_flow_config))) {
+        apply_stats.flow_config_skipped++;
+        return;
     }
+
+    if (flow_config_flip_us &&
+        start - flow_config_flip_us < IDCLASS_FLOW_CONFIG_GRACE_US &&
+        syscall(__NR_membarrier, MEMBARRIER_CMD_GLOBAL, 0, 0) < 0)
+        usleep(IDCLASS_FLOW_CONFIG_GRACE_US);
+
+    key = !flow_config_gen * IDCLASS_FLOW_CONFIG_SLOTS + IDCLASS_FLOW_CONFIG_DEFAULT;
+    if (bpf_map_update_elem(fd, &key, &global_flow_config, BPF_ANY)) {
+        ULOG_ERR("Failed to write flow config: %s\n", strerror(errno));
+        return;
+    }
+
+    flow_config_gen = !flow_config_gen;
+    map_manager_update_config();
+    if (!config_applied_valid || config_applied.config_gen != flow_config_gen) {
+        /* 没有翻转成功，数据路径仍在用原来的一代 */
+        flow_config_gen = !flow_config_gen;
+        flow_config_valid = false;
+        return;
+    }
+    flow_config_flip_us = idclass_gettime_us();
+    flow_config_applied = global_flow_config;
+    flow_config_valid = true;
+
+    apply_stats.flow_config_writes++;
+    idclass_bulk_done(BULK_CLASS_CONFIG, start, 1);
 }
 
-/* External: set class map from blob (called by config module) */
+/*
+ * External: set class map from blob (called by config module). Only slots
+ * whose value changed are written, the IP maps are only walked when a class
+ * was added or removed.
+ */
 void map_manager_set_classes(struct blob_attr *val) {
     int fd = map_manager_get_fd_internal(CL_MAP_CLASS);
     struct idclass_class empty_data = {};
+    struct idclass_class old[ARRAY_SIZE(map_class)];
+    struct idclass_class data[ARRAY_SIZE(map_class)];
+    uint32_t keys[ARRAY_SIZE(map_class)];
+    bool present[ARRAY_SIZE(map_class)];
+    bool membership = false;
     struct blob_attr *cur;
+    uint32_t n = 0;
     int32_t i;
     int rem;
 
-    for (i = 0; i < ARRAY_SIZE(map_class); i++)
+    for (i = 0; i < ARRAY_SIZE(map_class); i++) {
+        present[i] = !!map_class[i];
+        old[i] = map_class[i] ? map_class[i]->data : empty_data;
         if (map_class[i])
             map_class[i]->data.flags &= ~IDCLASS_CLASS_FLAG_PRESENT;
+    }
+
+    /* 类引用的配置先就位 */
+    idclass_flow_config_push();
 
     blobmsg_for_each_attr(cur, val, rem)
         idclass_map_create_class(cur);
@@ -747,67 +2051,45 @@ void map_manager_set_classes(struct blob_attr *val) {
         map_class[i] = NULL;
     }
 
+    /* 包计数由统计接口维护，不参与比较 */
     for (i = 0; i < ARRAY_SIZE(map_class); i++) {
-        struct idclass_class *data;
-        data = map_class[i] ? &map_class[i]->data : &empty_data;
-        bpf_map_update_elem(fd, &i, data, BPF_ANY);
+        struct idclass_class *cls = map_class[i] ? &map_class[i]->data : &empty_data;
+
+        if (present[i] != !!map_class[i])
+            membership = true;
+        /* 第一次全部写入，覆盖上次运行留在固定 map 中的类 */
+        if (classes_applied &&
+            !memcmp(&old[i], cls, offsetof(struct idclass_class, packets))) {
+            apply_stats.class_skipped++;
+            continue;
+        }
+        keys[n] = i;
+        data[n++] = *cls;
     }
+    /* 写入失败时下一次重新全部写入 */
+    classes_applied = !idclass_map_update_many(fd, keys, sizeof(keys[0]), data,
+                                               sizeof(data[0]), n, BPF_ANY);
+    apply_stats.class_writes += n;
 
     // Update IP mappings to reflect class ID changes
-    map_manager_update_ip_mappings();
+    if (membership)
+        map_manager_update_ip_mappings();
 }
 
-/* External: synchronize flow config to all classes */
+/* External: publish global_flow_config to the classes (a single generation flip) */
 void map_manager_sync_class_config(void) {
-    int fd = map_manager_get_fd_internal(CL_MAP_CLASS);
-    uint32_t key = 0, next;
-    struct idclass_class class;
-
-    while (bpf_map_get_next_key(fd, &key, &next) == 0) {
-        if (bpf_map_lookup_elem(fd, &next, &class) == 0) {
-            memcpy(&class.config, &global_flow_config, sizeof(global_flow_config));
-            bpf_map_update_elem(fd, &next, &class, BPF_EXIST);
-        }
-        key = next;
-    }
+    idclass_flow_config_push();
 }
 
 /* External: lookup DNS entry by hostname */
 int map_manager_lookup_dns_entry(char *host, bool cname, uint8_t *dscp, uint32_t *seq) {
-    struct idclass_map_data data = {
-        .id = CL_MAP_DNS,
-        .addr.dns.pattern = "",
-    };
-    struct idclass_map_entry *e;
-    int ret = -1;
     char *c;
 
-    e = avl_find_ge_element(&map_data, &data, e, avl);
-    if (!e)
+    if (!dns_rules)
         return -1;
     for (c = host; *c; c++)
         *c = tolower(*c);
-    avl_for_element_to_last(&map_data, e, e, avl) {
-        regex_t *regex = &e->data.addr.dns.regex;
-
-        if (e->data.id != CL_MAP_DNS)
-            break;
-        if (!cname && e->data.addr.dns.only_cname)
-            continue;
-        if (e->data.addr.dns.pattern[0] == '/') {
-            if (regexec(regex, host, 0, NULL, 0) != 0)
-                continue;
-        } else {
-            if (fnmatch(e->data.addr.dns.pattern, host, 0))
-                continue;
-        }
-        if (*dscp == 0xff || e->data.addr.dns.seq < *seq) {
-            *dscp = e->data.dscp;
-            *seq = e->data.addr.dns.seq;
-        }
-        ret = 0;
-    }
-    return ret;
+    return dns_matcher_lookup(dns_rules, host, cname, dscp, seq);
 }
 
 /* Helper: get class name by DSCP */
@@ -825,8 +2107,6 @@ static const char *idclass_dscp_to_class_name(uint8_t dscp) {
 void map_manager_add_ip_to_nft_sets(const void *addr, int family, uint32_t ttl, uint8_t dscp) {
     char ip_str[INET6_ADDRSTRLEN];
     const char *class_name;
-    char cmd[512];
-    int ret;
 
     if (inet_ntop(family, addr, ip_str, sizeof(ip_str)) == NULL) {
         ULOG_ERR("inet_ntop failed\n");
@@ -839,27 +2119,30 @@ void map_manager_add_ip_to_nft_sets(const void *addr, int family, uint32_t ttl,
         return;
     }
 
-    snprintf(cmd, sizeof(cmd),
-             "nft add element inet gargoyle-qos-priority upload_%s { %s timeout %ds } 2>/dev/null",
-             class_name, ip_str, ttl);
-    ret = system(cmd);
-    if (ret != 0) {
-        ULOG_WARN("Failed to add to upload set: %s\n", cmd);
-    }
+    /* 合并到下一次批量提交 */
+    nft_batch_add_element(class_name, ip_str, ttl);
+}
 
-    snprintf(cmd, sizeof(cmd),
-             "nft add element inet gargoyle-qos-priority download_%s { %s timeout %ds } 2>/dev/null",
-             class_name, ip_str, ttl);
-    ret = system(cmd);
-    if (ret != 0) {
-        ULOG_WARN("Failed to add to download set: %s\n", cmd);
-    }
+/*
+ * External: lifetime of an address learned from a DNS answer. The record TTL
+ * is used as is, only raised to a floor so that the client gets to open its
+ * connection (after that the datapath keeps the entry alive); 0 means the
+ * default timeout.
+ */
+uint32_t map_manager_dns_lifetime(uint32_t ttl) {
+    if (!ttl)
+        return 0;
+    return ttl < IDCLASS_DNS_MIN_TTL ? IDCLASS_DNS_MIN_TTL : ttl;
+}
+
+/* External: generation of the DNS rule set, changes whenever a rule does */
+uint32_t map_manager_dns_rules_gen(void) {
+    return dns_rules_gen;
 }
 
 /* External: add DNS host mapping (from ubus or dnsmasq) */
 int map_manager_add_dns_host(char *host, const char *addr, const char *type, int ttl) {
     struct idclass_map_data data = { .dscp = 0xff };
-    int prev_timeout = idclass_map_timeout;
     uint32_t lookup_seq = 0;
 
     /* Only used to get DSCP if host is given */
@@ -867,87 +2150,644 @@ int map_manager_add_dns_host(char *host, const char *addr, const char *type, int
         return 0; /* no DSCP found, ignore */
 
     data.user = true;
-    if (!strcmp(type, "A"))
-        data.id = CL_MAP_IPV4_ADDR;
-    else if (!strcmp(type, "AAAA"))
-        data.id = CL_MAP_IPV6_ADDR;
-    else
+    if (strcmp(type, "A") && strcmp(type, "AAAA"))
         return 0;
 
-    if (inet_pton((data.id == CL_MAP_IPV6_ADDR) ? AF_INET6 : AF_INET, addr, &data.addr) != 1)
+    /* addr 可以是 CIDR，把解析出的地址扩展到整个网段 */
+    if (idclass_parse_ip_entry(&data, !strcmp(type, "AAAA"), addr))
         return -1;
 
-    if (ttl)
-        idclass_map_timeout = ttl;
+    data.timeout = map_manager_dns_lifetime(ttl);
     map_manager_set_entry_data(&data);
-    idclass_map_timeout = prev_timeout;
     return 0;
 }
 
-/* Helper: update ip_conn_map from flow_stats_map (periodic) */
-static void idclass_update_ip_conn(struct uloop_timeout *t) {
-    __u32 key = 0, next_key;
+/* Helper: fold one per-CPU flow statistics shard into the merged record */
+static void idclass_flow_stats_merge(struct flow_stats *out, const struct flow_stats *in,
+                                     uint32_t *best_packets) {
+    int i;
+
+    if (!in->first_seen_ms)
+        return;
+
+    out->bytes += in->bytes;
+    out->win_packets += in->win_packets;
+    out->up_bytes += in->up_bytes;
+    out->down_bytes += in->down_bytes;
+    out->pps += in->pps;
+    out->syn_count += in->syn_count;
+    out->ack_count += in->ack_count;
+    out->fin_count += in->fin_count;
+    out->rst_count += in->rst_count;
+    out->data_segs += in->data_segs;
+    out->retrans_count += in->retrans_count;
+    out->reorder_count += in->reorder_count;
+    /* 直方图只看形状，分片相加后饱和到 8 位 */
+    for (i = 0; i < IDCLASS_HIST_BINS; i++) {
+        unsigned int len = out->len_hist[i] + in->len_hist[i];
+        unsigned int iat = out->iat_hist[i] + in->iat_hist[i];
+
+        out->len_hist[i] = len > 0xff ? 0xff : len;
+        out->iat_hist[i] = iat > 0xff ? 0xff : iat;
+    }
+    if (!out->first_seen_ms || (int32_t)(in->first_seen_ms - out->first_seen_ms) < 0)
+        out->first_seen_ms = in->first_seen_ms;
+    if (in->last_seen > out->last_seen)
+        out->last_seen = in->last_seen;
+    /* 各分片各自缓存判定，取最近一次评分的结果 */
+    if ((in->verdict_flags & IDCLASS_VERDICT_VALID) &&
+        (!(out->verdict_flags & IDCLASS_VERDICT_VALID) ||
+         (int32_t)(in->verdict_ms - out->verdict_ms) > 0)) {
+        out->verdict_ms = in->verdict_ms;
+        out->verdict_prio = in->verdict_prio;
+        out->verdict_flags = in->verdict_flags;
+    }
+
+    /* 平滑值不可相加，取包数最多的分片 */
+    if (in->packets > *best_packets) {
+        *best_packets = in->packets;
+        out->avg_pkt_len = in->avg_pkt_len;
+        out->iat_us = in->iat_us;
+        out->tcp_window = in->tcp_window;
+        out->tcp_mss = in->tcp_mss;
+        out->tcp_rtt_us = in->tcp_rtt_us;
+    }
+    out->packets += in->packets;
+}
+
+/* Helper: read a flow statistics record, merging per-CPU shards if needed */
+static int idclass_flow_stats_lookup(const struct flow_key *key, struct flow_stats *stats) {
+    /* 内核按 8 字节对齐复制每 CPU 的值 */
+    size_t stride = (sizeof(*stats) + 7) & ~7;
+    uint32_t best_packets = 0;
+    int i;
+
+    if (!flow_stats_percpu)
+        return bpf_map_lookup_elem(flow_stats_fd, key, stats);
+
+    if (bpf_map_lookup_elem(flow_stats_fd, key, flow_stats_buf) != 0)
+        return -1;
+
+    memset(stats, 0, sizeof(*stats));
+    for (i = 0; i < flow_stats_ncpus; i++)
+        idclass_flow_stats_merge(stats, flow_stats_buf + i * stride, &best_packets);
+
+    return 0;
+}
+
+/*
+ * Helper: lifetime packet and byte totals of a flow. The low words are
+ * summed over the per-CPU shards in 64 bits (the merged record only has 32),
+ * the high words carried by the datapath come from flow_info.
+ */
+static void idclass_flow_totals(const struct flow_key *key, const struct flow_stats *stats,
+                                uint64_t *packets, uint64_t *bytes) {
+    size_t stride = (sizeof(*stats) + 7) & ~7;
+    struct flow_info info;
+    int i;
+
+    *packets = stats->packets;
+    *bytes = stats->bytes;
+
+    if (flow_stats_percpu && bpf_map_lookup_elem(flow_stats_fd, key, flow_stats_buf) == 0) {
+        *packets = *bytes = 0;
+        for (i = 0; i < flow_stats_ncpus; i++) {
+            const struct flow_stats *s = flow_stats_buf + i * stride;
+
+            *packets += s->packets;
+            *bytes += s->bytes;
+        }
+    }
+
+    if (bpf_map_lookup_elem(flow_info_fd, key, &info) == 0) {
+        *packets += (uint64_t)info.packets_hi << 32;
+        *bytes += (uint64_t)info.bytes_hi << 32;
+    }
+}
+
+/* Helper: run the in-kernel idle flow sweeper (deletes flows, decrements ip_conn) */
+static void idclass_sweep_flows(struct uloop_timeout *t) {
+    static uint8_t pkt[ETH_HLEN];
+    DECLARE_LIBBPF_OPTS(bpf_test_run_opts, opts,
+        .data_in = pkt,
+        .data_size_in = sizeof(pkt),
+    );
+    int fd = ebpf_loader_get_sweep_fd();
+
+    if (fd >= 0 && bpf_prog_test_run_opts(fd, &opts) == 0)
+        flows_expired += opts.retval;
+    uloop_timeout_set(t, IDCLASS_SWEEP_INTERVAL * 1000);
+}
+
+/* 连接数校准用的计数节点 */
+struct ip_conn_count {
+    struct avl_node avl;
+    uint8_t addr[16];
+    uint32_t count;     /* 按流表重新统计的连接数 */
+    uint32_t seen;      /* 扫描时 ip_conn_map 中的值，不存在为 0 */
+    bool found;
+};
+
+struct idclass_reconcile_ctx {
+    struct avl_tree counts;
+    struct idclass_key_list flows;      /* 排序后的流 key */
+};
+
+static int ip_conn_count_cmp(const void *k1, const void *k2, void *ptr) {
+    return memcmp(k1, k2, 16);
+}
+
+/* 上一轮发现不一致的客户端，连续两轮相同才修正 */
+static AVL_TREE(ip_conn_suspects, ip_conn_count_cmp, false, NULL);
+
+static int idclass_flow_key_cmp(const void *k1, const void *k2) {
+    return memcmp(k1, k2, sizeof(struct flow_key));
+}
+
+/* Helper: find or add a client node */
+static struct ip_conn_count *idclass_conn_count_get(struct avl_tree *tree, const void *addr) {
+    struct ip_conn_count *c;
+
+    c = avl_find_element(tree, addr, c, avl);
+    if (c)
+        return c;
+    c = calloc(1, sizeof(*c));
+    if (!c)
+        return NULL;
+    memcpy(c->addr, addr, 16);
+    c->avl.key = c->addr;
+    avl_insert(tree, &c->avl);
+    return c;
+}
+
+/* Helper: count flow_info records of live flows per client */
+static void idclass_count_clients_cb(void *keys, void *vals, uint32_t n, void *ctx) {
+    struct idclass_reconcile_ctx *rc = ctx;
+    struct flow_info *info = vals;
+    struct ip_conn_count *c;
+    uint32_t i;
+
+    for (i = 0; i < n; i++) {
+        if (!info[i].client_family ||
+            !bsearch(keys + i * sizeof(struct flow_key), rc->flows.keys, rc->flows.n,
+                     sizeof(struct flow_key), idclass_flow_key_cmp))
+            continue;
+
+        c = idclass_conn_count_get(&rc->counts, info[i].client_ip);
+        if (c)
+            c->count++;
+    }
+}
+
+/* Helper: record the ip_conn_map value next to the recount */
+static void idclass_check_conn_cb(void *keys, void *vals, uint32_t n, void *ctx) {
+    struct idclass_reconcile_ctx *rc = ctx;
+    uint32_t *cnt = vals;
+    struct ip_conn_count *c;
+    uint32_t i;
+
+    for (i = 0; i < n; i++) {
+        /* 已没有流的客户端以 count 0 加入，修正时删除 */
+        c = idclass_conn_count_get(&rc->counts, keys + i * 16);
+        if (!c)
+            continue;
+        c->found = true;
+        c->seen = cnt[i];
+    }
+}
+
+/*
+ * Helper: write one correction unless the datapath touched the entry since
+ * the scan. conn_inc/conn_dec keep running while the maps are walked, so a
+ * value that moved is left alone and looked at again on the next pass.
+ */
+static bool idclass_conn_fix(const struct ip_conn_count *c) {
+    uint32_t now = 0;
+
+    if (bpf_map_lookup_elem(ip_conn_fd, c->addr, &now) && errno != ENOENT)
+        return false;
+    if (now != c->seen)
+        return false;
+    if (!c->count)
+        return !bpf_map_delete_elem(ip_conn_fd, c->addr);
+    return !bpf_map_update_elem(ip_conn_fd, c->addr, &c->count, BPF_ANY);
+}
+
+/*
+ * Helper: recount connections per client from the flow table and correct
+ * ip_conn_map in place. The datapath keeps the counts up to date on its own,
+ * this only repairs drift from LRU evictions, so it runs rarely. A flow that
+ * is created or swept while the maps are walked shows up as a one-off
+ * mismatch; only the same mismatch on two consecutive passes is corrected.
+ */
+static void idclass_reconcile_ip_conn(struct uloop_timeout *t) {
+    struct idclass_reconcile_ctx rc = {
+        .flows.key_size = sizeof(struct flow_key),
+    };
+    size_t stats_size = flow_stats_percpu ?
+        flow_stats_ncpus * ((sizeof(struct flow_stats) + 7) & ~7) :
+        sizeof(struct flow_stats);
+    uint64_t start = idclass_gettime_us();
+    struct ip_conn_count *c, *prev, *tmp;
+    struct avl_tree next;
+    uint64_t entries;
+
+    avl_init(&rc.counts, ip_conn_count_cmp, false, NULL);
+
+    /* flow_info 与流表各自 LRU 淘汰，只统计流表中仍存在的流 */
+    entries = idclass_map_walk(flow_stats_fd, sizeof(struct flow_key), stats_size,
+                               idclass_collect_keys_cb, &rc.flows);
+    qsort(rc.flows.keys, rc.flows.n, sizeof(struct flow_key), idclass_flow_key_cmp);
+    entries += idclass_map_walk(flow_info_fd, sizeof(struct flow_key), sizeof(struct flow_info),
+                                idclass_count_clients_cb, &rc);
+    entries += idclass_map_walk(ip_conn_fd, 16, sizeof(uint32_t),
+                                idclass_check_conn_cb, &rc);
+
+    avl_init(&next, ip_conn_count_cmp, false, NULL);
+    avl_remove_all_elements(&rc.counts, c, avl, tmp) {
+        if (c->found && c->seen == c->count && c->count) {
+            free(c);
+            continue;
+        }
+        prev = avl_find_element(&ip_conn_suspects, c->addr, prev, avl);
+        if (!prev || prev->seen != c->seen || prev->count != c->count) {
+            avl_insert(&next, &c->avl);     /* 留到下一轮确认 */
+            continue;
+        }
+        if (idclass_conn_fix(c))
+            ip_conn_corrected++;
+        free(c);
+    }
+    avl_remove_all_elements(&ip_conn_suspects, c, avl, tmp)
+        free(c);
+    avl_remove_all_elements(&next, c, avl, tmp)
+        avl_insert(&ip_conn_suspects, &c->avl);
+    free(rc.flows.keys);
+
+    idclass_bulk_done(BULK_IP_CONN, start, entries);
+    uloop_timeout_set(t, IDCLASS_RECONCILE_INTERVAL * 1000);
+}
+
+/*
+ * Warm restart: map_data is written to a compact binary snapshot on tmpfs
+ * when the daemon stops and read back at start-up. Each record is a fixed
+ * header followed by the address (key size of its map) or the DNS pattern.
+ */
+#define IDCLASS_SNAPSHOT_PATH       "/var/run/idclass.snapshot"
+#define IDCLASS_SNAPSHOT_MAGIC      0x53434449  /* "IDCS" */
+#define IDCLASS_SNAPSHOT_VERSION    1
+#define IDCLASS_SNAPSHOT_MAX_LEN    1024
+
+#define IDCLASS_SNAP_FILE           (1 << 0)
+#define IDCLASS_SNAP_USER           (1 << 1)
+#define IDCLASS_SNAP_ONLY_CNAME     (1 << 2)
+
+/* 分类恢复时间的测量：每秒检查一次，最多检查的次数和允许的偏差（百分点） */
+#define IDCLASS_WARMUP_MAX_CHECKS   300
+#define IDCLASS_WARMUP_TOLERANCE    5
+#define IDCLASS_WARMUP_DEFAULT_PCT  90
+
+struct idclass_snapshot_hdr {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t mature_pct;        /* 保存时达到采样包数的流所占百分比 */
+    uint32_t count;
+    uint32_t saved;             /* 保存时的单调时钟（秒） */
+};
+
+struct idclass_snapshot_rec {
+    uint8_t id;
+    uint8_t flags;              /* IDCLASS_SNAP_* */
+    uint8_t dscp;
+    uint8_t file_dscp;
+    uint32_t remaining;         /* 用户条目剩余有效期（秒），~0 为永久 */
+    uint16_t len;               /* 其后地址或域名的字节数 */
+} __attribute__((packed));
+
+static struct uloop_timeout warmup_timer;
+
+/* Helper: percentage of flows that have seen game_sample_packets packets */
+static uint32_t idclass_flow_maturity(uint32_t *flows) {
     struct flow_stats stats;
-    __u32 cur_time = idclass_gettime();
-    int fd = ip_conn_fd;
-    struct ip_key {
-        __u8 addr[16];
-    } cur_key = {0}, next_key_ip;
-
-    // Clear ip_conn_map
-    while (bpf_map_get_next_key(fd, &cur_key, &next_key_ip) == 0) {
-        bpf_map_delete_elem(fd, &next_key_ip);
-        cur_key = next_key_ip;
-    }
-
-    // Scan flow_stats_map
-    key = 0;
-    while (bpf_map_get_next_key(flow_stats_fd, &key, &next_key) == 0) {
-        if (bpf_map_lookup_elem(flow_stats_fd, &next_key, &stats) == 0) {
-            __u64 last_seen_sec = stats.last_seen / 1000000000ULL;
-            if (cur_time - last_seen_sec <= idclass_active_timeout) {
-                if (stats.client_ip[0] != 0 || stats.client_ip[1] != 0) {
-                    struct ip_key ipkey;
-                    memcpy(ipkey.addr, stats.client_ip, 16);
-                    uint32_t cnt_val;
-                    if (bpf_map_lookup_elem(fd, &ipkey, &cnt_val) == 0) {
-                        uint32_t new_cnt = cnt_val + 1;
-                        bpf_map_update_elem(fd, &ipkey, &new_cnt, BPF_EXIST);
-                    } else {
-                        uint32_t one = 1;
-                        bpf_map_update_elem(fd, &ipkey, &one, BPF_NOEXIST);
-                    }
-                }
-            }
+    struct flow_key key, next_key;
+    void *prev = NULL;
+    uint32_t n = 0, mature = 0;
+
+    *flows = 0;
+    if (flow_stats_fd < 0)
+        return 0;
+
+    while (bpf_map_get_next_key(flow_stats_fd, prev, &next_key) == 0) {
+        if (idclass_flow_stats_lookup(&next_key, &stats) == 0) {
+            n++;
+            if (stats.packets >= global_flow_config.game_sample_packets)
+                mature++;
         }
         key = next_key;
+        prev = &key;
+    }
+
+    *flows = n;
+    return n ? mature * 100 / n : 0;
+}
+
+/* Helper: write map_data to the snapshot file (atomically via rename) */
+static void idclass_snapshot_save(void) {
+    struct idclass_snapshot_hdr hdr = {
+        .magic = IDCLASS_SNAPSHOT_MAGIC,
+        .version = IDCLASS_SNAPSHOT_VERSION,
+    };
+    struct idclass_map_entry *e;
+    uint32_t now = idclass_gettime(), flows;
+    FILE *f;
+
+    f = fopen(IDCLASS_SNAPSHOT_PATH ".tmp", "w");
+    if (!f) {
+        ULOG_WARN("Failed to write %s: %s\n", IDCLASS_SNAPSHOT_PATH, strerror(errno));
+        return;
+    }
+
+    hdr.mature_pct = idclass_flow_maturity(&flows);
+    hdr.saved = now;
+    fwrite(&hdr, sizeof(hdr), 1, f);
+
+    avl_for_each_element(&map_data, e, avl) {
+        struct idclass_snapshot_rec rec = {
+            .id = e->data.id,
+            .dscp = e->data.dscp,
+            .file_dscp = e->data.file_dscp,
+        };
+        const void *addr = &e->data.addr;
+
+        if (e->data.file)
+            rec.flags |= IDCLASS_SNAP_FILE;
+        if (e->data.user &&
+            (e->timeout == ~0 || (int32_t)(e->timeout - now) > 0)) {
+            rec.flags |= IDCLASS_SNAP_USER;
+            rec.remaining = e->timeout == ~0 ? ~0 : e->timeout - now;
+        }
+        if (!rec.flags)
+            continue;
+
+        if (e->data.id == CL_MAP_DNS) {
+            addr = e->data.addr.dns.pattern;
+            rec.len = strlen(e->data.addr.dns.pattern);
+            if (rec.len > IDCLASS_SNAPSHOT_MAX_LEN)
+                continue;
+            if (e->data.addr.dns.only_cname)
+                rec.flags |= IDCLASS_SNAP_ONLY_CNAME;
+        } else {
+            rec.len = idclass_map_key_size(e->data.id);
+        }
+
+        fwrite(&rec, sizeof(rec), 1, f);
+        fwrite(addr, rec.len, 1, f);
+        hdr.count++;
+    }
+
+    /* 最后写入记录数 */
+    rewind(f);
+    fwrite(&hdr, sizeof(hdr), 1, f);
+    if (ferror(f) | fclose(f) ||
+        rename(IDCLASS_SNAPSHOT_PATH ".tmp", IDCLASS_SNAPSHOT_PATH)) {
+        ULOG_WARN("Failed to write %s\n", IDCLASS_SNAPSHOT_PATH);
+        unlink(IDCLASS_SNAPSHOT_PATH ".tmp");
+    }
+}
+
+/* Helper: restore map_data from the snapshot, user lifetimes keep running */
+static void idclass_snapshot_load(void) {
+    struct idclass_snapshot_hdr hdr;
+    struct idclass_snapshot_rec rec;
+    char buf[IDCLASS_SNAPSHOT_MAX_LEN + 1];
+    uint32_t now = idclass_gettime(), elapsed, i;
+    FILE *f;
+
+    f = fopen(IDCLASS_SNAPSHOT_PATH, "r");
+    if (!f)
+        return;
+
+    if (fread(&hdr, sizeof(hdr), 1, f) != 1 ||
+        hdr.magic != IDCLASS_SNAPSHOT_MAGIC ||
+        hdr.version != IDCLASS_SNAPSHOT_VERSION || hdr.saved > now) {
+        fprintf(stderr, "Ignoring incompatible snapshot %s\n", IDCLASS_SNAPSHOT_PATH);
+        fclose(f);
+        return;
+    }
+    elapsed = now - hdr.saved;
+    restart_stats.target_pct = hdr.mature_pct;
+
+    for (i = 0; i < hdr.count; i++) {
+        struct idclass_map_data data = {};
+
+        if (fread(&rec, sizeof(rec), 1, f) != 1 ||
+            rec.len > IDCLASS_SNAPSHOT_MAX_LEN ||
+            fread(buf, 1, rec.len, f) != rec.len)
+            break;
+
+        if (rec.id == CL_MAP_DNS) {
+            buf[rec.len] = 0;
+            data.addr.dns.pattern = buf;
+            data.addr.dns.only_cname = !!(rec.flags & IDCLASS_SNAP_ONLY_CNAME);
+        } else if (rec.id < CL_MAP_DNS && rec.len == idclass_map_key_size(rec.id)) {
+            memcpy(&data.addr, buf, rec.len);
+        } else {
+            continue;
+        }
+        data.id = rec.id;
+
+        /* 先恢复文件部分，用户部分的值优先 */
+        if (rec.flags & IDCLASS_SNAP_FILE) {
+            data.file = true;
+            data.dscp = rec.file_dscp;
+            map_manager_set_entry_data(&data);
+        }
+        if ((rec.flags & IDCLASS_SNAP_USER) &&
+            (rec.remaining == ~0 || rec.remaining > elapsed)) {
+            data.file = false;
+            data.dscp = rec.dscp;
+            data.timeout = rec.remaining == ~0 ? ~0 : rec.remaining - elapsed;
+            map_manager_set_entry_data(&data);
+        }
+        restart_stats.restored++;
     }
-    uloop_timeout_set(t, 1000);
+    fclose(f);
+}
+
+/* 固定地址 map 中没有对应用户态条目的 key */
+struct idclass_orphan_ctx {
+    enum idclass_map_id id;
+    struct idclass_key_list l;
+};
+
+static void idclass_collect_orphans_cb(void *keys, void *vals, uint32_t n, void *ctx) {
+    struct idclass_orphan_ctx *oc = ctx;
+    uint32_t i;
+
+    for (i = 0; i < n; i++) {
+        struct idclass_map_data data = { .id = oc->id };
+
+        memcpy(&data.addr, keys + i * oc->l.key_size, oc->l.key_size);
+        if (!avl_find(&map_data, &data))
+            idclass_key_list_add(&oc->l, keys + i * oc->l.key_size);
+    }
+}
+
+/*
+ * Helper: delete addresses from the reused maps that no userspace entry
+ * owns (e.g. premarked by the datapath after the snapshot was written),
+ * nothing would ever expire them.
+ */
+static uint32_t idclass_remove_orphans(void) {
+    enum idclass_map_id id;
+    uint32_t total = 0;
+
+    for (id = CL_MAP_IPV4_ADDR; id <= CL_MAP_IPV6_PREFIX; id++) {
+        struct idclass_orphan_ctx oc = {
+            .id = id,
+            .l.key_size = idclass_map_key_size(id),
+        };
+        int fd = map_manager_get_fd_internal(id);
+
+        idclass_map_walk(fd, oc.l.key_size, sizeof(struct idclass_ip_map_val),
+                         idclass_collect_orphans_cb, &oc);
+        idclass_key_list_delete(fd, &oc.l);
+        total += oc.l.n;
+        free(oc.l.keys);
+    }
+    return total;
+}
+
+/*
+ * Helper: recovery measurement. Classification is considered recovered once
+ * the share of flows that have seen enough packets to be scored is back
+ * within IDCLASS_WARMUP_TOLERANCE points of the share before the restart.
+ */
+static void idclass_warmup_cb(struct uloop_timeout *t) {
+    uint32_t flows, pct = idclass_flow_maturity(&flows);
+
+    restart_stats.checks++;
+    if (flows && pct + IDCLASS_WARMUP_TOLERANCE >= restart_stats.target_pct) {
+        restart_stats.ready_pct = pct;
+        restart_stats.ready_ms = (idclass_gettime_us() - restart_stats.start_us) / 1000;
+        if (!restart_stats.ready_ms)
+            restart_stats.ready_ms = 1;
+        ULOG_INFO("classification recovered after %u ms (%u%% of %u flows sampled)\n",
+                  restart_stats.ready_ms, pct, flows);
+        return;
+    }
+    if (restart_stats.checks < IDCLASS_WARMUP_MAX_CHECKS)
+        uloop_timeout_set(t, 1000);
+}
+
+/* Helper: take over the state of the previous run (snapshot and reused maps) */
+static void idclass_warm_start(void) {
+    uint64_t start = idclass_gettime_us();
+    struct global_config gcfg;
+    uint32_t key = 0;
+
+    restart_stats.warm = ebpf_loader_maps_reused();
+    if (restart_stats.warm) {
+        /* 数据路径正在使用的配置代 */
+        if (!bpf_map_lookup_elem(map_manager_get_fd_internal(CL_MAP_GLOBAL_CONFIG),
+                                 &key, &gcfg)) {
+            flow_config_gen = gcfg.config_gen & 1;
+            flow_config_flip_us = start;
+        }
+        idclass_flow_maturity(&restart_stats.flows_kept);
+    }
+
+    idclass_snapshot_load();
+    if (restart_stats.warm)
+        restart_stats.orphans = idclass_remove_orphans();
+    restart_stats.restore_us = idclass_gettime_us() - start;
+}
+
+/* External: save state for the next warm restart */
+void map_manager_stop(void) {
+    uloop_timeout_cancel(&warmup_timer);
+    if (ebpf_loader_warm_restart())
+        idclass_snapshot_save();
 }
 
 /* External: initialize map manager */
 int map_manager_init(void) {
     int i;
+
+    restart_stats.start_us = idclass_gettime_us();
+    restart_stats.target_pct = IDCLASS_WARMUP_DEFAULT_PCT;
     for (i = 0; i < __CL_MAP_MAX; i++)
         idclass_map_fds[i] = -1;
 
     for (i = 0; i < __CL_MAP_MAX; i++) {
+        /* CL_MAP_DNS 只存在于用户态 */
+        if (!idclass_map_path(i))
+            continue;
         if (map_manager_get_fd_internal(i) < 0)
             return -1;
     }
 
-    idclass_map_clear_list(CL_MAP_IPV4_ADDR);
-    idclass_map_clear_list(CL_MAP_IPV6_ADDR);
+    /* 复用的 map 保留地址，没有用户态条目的在恢复快照后删除 */
+    if (!ebpf_loader_maps_reused()) {
+        idclass_map_clear_list(CL_MAP_IPV4_ADDR);
+        idclass_map_clear_list(CL_MAP_IPV6_ADDR);
+        idclass_map_clear_list(CL_MAP_IPV4_PREFIX);
+        idclass_map_clear_list(CL_MAP_IPV6_PREFIX);
+    }
+    idclass_map_clear_list(CL_MAP_DNS_NAMES);
+    dns_rules = dns_matcher_new();
+    if (!dns_rules)
+        return -1;
+    if (nft_batch_init())
+        ULOG_WARN("nftables set updates disabled\n");
     map_manager_reset_config();
 
-    flow_stats_fd = bpf_obj_get("/sys/fs/bpf/idclass_data/flow_stats_map");
+    flow_stats_percpu = !!(ebpf_loader_get_flags() & IDCLASS_PERCPU_STATS);
+    if (flow_stats_percpu) {
+        flow_stats_ncpus = libbpf_num_possible_cpus();
+        if (flow_stats_ncpus < 1)
+            flow_stats_ncpus = 1;
+        flow_stats_buf = calloc(flow_stats_ncpus, (sizeof(struct flow_stats) + 7) & ~7);
+        if (!flow_stats_buf)
+            return -1;
+        flow_stats_fd = bpf_obj_get(CLASSIFY_DATA_PATH "/flow_stats_percpu");
+    } else {
+        flow_stats_fd = bpf_obj_get(CLASSIFY_DATA_PATH "/flow_stats_map");
+    }
     if (flow_stats_fd < 0) {
-        fprintf(stderr, "Failed to open flow_stats_map\n");
+        fprintf(stderr, "Failed to open flow statistics map\n");
+        return -1;
+    }
+    flow_info_fd = bpf_obj_get(CLASSIFY_DATA_PATH "/flow_info_map");
+    if (flow_info_fd < 0) {
+        fprintf(stderr, "Failed to open flow_info_map\n");
         return -1;
     }
+    classify_counters_fd = bpf_obj_get(CLASSIFY_DATA_PATH "/classify_counters");
+    if (classify_counters_fd < 0)
+        fprintf(stderr, "Failed to open classify_counters, verdict stats disabled\n");
+    client_rtt_fd = bpf_obj_get(CLASSIFY_DATA_PATH "/client_rtt_map");
+    if (client_rtt_fd < 0)
+        fprintf(stderr, "Failed to open client_rtt_map, latency stats disabled\n");
+    wan_loss_fd = bpf_obj_get(CLASSIFY_DATA_PATH "/wan_loss_map");
+    if (wan_loss_fd < 0)
+        fprintf(stderr, "Failed to open wan_loss_map, loss stats disabled\n");
+    idclass_map_note_type(flow_stats_fd);
+    idclass_map_note_type(flow_info_fd);
+    idclass_map_note_type(classify_counters_fd);
+    idclass_map_note_type(client_rtt_fd);
+    idclass_map_note_type(wan_loss_fd);
     ip_conn_fd = map_manager_get_fd_internal(CL_MAP_IP_CONN);
-    ip_conn_timer.cb = idclass_update_ip_conn;
-    uloop_timeout_set(&ip_conn_timer, 1000);
+    idclass_map_timer.cb = idclass_map_timer_cb;
+    flow_sweep_timer.cb = idclass_sweep_flows;
+    uloop_timeout_set(&flow_sweep_timer, IDCLASS_SWEEP_INTERVAL * 1000);
+    ip_conn_timer.cb = idclass_reconcile_ip_conn;
+    uloop_timeout_set(&ip_conn_timer, IDCLASS_RECONCILE_INTERVAL * 1000);
+
+    if (ebpf_loader_warm_restart())
+        idclass_warm_start();
+    warmup_timer.cb = idclass_warmup_cb;
+    uloop_timeout_set(&warmup_timer, 10);
 
     return 0;
 }
@@ -0,0 +1,173 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * nft_batch.c - batched nftables set updates
+ *
+ * Collects "add element" commands for the gargoyle-qos-priority sets and
+ * hands them to libnftables in one transaction, either a few milliseconds
+ * after the first pending element or as soon as a batch is full. This
+ * replaces forking "nft" twice per DNS answer.
+ */
+#include "common.h"
+#include <time.h>
+#include <nftables/libnftables.h>
+
+#define NFT_BATCH_FLUSH_MS  5
+#define NFT_BATCH_MAX       256
+#define NFT_BATCH_TABLE     "inet gargoyle-qos-priority"
+
+static struct nft_ctx *nft;
+static struct uloop_timeout nft_flush_timer;
+static char *nft_buf;
+static size_t nft_buf_len, nft_buf_alloc;
+static uint32_t nft_pending;
+
+static struct {
+    uint64_t queued;
+    uint64_t flushes;
+    uint64_t errors;
+    uint32_t max_depth;
+    uint32_t last_us;
+    uint32_t max_us;
+} nft_stats;
+
+/* Helper: monotonic time in microseconds */
+static uint64_t nft_batch_now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+/* Helper: append one command line to the pending batch */
+static int nft_batch_append(const char *line, size_t len) {
+    if (nft_buf_len + len + 1 > nft_buf_alloc) {
+        size_t alloc = nft_buf_alloc ? nft_buf_alloc * 2 : 16384;
+        char *p;
+
+        while (alloc < nft_buf_len + len + 1)
+            alloc *= 2;
+        p = realloc(nft_buf, alloc);
+        if (!p)
+            return -1;
+        nft_buf = p;
+        nft_buf_alloc = alloc;
+    }
+    memcpy(nft_buf + nft_buf_len, line, len);
+    nft_buf_len += len;
+    nft_buf[nft_buf_len] = 0;
+    return 0;
+}
+
+/*
+ * Helper: 整批失败（例如某个类没有对应的 set）时逐行重试，
+ * 保持原先每条命令独立生效的行为
+ */
+static void nft_batch_retry_lines(void) {
+    char *line, *next;
+
+    for (line = nft_buf; line && *line; line = next) {
+        next = strchr(line, '\n');
+        if (next)
+            *next++ = 0;
+        if (nft_run_cmd_from_buffer(nft, line))
+            nft_stats.errors++;
+    }
+}
+
+/* External: send all pending set updates in one transaction */
+void nft_batch_flush(void) {
+    uint64_t start;
+    uint32_t us;
+
+    uloop_timeout_cancel(&nft_flush_timer);
+    if (!nft_pending)
+        return;
+
+    start = nft_batch_now_us();
+    if (nft_run_cmd_from_buffer(nft, nft_buf))
+        nft_batch_retry_lines();
+    us = nft_batch_now_us() - start;
+
+    nft_stats.flushes++;
+    nft_stats.last_us = us;
+    if (us > nft_stats.max_us)
+        nft_stats.max_us = us;
+
+    nft_buf_len = 0;
+    nft_pending = 0;
+}
+
+static void nft_batch_timer_cb(struct uloop_timeout *t) {
+    nft_batch_flush();
+}
+
+/* External: queue an address for the upload_/download_ sets of a class */
+void nft_batch_add_element(const char *class_name, const char *addr, uint32_t ttl) {
+    char line[256];
+    int len;
+
+    if (!nft)
+        return;
+
+    len = snprintf(line, sizeof(line),
+                   "add element " NFT_BATCH_TABLE " upload_%s { %s timeout %us }\n"
+                   "add element " NFT_BATCH_TABLE " download_%s { %s timeout %us }\n",
+                   class_name, addr, ttl, class_name, addr, ttl);
+    if (len >= sizeof(line) || nft_batch_append(line, len)) {
+        nft_stats.errors++;
+        return;
+    }
+
+    nft_stats.queued++;
+    if (++nft_pending > nft_stats.max_depth)
+        nft_stats.max_depth = nft_pending;
+
+    if (nft_pending >= NFT_BATCH_MAX)
+        nft_batch_flush();
+    else if (!nft_flush_timer.pending)
+        uloop_timeout_set(&nft_flush_timer, NFT_BATCH_FLUSH_MS);
+}
+
+/* External: add batch statistics to get_stats output */
+void nft_batch_stats(struct blob_buf *b, bool reset) {
+    void *c;
+
+    c = blobmsg_open_table(b, "nft");
+    blobmsg_add_u32(b, "pending", nft_pending);
+    blobmsg_add_u32(b, "max_depth", nft_stats.max_depth);
+    blobmsg_add_u64(b, "queued", nft_stats.queued);
+    blobmsg_add_u64(b, "flushes", nft_stats.flushes);
+    blobmsg_add_u64(b, "errors", nft_stats.errors);
+    blobmsg_add_u32(b, "last_flush_us", nft_stats.last_us);
+    blobmsg_add_u32(b, "max_flush_us", nft_stats.max_us);
+    blobmsg_close_table(b, c);
+
+    if (reset)
+        memset(&nft_stats, 0, sizeof(nft_stats));
+}
+
+/* External: create the libnftables context */
+int nft_batch_init(void) {
+    nft = nft_ctx_new(NFT_CTX_DEFAULT);
+    if (!nft) {
+        ULOG_ERR("Failed to create nftables context\n");
+        return -1;
+    }
+    /* 输出与错误信息不打印到终端 */
+    nft_ctx_buffer_output(nft);
+    nft_ctx_buffer_error(nft);
+    nft_flush_timer.cb = nft_batch_timer_cb;
+    return 0;
+}
+
+/* External: flush pending updates and free the context */
+void nft_batch_stop(void) {
+    if (!nft)
+        return;
+
+    nft_batch_flush();
+    nft_ctx_free(nft);
+    nft = NULL;
+    free(nft_buf);
+    nft_buf = NULL;
+    nft_buf_len = nft_buf_alloc = 0;
+}
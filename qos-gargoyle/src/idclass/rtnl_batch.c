@@ -0,0 +1,710 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * rtnl_batch.c - batched rtnetlink requests for qdiscs, filters and links
+ *
+ * Builds clsact/cake qdiscs, cls_bpf filters (attached by program fd), IFB
+ * links and mirred redirects as rtnetlink messages and sends a whole batch
+ * with a single sendmsg(). Every message carries NLM_F_ACK and its own
+ * sequence number, so the acknowledgements can be matched back to the step
+ * that produced them and each failure is reported by name. Filter queries
+ * in a batch get their reply the same way, before the acknowledgement.
+ * A step that does not fit into the batch is logged by name and its queue
+ * call returns -1; the rest of the batch is still sent.
+ */
+#include "common.h"
+#include <linux/rtnetlink.h>
+#include <linux/if_link.h>
+#include <linux/pkt_sched.h>
+#include <linux/pkt_cls.h>
+#include <linux/tc_act/tc_mirred.h>
+#include <stdarg.h>
+#include <strings.h>
+#include <poll.h>
+
+#define RTNL_BATCH_SIZE     32768
+#define RTNL_BATCH_STEPS    32
+#define RTNL_STEP_NAME      64
+#define RTNL_ACK_TIMEOUT_MS 100
+
+struct rtnl_step {
+    uint32_t seq;
+    bool ignore_error;
+    int error;
+    uint32_t *prog_id;          /* 过滤器查询：应答中的 BPF 程序 id */
+    char name[RTNL_STEP_NAME];
+};
+
+static int rtnl_fd = -1;
+static uint32_t rtnl_seq;
+static char rtnl_buf[RTNL_BATCH_SIZE] __attribute__((aligned(NLMSG_ALIGNTO)));
+static size_t rtnl_len;
+static struct rtnl_step rtnl_steps[RTNL_BATCH_STEPS];
+static int rtnl_n_steps;
+static int rtnl_dropped;        /* 批次写满而没有加入的步骤数 */
+static bool rtnl_overflow;      /* 当前消息写不下 */
+
+/* Helper: log a step that did not fit into the batch */
+static void rtnl_drop(const char *name, bool ignore_error) {
+    ULOG_ERR("rtnetlink batch full, step dropped: %s\n", name);
+    if (!ignore_error)
+        rtnl_dropped++;
+}
+
+/* Helper: start a new message, returns NULL if the batch is full */
+static struct nlmsghdr *rtnl_msg(uint16_t type, uint16_t flags, const void *hdr,
+                                 size_t hdr_len, bool ignore_error,
+                                 const char *fmt, ...) {
+    char name[RTNL_STEP_NAME];
+    struct nlmsghdr *nlh;
+    struct rtnl_step *step;
+    va_list ap;
+
+    va_start(ap, fmt);
+    vsnprintf(name, sizeof(name), fmt, ap);
+    va_end(ap);
+
+    rtnl_overflow = false;
+    if (rtnl_n_steps == RTNL_BATCH_STEPS ||
+        rtnl_len + NLMSG_SPACE(hdr_len) > sizeof(rtnl_buf)) {
+        rtnl_drop(name, ignore_error);
+        return NULL;
+    }
+
+    nlh = (struct nlmsghdr *)(rtnl_buf + rtnl_len);
+    memset(nlh, 0, NLMSG_SPACE(hdr_len));
+    nlh->nlmsg_len = NLMSG_LENGTH(hdr_len);
+    nlh->nlmsg_type = type;
+    nlh->nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK | flags;
+    nlh->nlmsg_seq = ++rtnl_seq;
+    memcpy(NLMSG_DATA(nlh), hdr, hdr_len);
+
+    step = &rtnl_steps[rtnl_n_steps++];
+    step->seq = nlh->nlmsg_seq;
+    step->ignore_error = ignore_error;
+    step->error = 0;
+    step->prog_id = NULL;
+    memcpy(step->name, name, sizeof(step->name));
+    return nlh;
+}
+
+/* Helper: close the current message and account it in the batch */
+static int rtnl_msg_end(struct nlmsghdr *nlh) {
+    if (!nlh)
+        return -1;
+    if (rtnl_overflow) {
+        /* 消息写不下，撤销整条 */
+        rtnl_n_steps--;
+        rtnl_drop(rtnl_steps[rtnl_n_steps].name, rtnl_steps[rtnl_n_steps].ignore_error);
+        return -1;
+    }
+    rtnl_len += NLMSG_ALIGN(nlh->nlmsg_len);
+    return 0;
+}
+
+/* Helper: append an attribute to the current message */
+static struct rtattr *rtnl_attr(struct nlmsghdr *nlh, uint16_t type,
+                                const void *data, size_t len) {
+    struct rtattr *rta;
+    size_t ofs = NLMSG_ALIGN(nlh->nlmsg_len);
+
+    if (rtnl_len + ofs + RTA_SPACE(len) > sizeof(rtnl_buf)) {
+        rtnl_overflow = true;
+        return NULL;
+    }
+
+    rta = (struct rtattr *)((char *)nlh + ofs);
+    rta->rta_type = type;
+    rta->rta_len = RTA_LENGTH(len);
+    if (len)
+        memcpy(RTA_DATA(rta), data, len);
+    memset((char *)RTA_DATA(rta) + len, 0, RTA_SPACE(len) - RTA_LENGTH(len));
+    nlh->nlmsg_len = ofs + RTA_SPACE(len);
+    return rta;
+}
+
+static void rtnl_attr_u32(struct nlmsghdr *nlh, uint16_t type, uint32_t val) {
+    rtnl_attr(nlh, type, &val, sizeof(val));
+}
+
+static void rtnl_attr_str(struct nlmsghdr *nlh, uint16_t type, const char *str) {
+    rtnl_attr(nlh, type, str, strlen(str) + 1);
+}
+
+/* Helper: open a nested attribute, closed again by rtnl_nest_end() */
+static struct rtattr *rtnl_nest_start(struct nlmsghdr *nlh, uint16_t type) {
+    return rtnl_attr(nlh, type, NULL, 0);
+}
+
+static void rtnl_nest_end(struct nlmsghdr *nlh, struct rtattr *nest) {
+    if (nest)
+        nest->rta_len = (char *)nlh + nlh->nlmsg_len - (char *)nest;
+}
+
+/* Helper: tcmsg for a qdisc or filter on ifindex */
+static void rtnl_tcmsg(struct tcmsg *t, int ifindex, uint32_t parent,
+                       uint32_t handle, uint32_t info) {
+    memset(t, 0, sizeof(*t));
+    t->tcm_family = AF_UNSPEC;
+    t->tcm_ifindex = ifindex;
+    t->tcm_parent = parent;
+    t->tcm_handle = handle;
+    t->tcm_info = info;
+}
+
+static uint32_t rtnl_filter_parent(bool egress) {
+    return TC_H_MAKE(TC_H_CLSACT, egress ? TC_H_MIN_EGRESS : TC_H_MIN_INGRESS);
+}
+
+/* External: drop everything queued so far and start a new batch */
+void rtnl_batch_begin(void) {
+    rtnl_len = 0;
+    rtnl_n_steps = 0;
+    rtnl_dropped = 0;
+    rtnl_overflow = false;
+}
+
+/* External: queue "qdisc add clsact" (an existing clsact is not an error) */
+int rtnl_add_clsact(const char *ifname, int ifindex) {
+    struct nlmsghdr *nlh;
+    struct tcmsg t;
+
+    rtnl_tcmsg(&t, ifindex, TC_H_CLSACT, TC_H_MAKE(TC_H_CLSACT, 0), 0);
+    nlh = rtnl_msg(RTM_NEWQDISC, NLM_F_CREATE | NLM_F_EXCL, &t, sizeof(t), true,
+                   "add clsact on %s", ifname);
+    if (!nlh)
+        return -1;
+    rtnl_attr_str(nlh, TCA_KIND, "clsact");
+    return rtnl_msg_end(nlh);
+}
+
+/* External: queue "qdisc del root" */
+int rtnl_del_root_qdisc(const char *ifname, int ifindex) {
+    struct nlmsghdr *nlh;
+    struct tcmsg t;
+
+    rtnl_tcmsg(&t, ifindex, TC_H_ROOT, 0, 0);
+    nlh = rtnl_msg(RTM_DELQDISC, 0, &t, sizeof(t), true, "del root qdisc on %s", ifname);
+    return rtnl_msg_end(nlh);
+}
+
+/* External: queue "filter del <dir> prio <prio>" */
+int rtnl_del_filter(const char *ifname, int ifindex, bool egress, int prio) {
+    struct nlmsghdr *nlh;
+    struct tcmsg t;
+
+    rtnl_tcmsg(&t, ifindex, rtnl_filter_parent(egress), 0, TC_H_MAKE(prio << 16, 0));
+    nlh = rtnl_msg(RTM_DELTFILTER, 0, &t, sizeof(t), true, "del %sgress filter %x on %s",
+                   egress ? "e" : "in", prio, ifname);
+    return rtnl_msg_end(nlh);
+}
+
+/* Helper: queue a direct-action cls_bpf filter with the fixed handle */
+static int rtnl_bpf_filter(const char *ifname, int ifindex, bool egress, int prio,
+                            int prog_fd, const char *prog_name, uint16_t flags,
+                            const char *op) {
+    struct nlmsghdr *nlh;
+    struct rtattr *opts;
+    struct tcmsg t;
+
+    rtnl_tcmsg(&t, ifindex, rtnl_filter_parent(egress), IDCLASS_FILTER_HANDLE,
+               TC_H_MAKE(prio << 16, htons(ETH_P_ALL)));
+    nlh = rtnl_msg(RTM_NEWTFILTER, flags, &t, sizeof(t), false,
+                   "%s %sgress bpf filter on %s", op, egress ? "e" : "in", ifname);
+    if (!nlh)
+        return -1;
+    rtnl_attr_str(nlh, TCA_KIND, "bpf");
+    opts = rtnl_nest_start(nlh, TCA_OPTIONS);
+    rtnl_attr_u32(nlh, TCA_BPF_FD, prog_fd);
+    rtnl_attr_str(nlh, TCA_BPF_NAME, prog_name);
+    rtnl_attr_u32(nlh, TCA_BPF_FLAGS, TCA_BPF_FLAG_ACT_DIRECT);
+    rtnl_nest_end(nlh, opts);
+    return rtnl_msg_end(nlh);
+}
+
+/* External: queue a direct-action cls_bpf filter for an already loaded program */
+int rtnl_add_bpf_filter(const char *ifname, int ifindex, bool egress, int prio,
+                        int prog_fd, const char *prog_name) {
+    return rtnl_bpf_filter(ifname, ifindex, egress, prio, prog_fd, prog_name,
+                           NLM_F_CREATE | NLM_F_EXCL, "add");
+}
+
+/*
+ * External: queue an in-place program swap of an existing cls_bpf filter.
+ * The filter is changed by handle, cls_bpf publishes the new program with
+ * RCU, so every packet runs either the old or the new program.
+ */
+int rtnl_replace_bpf_filter(const char *ifname, int ifindex, bool egress, int prio,
+                            int prog_fd, const char *prog_name) {
+    return rtnl_bpf_filter(ifname, ifindex, egress, prio, prog_fd, prog_name,
+                           NLM_F_REPLACE, "replace");
+}
+
+/* External: queue a query for the program id attached by a cls_bpf filter */
+int rtnl_get_bpf_filter(const char *ifname, int ifindex, bool egress, int prio,
+                        uint32_t *prog_id) {
+    struct nlmsghdr *nlh;
+    struct tcmsg t;
+
+    *prog_id = 0;
+    rtnl_tcmsg(&t, ifindex, rtnl_filter_parent(egress), IDCLASS_FILTER_HANDLE,
+               TC_H_MAKE(prio << 16, htons(ETH_P_ALL)));
+    nlh = rtnl_msg(RTM_GETTFILTER, 0, &t, sizeof(t), false,
+                   "get %sgress bpf filter on %s", egress ? "e" : "in", ifname);
+    if (!nlh)
+        return -1;
+    rtnl_attr_str(nlh, TCA_KIND, "bpf");
+    if (rtnl_msg_end(nlh))
+        return -1;
+    rtnl_steps[rtnl_n_steps - 1].prog_id = prog_id;
+    return 0;
+}
+
+/* External: queue a match-all u32 filter redirecting ingress traffic to target */
+int rtnl_add_redirect(const char *ifname, int ifindex, int prio, int target) {
+    struct {
+        struct tc_u32_sel sel;
+        struct tc_u32_key key;
+    } sel = {
+        .sel.flags = TC_U32_TERMINAL,
+        .sel.nkeys = 1,
+    };
+    struct tc_mirred mirred = {
+        .action = TC_ACT_STOLEN,
+        .eaction = TCA_EGRESS_REDIR,
+        .ifindex = target,
+    };
+    struct rtattr *opts, *acts, *act, *act_opts;
+    struct nlmsghdr *nlh;
+    struct tcmsg t;
+
+    rtnl_tcmsg(&t, ifindex, rtnl_filter_parent(false), 0,
+               TC_H_MAKE(prio << 16, htons(ETH_P_ALL)));
+    nlh = rtnl_msg(RTM_NEWTFILTER, NLM_F_CREATE | NLM_F_EXCL, &t, sizeof(t), false,
+                   "add mirred redirect on %s", ifname);
+    if (!nlh)
+        return -1;
+    rtnl_attr_str(nlh, TCA_KIND, "u32");
+    opts = rtnl_nest_start(nlh, TCA_OPTIONS);
+    rtnl_attr_u32(nlh, TCA_U32_CLASSID, TC_H_MAKE(1 << 16, 1));
+    rtnl_attr(nlh, TCA_U32_SEL, &sel, sizeof(sel));
+    acts = rtnl_nest_start(nlh, TCA_U32_ACT);
+    act = rtnl_nest_start(nlh, 1);
+    rtnl_attr_str(nlh, TCA_ACT_KIND, "mirred");
+    act_opts = rtnl_nest_start(nlh, TCA_ACT_OPTIONS);
+    rtnl_attr(nlh, TCA_MIRRED_PARMS, &mirred, sizeof(mirred));
+    rtnl_nest_end(nlh, act_opts);
+    rtnl_nest_end(nlh, act);
+    rtnl_nest_end(nlh, acts);
+    rtnl_nest_end(nlh, opts);
+    return rtnl_msg_end(nlh);
+}
+
+/* External: queue creation of an IFB device that is brought up right away */
+int rtnl_add_ifb(const char *ifname) {
+    struct ifinfomsg ifi = {
+        .ifi_family = AF_UNSPEC,
+        .ifi_flags = IFF_UP,
+        .ifi_change = IFF_UP,
+    };
+    struct rtattr *linkinfo;
+    struct nlmsghdr *nlh;
+
+    nlh = rtnl_msg(RTM_NEWLINK, NLM_F_CREATE | NLM_F_EXCL, &ifi, sizeof(ifi), false,
+                   "add ifb %s", ifname);
+    if (!nlh)
+        return -1;
+    rtnl_attr_str(nlh, IFLA_IFNAME, ifname);
+    linkinfo = rtnl_nest_start(nlh, IFLA_LINKINFO);
+    rtnl_attr_str(nlh, IFLA_INFO_KIND, "ifb");
+    rtnl_nest_end(nlh, linkinfo);
+    return rtnl_msg_end(nlh);
+}
+
+/* External: queue deletion of a link by name (missing link is not an error) */
+int rtnl_del_link(const char *ifname) {
+    struct ifinfomsg ifi = { .ifi_family = AF_UNSPEC };
+    struct nlmsghdr *nlh;
+
+    nlh = rtnl_msg(RTM_DELLINK, 0, &ifi, sizeof(ifi), true, "del link %s", ifname);
+    if (!nlh)
+        return -1;
+    rtnl_attr_str(nlh, IFLA_IFNAME, ifname);
+    return rtnl_msg_end(nlh);
+}
+
+/* Helper: parse a tc rate ("100mbit", "20Mbps", bare number = bit/s) into bytes/s */
+static int rtnl_parse_rate(const char *str, uint64_t *rate) {
+    static const struct {
+        const char *unit;
+        double scale;
+    } units[] = {
+        { "", 1. / 8 }, { "bit", 1. / 8 }, { "bps", 1 },
+        { "kbit", 1000. / 8 }, { "mbit", 1000000. / 8 }, { "gbit", 1000000000. / 8 },
+        { "kibit", 1024. / 8 }, { "mibit", 1048576. / 8 }, { "gibit", 1073741824. / 8 },
+        { "kbps", 1000 }, { "mbps", 1000000 }, { "gbps", 1000000000 },
+        { "kibps", 1024 }, { "mibps", 1048576 }, { "gibps", 1073741824 },
+    };
+    char *end;
+    double val;
+    int i;
+
+    val = strtod(str, &end);
+    if (end == str || val < 0)
+        return -1;
+    for (i = 0; i < ARRAY_SIZE(units); i++) {
+        if (strcasecmp(end, units[i].unit))
+            continue;
+        *rate = val * units[i].scale;
+        return 0;
+    }
+    return -1;
+}
+
+/* Helper: parse a tc time ("100ms", "1s", bare number = us) into microseconds */
+static int rtnl_parse_time(const char *str, uint32_t *us) {
+    char *end;
+    double val;
+
+    val = strtod(str, &end);
+    if (end == str || val < 0)
+        return -1;
+    if (!strcasecmp(end, "s") || !strcasecmp(end, "sec") || !strcasecmp(end, "secs"))
+        val *= 1000000;
+    else if (!strcasecmp(end, "ms") || !strcasecmp(end, "msec") || !strcasecmp(end, "msecs"))
+        val *= 1000;
+    else if (*end && strcasecmp(end, "us") && strcasecmp(end, "usec") &&
+             strcasecmp(end, "usecs"))
+        return -1;
+    *us = val;
+    return 0;
+}
+
+/* Helper: parse a tc size ("4mb", "512k", bare number = bytes) */
+static int rtnl_parse_size(const char *str, uint32_t *size) {
+    char *end;
+    double val;
+
+    val = strtod(str, &end);
+    if (end == str || val < 0)
+        return -1;
+    if (!strcasecmp(end, "k") || !strcasecmp(end, "kb"))
+        val *= 1024;
+    else if (!strcasecmp(end, "m") || !strcasecmp(end, "mb"))
+        val *= 1024 * 1024;
+    else if (!strcasecmp(end, "g") || !strcasecmp(end, "gb"))
+        val *= 1024 * 1024 * 1024;
+    else if (*end && strcasecmp(end, "b"))
+        return -1;
+    *size = val;
+    return 0;
+}
+
+/*
+ * External: queue "qdisc add root cake <args>". args uses the tc cake
+ * keywords; returns -1 without queueing anything if it contains a keyword
+ * this parser does not know or the batch is full, so the caller can fall
+ * back to tc.
+ */
+int rtnl_add_cake(const char *ifname, int ifindex, const char *args) {
+    static const struct {
+        const char *name;
+        uint16_t attr;
+        uint32_t val;
+    } keywords[] = {
+        { "besteffort", TCA_CAKE_DIFFSERV_MODE, CAKE_DIFFSERV_BESTEFFORT },
+        { "precedence", TCA_CAKE_DIFFSERV_MODE, CAKE_DIFFSERV_PRECEDENCE },
+        { "diffserv8", TCA_CAKE_DIFFSERV_MODE, CAKE_DIFFSERV_DIFFSERV8 },
+        { "diffserv4", TCA_CAKE_DIFFSERV_MODE, CAKE_DIFFSERV_DIFFSERV4 },
+        { "diffserv3", TCA_CAKE_DIFFSERV_MODE, CAKE_DIFFSERV_DIFFSERV3 },
+        { "flowblind", TCA_CAKE_FLOW_MODE, CAKE_FLOW_NONE },
+        { "srchost", TCA_CAKE_FLOW_MODE, CAKE_FLOW_SRC_IP },
+        { "dsthost", TCA_CAKE_FLOW_MODE, CAKE_FLOW_DST_IP },
+        { "hosts", TCA_CAKE_FLOW_MODE, CAKE_FLOW_HOSTS },
+        { "flows", TCA_CAKE_FLOW_MODE, CAKE_FLOW_FLOWS },
+        { "dual-srchost", TCA_CAKE_FLOW_MODE, CAKE_FLOW_DUAL_SRC },
+        { "dual-dsthost", TCA_CAKE_FLOW_MODE, CAKE_FLOW_DUAL_DST },
+        { "triple-isolate", TCA_CAKE_FLOW_MODE, CAKE_FLOW_TRIPLE },
+        { "ingress", TCA_CAKE_INGRESS, 1 },
+        { "egress", TCA_CAKE_INGRESS, 0 },
+        { "autorate-ingress", TCA_CAKE_AUTORATE, 1 },
+        { "nat", TCA_CAKE_NAT, 1 },
+        { "nonat", TCA_CAKE_NAT, 0 },
+        { "wash", TCA_CAKE_WASH, 1 },
+        { "nowash", TCA_CAKE_WASH, 0 },
+        { "split-gso", TCA_CAKE_SPLIT_GSO, 1 },
+        { "no-split-gso", TCA_CAKE_SPLIT_GSO, 0 },
+        { "ack-filter", TCA_CAKE_ACK_FILTER, CAKE_ACK_FILTER },
+        { "ack-filter-aggressive", TCA_CAKE_ACK_FILTER, CAKE_ACK_AGGRESSIVE },
+        { "no-ack-filter", TCA_CAKE_ACK_FILTER, CAKE_ACK_NONE },
+        { "noatm", TCA_CAKE_ATM, CAKE_ATM_NONE },
+        { "atm", TCA_CAKE_ATM, CAKE_ATM_ATM },
+        { "ptm", TCA_CAKE_ATM, CAKE_ATM_PTM },
+        { "datacentre", TCA_CAKE_RTT, 100 },
+        { "lan", TCA_CAKE_RTT, 1000 },
+        { "metro", TCA_CAKE_RTT, 10000 },
+        { "regional", TCA_CAKE_RTT, 30000 },
+        { "internet", TCA_CAKE_RTT, 100000 },
+        { "oceanic", TCA_CAKE_RTT, 300000 },
+        { "satellite", TCA_CAKE_RTT, 1000000 },
+        { "interplanetary", TCA_CAKE_RTT, 3600000000U },
+    };
+    /* 取值按属性号保存，最后统一写入，后出现的关键字覆盖先出现的 */
+    uint32_t val[__TCA_CAKE_MAX];
+    bool set[__TCA_CAKE_MAX] = {};
+    uint64_t rate = 0;
+    bool rate_set = false;
+    int32_t overhead = 0;
+    bool overhead_set = false, raw = false;
+    char *buf, *tok, *next, *save = NULL;
+    struct nlmsghdr *nlh;
+    struct rtattr *opts;
+    struct tcmsg t;
+    int i, ret = -1;
+
+    buf = strdup(args);
+    if (!buf)
+        return -1;
+
+#define CAKE_SET(_attr, _val) do { val[_attr] = (_val); set[_attr] = true; } while (0)
+    for (tok = strtok_r(buf, " \t", &save); tok; tok = strtok_r(NULL, " \t", &save)) {
+        for (i = 0; i < ARRAY_SIZE(keywords); i++)
+            if (!strcmp(tok, keywords[i].name))
+                break;
+        if (i < ARRAY_SIZE(keywords)) {
+            CAKE_SET(keywords[i].attr, keywords[i].val);
+            continue;
+        }
+
+        if (!strcmp(tok, "unlimited")) {
+            rate = 0;
+            rate_set = true;
+            continue;
+        }
+        if (!strcmp(tok, "raw")) {
+            raw = true;
+            overhead_set = false;
+            continue;
+        }
+        /* 常见链路层封装的组合关键字 */
+        if (!strcmp(tok, "conservative")) {
+            CAKE_SET(TCA_CAKE_ATM, CAKE_ATM_ATM);
+            overhead = 48;
+            overhead_set = true;
+            continue;
+        }
+        if (!strcmp(tok, "ethernet") || !strcmp(tok, "docsis")) {
+            CAKE_SET(TCA_CAKE_ATM, CAKE_ATM_NONE);
+            CAKE_SET(TCA_CAKE_MPU, tok[0] == 'e' ? 84 : 64);
+            overhead = tok[0] == 'e' ? 38 : 18;
+            overhead_set = true;
+            continue;
+        }
+        if (!strcmp(tok, "ether-vlan")) {
+            overhead += 4;
+            overhead_set = true;
+            continue;
+        }
+
+        next = strtok_r(NULL, " \t", &save);
+        if (!next)
+            goto out;
+        if (!strcmp(tok, "bandwidth")) {
+            if (rtnl_parse_rate(next, &rate))
+                goto out;
+            rate_set = true;
+        } else if (!strcmp(tok, "overhead")) {
+            overhead = strtol(next, &tok, 0);
+            if (*tok || overhead < -64 || overhead > 256)
+                goto out;
+            overhead_set = true;
+            raw = false;
+        } else if (!strcmp(tok, "mpu")) {
+            CAKE_SET(TCA_CAKE_MPU, strtoul(next, &tok, 0));
+            if (*tok || val[TCA_CAKE_MPU] > 256)
+                goto out;
+        } else if (!strcmp(tok, "rtt")) {
+            if (rtnl_parse_time(next, &val[TCA_CAKE_RTT]))
+                goto out;
+            set[TCA_CAKE_RTT] = true;
+        } else if (!strcmp(tok, "memlimit")) {
+            if (rtnl_parse_size(next, &val[TCA_CAKE_MEMORY]))
+                goto out;
+            set[TCA_CAKE_MEMORY] = true;
+        } else if (!strcmp(tok, "fwmark")) {
+            CAKE_SET(TCA_CAKE_FWMARK, strtoul(next, &tok, 0));
+            if (*tok)
+                goto out;
+        } else {
+            goto out;
+        }
+    }
+#undef CAKE_SET
+
+    rtnl_tcmsg(&t, ifindex, TC_H_ROOT, 0, 0);
+    nlh = rtnl_msg(RTM_NEWQDISC, NLM_F_CREATE | NLM_F_EXCL, &t, sizeof(t), false,
+                   "add cake on %s", ifname);
+    if (!nlh)
+        goto out;
+    rtnl_attr_str(nlh, TCA_KIND, "cake");
+    opts = rtnl_nest_start(nlh, TCA_OPTIONS);
+    if (rate_set)
+        rtnl_attr(nlh, TCA_CAKE_BASE_RATE64, &rate, sizeof(rate));
+    for (i = 0; i < __TCA_CAKE_MAX; i++)
+        if (set[i])
+            rtnl_attr_u32(nlh, i, val[i]);
+    if (overhead_set)
+        rtnl_attr(nlh, TCA_CAKE_OVERHEAD, &overhead, sizeof(overhead));
+    if (raw)
+        rtnl_attr(nlh, TCA_CAKE_RAW, NULL, 0);
+    rtnl_nest_end(nlh, opts);
+    ret = rtnl_msg_end(nlh);
+
+out:
+    free(buf);
+    return ret;
+}
+
+/* Helper: record the ack/error for the step with the given sequence number */
+static void rtnl_batch_ack(uint32_t seq, int error, int *pending) {
+    int i;
+
+    for (i = 0; i < rtnl_n_steps; i++) {
+        if (rtnl_steps[i].seq != seq)
+            continue;
+        rtnl_steps[i].error = -error;
+        (*pending)--;
+        return;
+    }
+}
+
+/* Helper: store TCA_BPF_ID of a filter query reply in its step */
+static void rtnl_batch_filter_reply(struct nlmsghdr *nlh) {
+    struct tcmsg *t = NLMSG_DATA(nlh);
+    struct rtattr *rta, *opt;
+    int len, olen, i;
+
+    for (i = 0; i < rtnl_n_steps; i++)
+        if (rtnl_steps[i].seq == nlh->nlmsg_seq)
+            break;
+    if (i == rtnl_n_steps || !rtnl_steps[i].prog_id)
+        return;
+
+    len = nlh->nlmsg_len - NLMSG_LENGTH(sizeof(*t));
+    for (rta = TCA_RTA(t); RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+        if (rta->rta_type != TCA_OPTIONS)
+            continue;
+        olen = RTA_PAYLOAD(rta);
+        for (opt = RTA_DATA(rta); RTA_OK(opt, olen); opt = RTA_NEXT(opt, olen)) {
+            if (opt->rta_type == TCA_BPF_ID)
+                *rtnl_steps[i].prog_id = *(uint32_t *)RTA_DATA(opt);
+        }
+    }
+}
+
+/*
+ * Helper: wait briefly for more acknowledgements. rtnetlink handles the
+ * requests inside sendmsg(), so the acks are normally queued already and
+ * this only bounds how long a lost ack can hold up the main loop.
+ */
+static bool rtnl_batch_wait(void) {
+    struct pollfd pfd = { .fd = rtnl_fd, .events = POLLIN };
+    int ret;
+
+    do {
+        ret = poll(&pfd, 1, RTNL_ACK_TIMEOUT_MS);
+    } while (ret < 0 && errno == EINTR);
+    return ret > 0;
+}
+
+/*
+ * External: send the queued batch and wait for all acknowledgements.
+ * Failed steps are logged by name; returns the number of failed or dropped
+ * steps that were not marked as allowed to fail, or -1 if the batch could
+ * not be sent.
+ */
+int rtnl_batch_commit(void) {
+    struct sockaddr_nl sa = { .nl_family = AF_NETLINK };
+    char buf[8192] __attribute__((aligned(NLMSG_ALIGNTO)));
+    int pending = rtnl_n_steps;
+    int failed = rtnl_dropped;
+    ssize_t len;
+    int i;
+
+    if (!rtnl_n_steps) {
+        rtnl_batch_begin();
+        return failed;
+    }
+
+    if (sendto(rtnl_fd, rtnl_buf, rtnl_len, 0, (struct sockaddr *)&sa, sizeof(sa)) < 0) {
+        ULOG_ERR("Failed to send rtnetlink batch: %s\n", strerror(errno));
+        rtnl_batch_begin();
+        return -1;
+    }
+
+    /* 内核按顺序处理消息，每条消息都有一个 NLMSG_ERROR 应答 */
+    while (pending > 0) {
+        struct nlmsghdr *nlh;
+
+        len = recv(rtnl_fd, buf, sizeof(buf), MSG_DONTWAIT);
+        if (len < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN && rtnl_batch_wait())
+                continue;
+            ULOG_ERR("Failed to read rtnetlink acks (%d missing): %s\n",
+                     pending, errno == EAGAIN ? "timeout" : strerror(errno));
+            break;
+        }
+
+        for (nlh = (struct nlmsghdr *)buf; NLMSG_OK(nlh, len); nlh = NLMSG_NEXT(nlh, len)) {
+            struct nlmsgerr *err = NLMSG_DATA(nlh);
+
+            if (nlh->nlmsg_type == RTM_NEWTFILTER)
+                rtnl_batch_filter_reply(nlh);
+            if (nlh->nlmsg_type != NLMSG_ERROR)
+                continue;
+            rtnl_batch_ack(nlh->nlmsg_seq, err->error, &pending);
+        }
+    }
+
+    for (i = 0; i < rtnl_n_steps; i++) {
+        struct rtnl_step *step = &rtnl_steps[i];
+
+        if (!step->error || step->ignore_error)
+            continue;
+        ULOG_ERR("%s: %s\n", step->name, strerror(step->error));
+        failed++;
+    }
+    if (pending > 0)
+        failed += pending;
+
+    rtnl_batch_begin();
+    return failed;
+}
+
+/* External: open the rtnetlink socket */
+int rtnl_batch_init(void) {
+    struct sockaddr_nl sa = { .nl_family = AF_NETLINK };
+
+    rtnl_fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+    if (rtnl_fd < 0) {
+        ULOG_ERR("Failed to create rtnetlink socket: %s\n", strerror(errno));
+        return -1;
+    }
+    if (bind(rtnl_fd, (struct sockaddr *)&sa, sizeof(sa)) < 0) {
+        ULOG_ERR("Failed to bind rtnetlink socket: %s\n", strerror(errno));
+        close(rtnl_fd);
+        rtnl_fd = -1;
+        return -1;
+    }
+    rtnl_batch_begin();
+    return 0;
+}
+
+/* External: close the rtnetlink socket */
+void rtnl_batch_stop(void) {
+    if (rtnl_fd < 0)
+        return;
+    close(rtnl_fd);
+    rtnl_fd = -1;
+}
@@ -30,20 +30,12 @@ static int ubus_add_array(struct blob_attr *attr, uint8_t val, enum idclass_map_
     return 0;
 }
 
-/* 内部辅助函数：设置文件列表 */
+/* 内部辅助函数：设置文件列表（未变化的文件不重新解析） */
 static int ubus_set_files(struct blob_attr *attr) {
-    struct blob_attr *cur;
-    int rem;
-
-    if (blobmsg_check_array(attr, BLOBMSG_TYPE_STRING) < 0)
+    if (attr && blobmsg_check_array(attr, BLOBMSG_TYPE_STRING) < 0)
         return UBUS_STATUS_INVALID_ARGUMENT;
 
-    map_manager_clear_files();
-
-    blobmsg_for_each_attr(cur, attr, rem)
-        map_manager_load_file(blobmsg_get_string(cur));
-
-    map_manager_gc();
+    map_manager_set_files(attr);
     return 0;
 }
 
@@ -216,6 +208,11 @@ enum {
     CL_CONFIG_ENABLE_TCP_WINDOW,
     CL_CONFIG_ENABLE_TCP_MSS,
     CL_CONFIG_ENABLE_TCP_RTT,
+    CL_CONFIG_HIST_BIMODAL_PCT,
+    CL_CONFIG_HIST_PERIODIC_PCT,
+    CL_CONFIG_WEIGHT_HIST_VIDEO,
+    CL_CONFIG_WEIGHT_HIST_REALTIME,
+    CL_CONFIG_ENABLE_HIST,
     __CL_CONFIG_MAX
 };
 
@@ -312,6 +309,11 @@ static const struct blobmsg_policy config_policy[__CL_CONFIG_MAX] = {
     [CL_CONFIG_ENABLE_TCP_WINDOW] = { "enable_tcp_window", BLOBMSG_TYPE_BOOL },
     [CL_CONFIG_ENABLE_TCP_MSS]    = { "enable_tcp_mss",    BLOBMSG_TYPE_BOOL },
     [CL_CONFIG_ENABLE_TCP_RTT]    = { "enable_tcp_rtt",    BLOBMSG_TYPE_BOOL },
+    [CL_CONFIG_HIST_BIMODAL_PCT]  = { "hist_bimodal_pct",  BLOBMSG_TYPE_INT32 },
+    [CL_CONFIG_HIST_PERIODIC_PCT] = { "hist_periodic_pct", BLOBMSG_TYPE_INT32 },
+    [CL_CONFIG_WEIGHT_HIST_VIDEO]    = { "weight_hist_video",    BLOBMSG_TYPE_INT32 },
+    [CL_CONFIG_WEIGHT_HIST_REALTIME] = { "weight_hist_realtime", BLOBMSG_TYPE_INT32 },
+    [CL_CONFIG_ENABLE_HIST]       = { "enable_hist",       BLOBMSG_TYPE_BOOL },
 };
 
 static int ubus_config(struct ubus_context *ctx, struct ubus_object *obj,
@@ -338,8 +340,9 @@ static int ubus_config(struct ubus_context *ctx, struct ubus_object *obj,
     if ((cur = tb[CL_CONFIG_TIMEOUT]) != NULL)
         idclass_map_timeout = blobmsg_get_u32(cur);
 
-    if ((cur = tb[CL_CONFIG_FILES]) != NULL &&
-        (ret = ubus_set_files(cur) != 0))
+    /* reset 时没有给出文件列表即清空文件条目 */
+    if (((cur = tb[CL_CONFIG_FILES]) != NULL || reset) &&
+        (ret = ubus_set_files(cur)) != 0)
         return ret;
 
     if (config_parse_dscp_value(&global_config.dscp_icmp, tb[CL_CONFIG_DSCP_ICMP], reset))
@@ -380,6 +383,7 @@ static int ubus_status(struct ubus_context *ctx, struct ubus_object *obj,
                        struct blob_attr *msg) {
     blob_buf_init(&b, 0);
     interface_status(&b);
+    blobmsg_add_u32(&b, "bpf_load_us", ebpf_loader_get_load_time());
     ubus_send_reply(ctx, req, b.head);
     blob_buf_free(&b);
     return 0;
@@ -403,6 +407,33 @@ static int ubus_get_stats(struct ubus_context *ctx, struct ubus_object *obj,
     return 0;
 }
 
+/* ubus 方法: flows（导出流的包长/包间隔直方图，用于调参） */
+enum {
+    FLOWS_LIMIT,
+    __FLOWS_MAX
+};
+
+static const struct blobmsg_policy flows_policy[__FLOWS_MAX] = {
+    [FLOWS_LIMIT] = { "limit", BLOBMSG_TYPE_INT32 },
+};
+
+static int ubus_flows(struct ubus_context *ctx, struct ubus_object *obj,
+                      struct ubus_request_data *req, const char *method,
+                      struct blob_attr *msg) {
+    struct blob_attr *tb[__FLOWS_MAX];
+    uint32_t limit = 256;
+
+    blobmsg_parse(flows_policy, __FLOWS_MAX, tb, blobmsg_data(msg), blobmsg_len(msg));
+    if (tb[FLOWS_LIMIT])
+        limit = blobmsg_get_u32(tb[FLOWS_LIMIT]);
+
+    blob_buf_init(&b, 0);
+    map_manager_flows(&b, limit);
+    ubus_send_reply(ctx, req, b.head);
+    blob_buf_free(&b);
+    return 0;
+}
+
 /* ubus 方法: check_devices */
 static int ubus_check_devices(struct ubus_context *ctx, struct ubus_object *obj,
                               struct ubus_request_data *req, const char *method,
@@ -462,6 +493,7 @@ static const struct ubus_method idclass_methods[] = {
     UBUS_METHOD_NOARG("dump", ubus_dump),
     UBUS_METHOD_NOARG("status", ubus_status),
     UBUS_METHOD_NOARG("get_stats", ubus_get_stats),
+    UBUS_METHOD("flows", ubus_flows, flows_policy),
     UBUS_METHOD("add_dns_host", ubus_add_dns_host, dns_policy),
     UBUS_METHOD_NOARG("check_devices", ubus_check_devices),
 };
@@ -469,9 +501,15 @@ static const struct ubus_method idclass_methods[] = {
 static struct ubus_object_type idclass_object_type =
     UBUS_OBJECT_TYPE("idclass", idclass_methods);
 
+/* 有订阅者时才让数据路径产生事件 */
+static void ubus_subscribe_cb(struct ubus_context *ctx, struct ubus_object *obj) {
+    event_stream_set_subscribed(obj->has_subscribers);
+}
+
 static struct ubus_object idclass_object = {
     .name = "idclass",
     .type = &idclass_object_type,
+    .subscribe_cb = ubus_subscribe_cb,
     .methods = idclass_methods,
     .n_methods = ARRAY_SIZE(idclass_methods),
 };
@@ -538,6 +576,13 @@ void ubus_server_update_bridger(bool shutdown) {
     ubus_invoke_async(&conn.ctx, id, "set_blacklist", b.head, &req);
 }
 
+/* 外部接口：向 idclass 对象的订阅者发送事件 */
+void ubus_server_notify(const char *type, struct blob_attr *msg) {
+    if (!idclass_object.has_subscribers)
+        return;
+    ubus_notify(&conn.ctx, &idclass_object, type, msg, -1);
+}
+
 /* 外部接口：检查逻辑接口对应的物理设备 */
 struct iface_req {
     char *name;